@@ -9,9 +9,18 @@
  */
 
 #include <sys/types.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/kernel.h>
+#include <sys/pcpu.h>
+#include <sys/petri_trace.h>
 #include <sys/sched_petri.h>
 #include <sys/syslog.h>
 #include <sys/malloc.h>
+#include <machine/atomic.h>
+
+/* matrices and firing functions of the cpu subnet, built from kern/petri_net.def */
+#include "petri_cpu_net.h"
 
 int CPU_NUMBER;
 int CPU_NUMBER_PLACES;
@@ -23,306 +32,2104 @@ int PLACE_SMP_READY;
 int TRAN_REMOVE_GLOBAL_QUEUE;
 int TRAN_START_SMP;
 int TRAN_QUEUE_GLOBAL;
+int GLOBAL_QUEUES;
+int *global_queue_per_cpu = NULL;
+cpuset_t *global_queue_cpus = NULL;
+
+/* operations of fire_word() on a marking word */
+#define PETRI_WORD_FIRE		0
+#define PETRI_WORD_CONSUME	1
+#define PETRI_WORD_PRODUCE	2
+#define PETRI_WORD_RESTORE	3
+#define PETRI_WORD_APPLY	4	/* PETRI_WORD_FIRE without checking the arcs */
+
+/*
+ * the hooks are meant to fire only transitions their own state enables.
+ * nothing proves it, petri_analyze only checks properties of the net, so
+ * INVARIANTS kernels check every firing of a hook and report the ones not
+ * sensitized. production kernels apply the others unchecked but still
+ * check the ones of PETRI_CHECKED_TRANSITIONS, which race with the state
+ * of other cpus: ADDTOQUEUE with a suspend, EXEC_IDLE with a thread queued
+ */
+#ifdef INVARIANTS
+#define PETRI_CHECK_HOOK_FIRINGS	1
+#else
+#define PETRI_CHECK_HOOK_FIRINGS	0
+#endif
+#define PETRI_CHECKED_TRANSITIONS	((1u << TRAN_ADDTOQUEUE) | (1u << TRAN_EXEC_IDLE))
+
+int print = 0;
+int petri_interpreted = 0;
+int petri_wake_affine = 2;
+int petri_pack = 0;
+int petri_pack_wait = 1000;
+void (*petri_drain_cpu)(int cpu_n) = NULL;
+void (*petri_lock_cpu)(int cpu_n) = NULL;
+void (*petri_unlock_cpu)(int cpu_n) = NULL;
+volatile u_int smp_set = 0;
+struct petri_cpu_resource_net *resource_net;
+int *monopolized_cpus_per_proc = NULL;
+/* cpus monopolized by some process, mirrors monopolized_cpus_per_proc */
+cpuset_t monopolized_cpus;
+/* where resource_choose_cpu() starts looking on each cpu, so choices rotate */
+DPCPU_DEFINE_STATIC(int, choose_rotor);
+/* average run queue wait in us and whether it stopped packing, see resource_pack_waited() */
+static volatile int pack_wait_avg;
+static volatile bool pack_spreading;
+/* the load and the active cpus pack_applies() compares, and the tick they were counted on */
+static volatile int pack_load;
+static volatile int pack_active;
+static volatile int pack_tick;
+
+/* arcs collected while building the net, compiled by compile_resource_net() */
+struct petri_build_arc {
+	int place;
+	int transition;
+	int weight;
+	bool inhibitor;
+};
+
+static struct petri_build_arc *build_arcs;
+static int build_arcs_number;
+
+/* image init_resource_net() builds the net from, the built-in one when NULL */
+static const struct petri_net_image *boot_image = NULL;
+
+/* thread net transition fired along with each base transition of a cpu */
+const int8_t base_hierarchical_transitions[CPU_BASE_TRANSITIONS] = {
+	[TRAN_ADDTOQUEUE]		= TRAN_ON_QUEUE,
+	[TRAN_EXEC]				= TRAN_SET_RUNNING,
+	[TRAN_EXEC_IDLE]		= TRAN_ON_QUEUE,
+	[TRAN_FROM_GLOBAL_CPU]	= NO_HIERARCHICAL_TRANSITION,
+	[TRAN_REMOVE_QUEUE]		= TRAN_REMOVE,
+	[TRAN_RETURN_INVOL]		= TRAN_SWITCH_OUT,
+	[TRAN_RETURN_VOL]		= TRAN_TO_WAIT_CHANNEL,
+	[TRAN_SUSPEND_PROC]		= NO_HIERARCHICAL_TRANSITION,
+	[TRAN_UNQUEUE]			= NO_HIERARCHICAL_TRANSITION,
+	[TRAN_WAKEUP_PROC]		= NO_HIERARCHICAL_TRANSITION
+};
+
+/* thread net transition of every global transition of the built-in net */
+static const int8_t builtin_global_hierarchical_transitions[GLOBAL_TRANSITIONS] = {
+	[GLOBAL_TRAN_REMOVE_QUEUE]	= TRAN_REMOVE,
+	[GLOBAL_TRAN_START_SMP]		= NO_HIERARCHICAL_TRANSITION,
+	[GLOBAL_TRAN_QUEUE]			= TRAN_ON_QUEUE
+};
+
+/* the global queue counts threads, the smp places never hold more than one
+ * token and are read by local transitions of every cpu, so they are kept
+ * away from the global queue. smp starts not ready */
+static const struct petri_net_image_place builtin_global_places[GLOBAL_PLACES] = {
+	[GLOBAL_PLACE_QUEUE]			= { .pnp_block = 0 },
+	[GLOBAL_PLACE_SMP_NOT_READY]	= { .pnp_flags = PETRI_NET_PLACE_SAFE, .pnp_block = 1, .pnp_tokens = 1 },
+	[GLOBAL_PLACE_SMP_READY]		= { .pnp_flags = PETRI_NET_PLACE_SAFE, .pnp_block = 1 }
+};
+
+/* arcs of the built-in net over the global places */
+static const struct petri_net_image_arc builtin_global_arcs[] = {
+	//incidence between each cpu and global resources
+	{ GLOBAL_PLACE_QUEUE, TRAN_FROM_GLOBAL_CPU, -1, PETRI_NET_ARC_GLOBAL_PLACE },
+	//inhibit executing to cpus other than 0 because smp hasnt started
+	{ GLOBAL_PLACE_SMP_NOT_READY, TRAN_FROM_GLOBAL_CPU, 1,
+	    PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_INHIBITOR | PETRI_NET_ARC_SECONDARY },
+	{ GLOBAL_PLACE_SMP_NOT_READY, TRAN_EXEC, 1,
+	    PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_INHIBITOR | PETRI_NET_ARC_SECONDARY },
+	//inhibit smp execution when not ready
+	{ GLOBAL_PLACE_SMP_NOT_READY, TRAN_ADDTOQUEUE, 1, PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_INHIBITOR },
+	//Transition to remove from global queue
+	{ GLOBAL_PLACE_QUEUE, GLOBAL_TRAN_REMOVE_QUEUE, -1, PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_GLOBAL_TRANSITION },
+	//Represents arc to queue on the global queue
+	{ GLOBAL_PLACE_QUEUE, GLOBAL_TRAN_QUEUE, 1, PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_GLOBAL_TRANSITION },
+	//Transitions to go from smp not ready to ready
+	{ GLOBAL_PLACE_SMP_NOT_READY, GLOBAL_TRAN_START_SMP, -1, PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_GLOBAL_TRANSITION },
+	{ GLOBAL_PLACE_SMP_READY, GLOBAL_TRAN_START_SMP, 1, PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_GLOBAL_TRANSITION }
+};
+
+/* thread net transition of every transition of the resource net, indexed directly */
+int8_t *hierarchical_transitions = NULL;
+
+/* names of the base and global transitions, see transition_name() */
+static const char *base_transitions_names[CPU_BASE_TRANSITIONS] = {
+	"ADDTOQUEUE", "EXEC", "EXEC_IDLE", "FROM_GLOBAL_CPU", "REMOVE_QUEUE", "RETURN_INVOL",
+	"RETURN_VOL", "SUSPEND_PROC", "UNQUEUE", "WAKEUP_PROC"
+};
+static const char *global_transitions_names[GLOBAL_TRANSITIONS] = {
+	"REMOVE_GLOBAL_QUEUE", "START_SMP", "QUEUE_GLOBAL"
+};
+
+const char *cpu_places_names[] = { "CPU", "EXECUTING", "QUEUE", "SUSPENDED", "TOEXEC" };
+
+static const char *transition_name(int transition_index, char *buf, size_t size);
+static bool resource_fire_single_transition(struct thread *pt, int transition_index, char *func, bool checked);
+static bool fire_transition(int transition_index);
+static void apply_transition(int transition_index);
+static bool fire_word(volatile uint64_t *word, int cpu_n, struct petri_word_arcs *word_arcs, int op);
+static bool fire_local_transition(int cpu_n, int base_transition, bool checked);
+static void trace_firing(struct thread *pt, int transition_index);
+static void trace_record(u_int kind, lwpid_t tid, int transition, int block, uint64_t mark);
+static bool word_next_mark(struct petri_word_arcs *word_arcs, int op, uint64_t mark, uint64_t *next);
+static bool word_arcs_are_sensitized(struct petri_word_arcs *word_arcs, uint64_t mark);
+static bool coordinator_arcs_are_sensitized(int transition_index);
+static uint64_t local_mark_refresh(uint64_t mark, uint64_t next);
+static uint64_t local_mark_enabled(uint64_t mark, u_int rescan);
+static void publish_enabled(int cpu_n, u_int changed);
+static void publish_marked(int cpu_n, u_int changed);
+static void set_place_tokens(struct petri_cpu_resource_net *net, int place, int tokens);
+static int resource_net_place_tokens(struct petri_cpu_resource_net *net, int place);
+static void publish_idle(int cpu_n, int base_transition);
+int get_monopolized_cpu_by_proc_id(int proc_id);
+bool toggle_active_cpu(int cpu, bool turn_off);
+bool toggle_pin_cpu_to_proc(int proc_id, int cpu, bool release);
+struct petri_cpu_resource_net *allocate_resource_net(size_t image_size);
+void compile_coordinator(struct petri_cpu_resource_net *net);
+void compile_marking(struct petri_cpu_resource_net *net, const struct petri_net_image *image);
+void compile_resource_net(struct petri_cpu_resource_net *net, const struct petri_net_image *image);
+void compile_subnet(struct petri_cpu_resource_net *net);
+void init_enabled(struct petri_cpu_resource_net *net);
+void init_global_resources(void);
+void init_global_variables(void);
+static void init_global_queues(void);
+static void init_topology(cpuset_t *groups, int16_t *group_of);
+static int topology_groups(struct cpu_group *cg);
+void init_hierarchical_transitions(struct petri_cpu_resource_net *net, const struct petri_net_image *image);
+void init_resource_mark(struct petri_cpu_resource_net *net, const struct petri_net_image *image);
+void print_resource_net(void);
+
+/* this is needed because mp_ncpus is set at runtime */
+void
+init_global_variables(void)
+{
+
+	CPU_NUMBER 						= mp_ncpus;
+	init_global_queues();
+	CPU_NUMBER_PLACES 				= (CPU_BASE_PLACES*CPU_NUMBER) + GLOBAL_PLACES + GLOBAL_QUEUES - 1;
+	CPU_NUMBER_TRANSITIONS 			= (CPU_BASE_TRANSITIONS*CPU_NUMBER) + GLOBAL_TRANSITIONS + 2 * (GLOBAL_QUEUES - 1);
+	PER_CPU_LAST_TRANSITION	 		= (CPU_BASE_TRANSITIONS*CPU_NUMBER);
+	PLACE_GLOBAL_QUEUE 				= (CPU_BASE_PLACES*CPU_NUMBER) + GLOBAL_PLACE_QUEUE;
+	PLACE_SMP_NOT_READY 			= (CPU_BASE_PLACES*CPU_NUMBER) + GLOBAL_PLACE_SMP_NOT_READY;
+	PLACE_SMP_READY 				= (CPU_BASE_PLACES*CPU_NUMBER) + GLOBAL_PLACE_SMP_READY;
+	TRAN_REMOVE_GLOBAL_QUEUE 		= PER_CPU_LAST_TRANSITION + GLOBAL_TRAN_REMOVE_QUEUE;
+	TRAN_START_SMP 					= PER_CPU_LAST_TRANSITION + GLOBAL_TRAN_START_SMP;
+	TRAN_QUEUE_GLOBAL 				= PER_CPU_LAST_TRANSITION + GLOBAL_TRAN_QUEUE;
+
+	smp_set = 0;
+}
+
+/**
+ * one global queue for the cpus of every last level cache group of the
+ * topology, numbered from the one of cpu 0
+*/
+static void
+init_global_queues(void)
+{
+	cpuset_t *groups;
+	int16_t *group_of;
+	int *queue_of_group, groups_number, group, queue;
+
+	groups_number = topology_groups(smp_topo());
+	groups = (cpuset_t *)init_pointer(groups_number * sizeof(cpuset_t));
+	group_of = (int16_t *)init_pointer(CPU_NUMBER * PETRI_TOPO_LEVELS * sizeof(int16_t));
+	queue_of_group = (int *)init_pointer(groups_number * sizeof(int));
+	init_topology(groups, group_of);
+
+	if (global_queue_per_cpu != NULL) {
+		free(global_queue_per_cpu, M_DEVBUF);
+		free(global_queue_cpus, M_DEVBUF);
+	}
+	global_queue_per_cpu = (int *)init_pointer(CPU_NUMBER * sizeof(int));
+	global_queue_cpus = (cpuset_t *)init_pointer(CPU_NUMBER * sizeof(cpuset_t));
+	memset(queue_of_group, -1, groups_number * sizeof(int));
+
+	GLOBAL_QUEUES = 0;
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		group = group_of[cpu_n * PETRI_TOPO_LEVELS + PETRI_TOPO_LLC];
+		if (queue_of_group[group] == -1)
+			queue_of_group[group] = GLOBAL_QUEUES++;
+		queue = queue_of_group[group];
+		global_queue_per_cpu[cpu_n] = queue;
+		CPU_SET(cpu_n, &global_queue_cpus[queue]);
+	}
+
+	free(queue_of_group, M_DEVBUF);
+	free(group_of, M_DEVBUF);
+	free(groups, M_DEVBUF);
+}
+
+static void
+add_arc(int place, int transition, int weight)
+{
+
+	build_arcs[build_arcs_number].place = place;
+	build_arcs[build_arcs_number].transition = transition;
+	build_arcs[build_arcs_number].weight = weight;
+	build_arcs[build_arcs_number].inhibitor = false;
+	build_arcs_number++;
+}
+
+static void
+add_inhibitor_arc(int place, int transition)
+{
+
+	build_arcs[build_arcs_number].place = place;
+	build_arcs[build_arcs_number].transition = transition;
+	build_arcs[build_arcs_number].weight = 1;
+	build_arcs[build_arcs_number].inhibitor = true;
+	build_arcs_number++;
+}
+
+static void
+add_image_arc(int place, int transition, const struct petri_net_image_arc *arc)
+{
+
+	if (arc->pna_flags & PETRI_NET_ARC_INHIBITOR)
+		add_inhibitor_arc(place, transition);
+	else
+		add_arc(place, transition, arc->pna_weight);
+}
+
+/**
+ * the built-in net as an image: the cpu template of petri_net.def and the
+ * global part above. the caller frees it
+*/
+struct petri_net_image *
+petri_net_builtin_image(size_t *size)
+{
+	struct petri_net_image *image;
+	struct petri_net_image_arc *arc;
+
+	image = (struct petri_net_image *)init_pointer(PETRI_NET_IMAGE_SIZE(PETRI_NET_IMAGE_ARCS));
+	image->pni_magic = PETRI_NET_IMAGE_MAGIC;
+	image->pni_version = PETRI_NET_IMAGE_VERSION;
+	image->pni_cpu_places = CPU_BASE_PLACES;
+	image->pni_cpu_transitions = CPU_BASE_TRANSITIONS;
+	image->pni_global_places = GLOBAL_PLACES;
+	image->pni_global_transitions = GLOBAL_TRANSITIONS;
+	strlcpy(image->pni_name, "default", sizeof(image->pni_name));
+
+	for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++)
+		if (petri_cpu_safe[num_place])
+			image->pni_cpu_place[num_place].pnp_flags = PETRI_NET_PLACE_SAFE;
+	//cpu 0 starts executing, others start available
+	image->pni_cpu_place[PLACE_EXECUTING].pnp_boot_tokens = 1;
+	image->pni_cpu_place[PLACE_CPU].pnp_tokens = 1;
+	memcpy(image->pni_global_place, builtin_global_places, sizeof(builtin_global_places));
+
+	memcpy(image->pni_cpu_map, base_hierarchical_transitions, sizeof(base_hierarchical_transitions));
+	memcpy(image->pni_global_map, builtin_global_hierarchical_transitions,
+	    sizeof(builtin_global_hierarchical_transitions));
+
+	arc = image->pni_arc;
+	for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++) {
+		for (int num_transition = 0; num_transition < CPU_BASE_TRANSITIONS; num_transition++) {
+			if (petri_cpu_incidence[num_place][num_transition] != 0)
+				*arc++ = (struct petri_net_image_arc){ num_place, num_transition,
+				    petri_cpu_incidence[num_place][num_transition], 0 };
+			if (petri_cpu_inhibition[num_place][num_transition] == 1)
+				*arc++ = (struct petri_net_image_arc){ num_place, num_transition, 1,
+				    PETRI_NET_ARC_INHIBITOR };
+		}
+	}
+	memcpy(arc, builtin_global_arcs, sizeof(builtin_global_arcs));
+	arc += nitems(builtin_global_arcs);
+
+	image->pni_arcs = arc - image->pni_arc;
+	*size = PETRI_NET_IMAGE_SIZE(image->pni_arcs);
+
+	return image;
+}
+
+static int
+image_error(const char *reason, int index)
+{
+
+	log(LOG_WARNING, "(resource_net) net image: %s (%d)\n", reason, index);
+
+	return EINVAL;
+}
+
+/* whether the 1-safe and the counting places of a block fit its marking word */
+static int
+image_block_fits(const struct petri_net_image_place *places, int count, bool global, int block)
+{
+	int safe = 0, counters = 0;
+
+	for (int num_place = 0; num_place < count; num_place++) {
+		if (global && places[num_place].pnp_block != block)
+			continue;
+		if (places[num_place].pnp_flags & PETRI_NET_PLACE_SAFE) {
+			if (places[num_place].pnp_tokens > 1 || places[num_place].pnp_boot_tokens > 1)
+				return -1;
+			safe++;
+		} else
+			counters++;
+	}
+
+	return (safe <= PETRI_SAFE_BITS && counters <= PETRI_BLOCK_COUNTERS) ? 0 : -1;
+}
+
+/**
+ * check that image of size bytes describes a net this kernel can build:
+ * the places and transitions of the built-in one, arcs between existing
+ * places and transitions, and markings that fit their packed blocks
+*/
+int
+petri_net_image_check(const struct petri_net_image *image, size_t size)
+{
+	const struct petri_net_image_arc *arc;
+	const struct petri_net_image_place *place;
+	bool global_place, global_transition;
+
+	if (size < sizeof(*image) || image->pni_magic != PETRI_NET_IMAGE_MAGIC)
+		return image_error("bad magic", 0);
+	if (image->pni_version != PETRI_NET_IMAGE_VERSION)
+		return image_error("unsupported version", image->pni_version);
+	if (image->pni_arcs > PETRI_NET_IMAGE_ARCS || size != PETRI_NET_IMAGE_SIZE(image->pni_arcs))
+		return image_error("size does not match the arcs", image->pni_arcs);
+	if (image->pni_cpu_places != CPU_BASE_PLACES || image->pni_cpu_transitions != CPU_BASE_TRANSITIONS ||
+	    image->pni_global_places != GLOBAL_PLACES || image->pni_global_transitions != GLOBAL_TRANSITIONS)
+		return image_error("places or transitions differ from the built-in net", 0);
+	if (memchr(image->pni_name, '\0', sizeof(image->pni_name)) == NULL)
+		return image_error("name is not terminated", 0);
+
+	if (image_block_fits(image->pni_cpu_place, CPU_BASE_PLACES, false, 0) != 0)
+		return image_error("cpu places do not fit a block", 0);
+	for (int num_place = 0; num_place < GLOBAL_PLACES; num_place++)
+		if (image->pni_global_place[num_place].pnp_block >= PETRI_COORDINATOR_BLOCKS)
+			return image_error("global place in a missing block", num_place);
+	for (int block = 0; block < PETRI_COORDINATOR_BLOCKS; block++)
+		if (image_block_fits(image->pni_global_place, GLOBAL_PLACES, true, block) != 0)
+			return image_error("global places do not fit block", block);
+
+	for (int num_transition = 0; num_transition < CPU_BASE_TRANSITIONS; num_transition++)
+		if (image->pni_cpu_map[num_transition] < NO_HIERARCHICAL_TRANSITION ||
+		    image->pni_cpu_map[num_transition] >= THREADS_TRANSITIONS_SIZE)
+			return image_error("bad thread transition of cpu transition", num_transition);
+	for (int num_transition = 0; num_transition < GLOBAL_TRANSITIONS; num_transition++)
+		if (image->pni_global_map[num_transition] < NO_HIERARCHICAL_TRANSITION ||
+		    image->pni_global_map[num_transition] >= THREADS_TRANSITIONS_SIZE)
+			return image_error("bad thread transition of global transition", num_transition);
+
+	for (int i = 0; i < image->pni_arcs; i++) {
+		arc = &image->pni_arc[i];
+		global_place = (arc->pna_flags & PETRI_NET_ARC_GLOBAL_PLACE) != 0;
+		global_transition = (arc->pna_flags & PETRI_NET_ARC_GLOBAL_TRANSITION) != 0;
+
+		if (arc->pna_place >= (global_place ? GLOBAL_PLACES : CPU_BASE_PLACES) ||
+		    arc->pna_transition >= (global_transition ? GLOBAL_TRANSITIONS : CPU_BASE_TRANSITIONS))
+			return image_error("arc to a missing place or transition", i);
+		if (!global_place && global_transition)
+			return image_error("arc from a cpu place to a global transition", i);
+		if ((arc->pna_flags & PETRI_NET_ARC_SECONDARY) && (!global_place || global_transition))
+			return image_error("secondary arc not between a global place and a cpu", i);
+		if (global_place && arc->pna_place == GLOBAL_PLACE_QUEUE && global_transition &&
+		    arc->pna_transition != GLOBAL_TRAN_REMOVE_QUEUE && arc->pna_transition != GLOBAL_TRAN_QUEUE)
+			return image_error("global queue arc to a transition not repeated per queue", i);
+
+		place = global_place ? &image->pni_global_place[arc->pna_place] : &image->pni_cpu_place[arc->pna_place];
+		if (arc->pna_flags & PETRI_NET_ARC_INHIBITOR) {
+			if (arc->pna_weight != 1)
+				return image_error("inhibitor arc with a weight", i);
+		} else if (arc->pna_weight == 0 ||
+		    ((place->pnp_flags & PETRI_NET_PLACE_SAFE) && (arc->pna_weight < -1 || arc->pna_weight > 1)))
+			return image_error("bad arc weight", i);
+	}
+
+	return 0;
+}
+
+/**
+ * build the net from image on the next init_resource_net(), instead of the
+ * built-in one. image must stay around until then
+*/
+int
+petri_net_use_image(const struct petri_net_image *image, size_t size)
+{
+	int error;
+
+	error = petri_net_image_check(image, size);
+	if (error == 0)
+		boot_image = image;
+
+	return error;
+}
+
+/**
+ * whether the cpu template of image is the one of petri_net.def, which the
+ * generated functions fire. other nets are fired through their matrices
+*/
+static bool
+image_is_generated(const struct petri_net_image *image)
+{
+	const struct petri_net_image_arc *arc;
+	int incidence[CPU_BASE_PLACES][CPU_BASE_TRANSITIONS] = { { 0 } };
+	int inhibition[CPU_BASE_PLACES][CPU_BASE_TRANSITIONS] = { { 0 } };
+
+	for (int i = 0; i < image->pni_arcs; i++) {
+		arc = &image->pni_arc[i];
+		if (arc->pna_flags & (PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_GLOBAL_TRANSITION))
+			continue;
+		if (arc->pna_flags & PETRI_NET_ARC_INHIBITOR)
+			inhibition[arc->pna_place][arc->pna_transition] = 1;
+		else
+			incidence[arc->pna_place][arc->pna_transition] += arc->pna_weight;
+	}
+
+	for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++)
+		if (petri_cpu_safe[num_place] != ((image->pni_cpu_place[num_place].pnp_flags & PETRI_NET_PLACE_SAFE) != 0))
+			return false;
+
+	return memcmp(incidence, petri_cpu_incidence, sizeof(incidence)) == 0 &&
+		memcmp(inhibition, petri_cpu_inhibition, sizeof(inhibition)) == 0;
+}
+
+/* the global place of image an arc of queue goes to */
+static __inline int
+global_queue_place(int place, int queue)
+{
+
+	if (place == GLOBAL_PLACE_QUEUE)
+		return PLACE_GLOBAL_QUEUE_OF(queue);
+
+	return CPU_BASE_PLACE(CPU_NUMBER) + place;
+}
+
+/* the global transition of image a queue repeats, or -1 when only the first has it */
+static __inline int
+global_queue_transition(int transition, int queue)
+{
+
+	if (transition == GLOBAL_TRAN_REMOVE_QUEUE)
+		return TRAN_REMOVE_GLOBAL_QUEUE_OF(queue);
+	if (transition == GLOBAL_TRAN_QUEUE)
+		return TRAN_QUEUE_GLOBAL_OF(queue);
+
+	return queue == 0 ? PER_CPU_LAST_TRANSITION + transition : -1;
+}
+
+/**
+ * collect the arcs of image: every cpu repeats the arcs of the template
+ * and then its arcs to the global places, the arcs between global places
+ * and transitions come last, repeated by every global queue. the global
+ * queue place of the arcs of a cpu is the queue of its last level cache
+*/
+static void
+collect_arcs(const struct petri_net_image *image)
+{
+	const struct petri_net_image_arc *arc;
+	int transition;
+
+	build_arcs = (struct petri_build_arc *)init_pointer((CPU_NUMBER + GLOBAL_QUEUES) * image->pni_arcs *
+	    sizeof(struct petri_build_arc));
+	build_arcs_number = 0;
+
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		for (int i = 0; i < image->pni_arcs; i++) {
+			arc = &image->pni_arc[i];
+			if ((arc->pna_flags & (PETRI_NET_ARC_GLOBAL_PLACE | PETRI_NET_ARC_GLOBAL_TRANSITION)) == 0)
+				add_image_arc(PLACE(cpu_n, arc->pna_place), TRANSITION(cpu_n, arc->pna_transition), arc);
+		}
+		for (int i = 0; i < image->pni_arcs; i++) {
+			arc = &image->pni_arc[i];
+			if ((arc->pna_flags & PETRI_NET_ARC_GLOBAL_PLACE) == 0 ||
+			    (arc->pna_flags & PETRI_NET_ARC_GLOBAL_TRANSITION) != 0)
+				continue;
+			if ((arc->pna_flags & PETRI_NET_ARC_SECONDARY) && cpu_n == 0)
+				continue;
+			add_image_arc(global_queue_place(arc->pna_place, GLOBAL_QUEUE_OF_CPU(cpu_n)),
+			    TRANSITION(cpu_n, arc->pna_transition), arc);
+		}
+	}
+
+	for (int queue = 0; queue < GLOBAL_QUEUES; queue++) {
+		for (int i = 0; i < image->pni_arcs; i++) {
+			arc = &image->pni_arc[i];
+			if ((arc->pna_flags & PETRI_NET_ARC_GLOBAL_TRANSITION) == 0 ||
+			    (transition = global_queue_transition(arc->pna_transition, queue)) == -1)
+				continue;
+			add_image_arc(global_queue_place(arc->pna_place, queue), transition, arc);
+		}
+	}
+}
+
+static size_t
+arena_reserve(size_t *arena_size, size_t size)
+{
+	size_t offset = *arena_size;
+
+	*arena_size += roundup2(size, CACHE_LINE_SIZE);
+
+	return offset;
+}
+
+/* groups in the topology tree under cg */
+static int
+topology_groups(struct cpu_group *cg)
+{
+	int groups = 1;
+
+	for (int child = 0; child < cg->cg_children; child++)
+		groups += topology_groups(&cg->cg_child[child]);
+
+	return groups;
+}
+
+/**
+ * copy the groups under cg to groups from group on, and make each one
+ * the group of its cpus at the levels it stands for. groups are visited
+ * from the root down, so a cpu keeps the widest group of a level
+*/
+static int
+init_topology_groups(cpuset_t *groups, int16_t *group_of, struct cpu_group *cg, int group)
+{
+	int16_t *cpu_group;
+	int level, index = group++;
+
+	CPU_COPY(&cg->cg_mask, &groups[index]);
+	if (cg->cg_level == CG_SHARE_L1 || cg->cg_level == CG_SHARE_L2)
+		level = PETRI_TOPO_CACHE;
+	else if (cg->cg_level == CG_SHARE_L3)
+		level = PETRI_TOPO_LLC;
+	else if ((cg->cg_flags & CG_FLAG_NODE) || (cg->cg_parent != NULL && cg->cg_parent->cg_parent == NULL))
+		level = PETRI_TOPO_DOMAIN;
+	else
+		level = -1;
+
+	for (int cpu_n = 0; level != -1 && cpu_n < CPU_NUMBER; cpu_n++) {
+		cpu_group = &group_of[cpu_n * PETRI_TOPO_LEVELS + level];
+		if (CPU_ISSET(cpu_n, &cg->cg_mask) && *cpu_group == -1)
+			*cpu_group = index;
+	}
+	for (int child = 0; child < cg->cg_children; child++)
+		group = init_topology_groups(groups, group_of, &cg->cg_child[child], group);
+
+	return group;
+}
+
+/**
+ * the cpus sharing each level with every cpu, in groups and group_of laid
+ * out as the topo_groups and topo_group of a net. levels the topology does
+ * not have take the next wider one, up to the root group of every cpu
+*/
+static void
+init_topology(cpuset_t *groups, int16_t *group_of)
+{
+	int16_t *cpu_group;
+
+	for (int i = 0; i < CPU_NUMBER * PETRI_TOPO_LEVELS; i++)
+		group_of[i] = -1;
+	init_topology_groups(groups, group_of, smp_topo(), 0);
+
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		cpu_group = &group_of[cpu_n * PETRI_TOPO_LEVELS];
+		for (int level = PETRI_TOPO_LEVELS - 1; level >= 0; level--)
+			if (cpu_group[level] == -1)
+				cpu_group[level] = level == PETRI_TOPO_LEVELS - 1 ? 0 : cpu_group[level + 1];
+	}
+}
+
+/**
+ * the net is allocated as a single cache line aligned arena,
+ * every section of it starts on its own cache line. the image it
+ * is built from is kept at the end
+*/
+struct petri_cpu_resource_net *
+allocate_resource_net(size_t image_size)
+{
+	struct petri_cpu_resource_net *net;
+	size_t arena_size = 0;
+	size_t blocks, enabled_cpus, marked_cpus, idle_cpus, places, transitions, arcs, local, coordinator_arcs, hierarchical, image;
+	size_t topo_groups, topo_group;
+	char *arena;
+
+	arena_reserve(&arena_size, sizeof(struct petri_cpu_resource_net));
+	blocks = arena_reserve(&arena_size, PETRI_BLOCKS * sizeof(struct petri_cpu_block));
+	enabled_cpus = arena_reserve(&arena_size, CPU_BASE_TRANSITIONS * sizeof(cpuset_t));
+	marked_cpus = arena_reserve(&arena_size, CPU_BASE_PLACES * sizeof(cpuset_t));
+	idle_cpus = arena_reserve(&arena_size, sizeof(cpuset_t));
+	places = arena_reserve(&arena_size, CPU_NUMBER_PLACES * sizeof(struct petri_place_map));
+	transitions = arena_reserve(&arena_size, CPU_NUMBER_TRANSITIONS * sizeof(struct petri_transition_arcs));
+	arcs = arena_reserve(&arena_size, build_arcs_number * sizeof(struct petri_arc));
+	local = arena_reserve(&arena_size, CPU_BASE_TRANSITIONS * sizeof(struct petri_word_arcs));
+	//every arc becomes at most one coordinator arc
+	coordinator_arcs = arena_reserve(&arena_size, build_arcs_number * sizeof(struct petri_coordinator_arc));
+	topo_groups = arena_reserve(&arena_size, topology_groups(smp_topo()) * sizeof(cpuset_t));
+	topo_group = arena_reserve(&arena_size, CPU_NUMBER * PETRI_TOPO_LEVELS * sizeof(int16_t));
+	hierarchical = arena_reserve(&arena_size, CPU_NUMBER_TRANSITIONS * sizeof(int8_t));
+	image = arena_reserve(&arena_size, image_size);
+
+	arena = (char *)malloc_aligned(arena_size, CACHE_LINE_SIZE, M_DEVBUF, MALLOC_FLAGS);
+
+	net = (struct petri_cpu_resource_net *)arena;
+	net->blocks = (struct petri_cpu_block *)(arena + blocks);
+	net->enabled_cpus = (cpuset_t *)(arena + enabled_cpus);
+	net->marked_cpus = (cpuset_t *)(arena + marked_cpus);
+	net->idle_cpus = (cpuset_t *)(arena + idle_cpus);
+	net->places = (struct petri_place_map *)(arena + places);
+	net->transitions = (struct petri_transition_arcs *)(arena + transitions);
+	net->arcs = (struct petri_arc *)(arena + arcs);
+	net->arcs_number = build_arcs_number;
+	net->local = (struct petri_word_arcs *)(arena + local);
+	net->coordinator_arcs = (struct petri_coordinator_arc *)(arena + coordinator_arcs);
+	net->topo_groups = (cpuset_t *)(arena + topo_groups);
+	net->topo_group = (int16_t *)(arena + topo_group);
+	net->hierarchical = (int8_t *)(arena + hierarchical);
+	net->image = (struct petri_net_image *)(arena + image);
+	net->image_size = image_size;
+	net->arena_size = arena_size;
+
+	return net;
+}
+
+void
+free_resource_net(struct petri_cpu_resource_net *net)
+{
+
+	free(net, M_DEVBUF);
+}
+
+void
+init_global_resources(void)
+{
+
+	//cpu pinned array: CPU_NUMBER elems initialized in -1
+	if (monopolized_cpus_per_proc != NULL)
+		free(monopolized_cpus_per_proc, M_DEVBUF);
+	monopolized_cpus_per_proc = (int *)init_pointer(CPU_NUMBER * sizeof(int));
+	memset(monopolized_cpus_per_proc, -1, CPU_NUMBER * sizeof(int));
+	CPU_ZERO(&monopolized_cpus);
+	pack_wait_avg = 0;
+	pack_spreading = false;
+	pack_load = pack_active = 0;
+	pack_tick = ticks - 1;
+}
+
+/* map every transition to its thread net transition, the cpu ones repeat the template */
+void
+init_hierarchical_transitions(struct petri_cpu_resource_net *net, const struct petri_net_image *image)
+{
+
+	for (int transition = 0; transition < PER_CPU_LAST_TRANSITION; transition++)
+		net->hierarchical[transition] = image->pni_cpu_map[transition % CPU_BASE_TRANSITIONS];
+	for (int transition = 0; transition < GLOBAL_TRANSITIONS; transition++)
+		net->hierarchical[PER_CPU_LAST_TRANSITION + transition] = image->pni_global_map[transition];
+	for (int queue = 1; queue < GLOBAL_QUEUES; queue++) {
+		net->hierarchical[TRAN_REMOVE_GLOBAL_QUEUE_OF(queue)] = image->pni_global_map[GLOBAL_TRAN_REMOVE_QUEUE];
+		net->hierarchical[TRAN_QUEUE_GLOBAL_OF(queue)] = image->pni_global_map[GLOBAL_TRAN_QUEUE];
+	}
+}
+
+/* cpu 0 gets the boot marking of the cpu places, the other cpus the regular one */
+void
+init_resource_mark(struct petri_cpu_resource_net *net, const struct petri_net_image *image)
+{
+	const struct petri_net_image_place *place;
+
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++) {
+			place = &image->pni_cpu_place[num_place];
+			set_place_tokens(net, PLACE(cpu_n, num_place), cpu_n == 0 ? place->pnp_boot_tokens : place->pnp_tokens);
+		}
+	}
+	for (int num_place = 0; num_place < GLOBAL_PLACES; num_place++)
+		set_place_tokens(net, CPU_BASE_PLACE(CPU_NUMBER) + num_place, image->pni_global_place[num_place].pnp_tokens);
+	for (int queue = 1; queue < GLOBAL_QUEUES; queue++)
+		set_place_tokens(net, PLACE_GLOBAL_QUEUE_OF(queue), image->pni_global_place[GLOBAL_PLACE_QUEUE].pnp_tokens);
+
+	//cpus that start available run their idle thread first
+	CPU_ZERO(net->idle_cpus);
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++)
+		if (resource_net_place_tokens(net, PLACE(cpu_n, PLACE_CPU)) > 0)
+			CPU_SET(cpu_n, net->idle_cpus);
+
+	init_enabled(net);
+}
+
+/* the PETRI_PUBLISHED_PLACES holding a token in mark, the block of a cpu of net */
+static __inline u_int
+marked_places(struct petri_cpu_resource_net *net, uint64_t mark)
+{
+	struct petri_place_map *place_map;
+	u_int marked = 0;
+
+	for (u_int places = PETRI_PUBLISHED_PLACES; places != 0; places &= places - 1) {
+		//the places of cpu 0 share their slots with every other cpu
+		place_map = &net->places[ffs(places) - 1];
+		if (place_map->safe ? (mark >> place_map->slot) & 1 : PETRI_MARK_COUNTER(mark) > 0)
+			marked |= places & -places;
+	}
+
+	return marked;
+}
+
+/**
+ * compute the enabled bits of every cpu block from scratch, and the cpusets
+ * of the published transitions and places from them
+*/
+void
+init_enabled(struct petri_cpu_resource_net *net)
+{
+	uint64_t mark;
+	u_int enabled, marked;
+
+	for (int base_transition = 0; base_transition < CPU_BASE_TRANSITIONS; base_transition++)
+		CPU_ZERO(&net->enabled_cpus[base_transition]);
+	net->published_bits = 0;
+	for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++) {
+		CPU_ZERO(&net->marked_cpus[num_place]);
+		if (PETRI_PUBLISHED_PLACES & (1u << num_place))
+			net->published_bits |= net->places[num_place].safe ?
+			    (uint64_t)1 << net->places[num_place].slot : ~(uint64_t)0 << PETRI_COUNTER_SHIFT;
+	}
+
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		mark = net->blocks[cpu_n].mark;
+		enabled = 0;
+		for (int base_transition = 0; base_transition < CPU_BASE_TRANSITIONS; base_transition++) {
+			if (!word_arcs_are_sensitized(&net->local[base_transition], mark))
+				continue;
+			enabled |= (1u << base_transition);
+			if (PETRI_PUBLISHED_TRANSITIONS & (1u << base_transition))
+				CPU_SET(cpu_n, &net->enabled_cpus[base_transition]);
+		}
+		net->blocks[cpu_n].mark = (mark & ~PETRI_ENABLED_MASK) | ((uint64_t)enabled << PETRI_ENABLED_SHIFT);
+
+		marked = marked_places(net, mark);
+		for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++)
+			if (marked & (1u << num_place))
+				CPU_SET(cpu_n, &net->marked_cpus[num_place]);
+	}
+}
+
+/**
+ * group the arcs collected while building the net into per-transition
+ * arc lists, so sensitizing and firing a transition only visits the places
+ * it is connected to instead of every place of the net
+*/
+void
+compile_resource_net(struct petri_cpu_resource_net *net, const struct petri_net_image *image)
+{
+	struct petri_transition_arcs *transition;
+	struct petri_build_arc *build_arc;
+	int *cursors;
+	int arcs_number = 0, inputs, outputs, inhibitors, kind;
+
+	//count the arcs of each kind per transition
+	for (int i = 0; i < build_arcs_number; i++) {
+		build_arc = &build_arcs[i];
+		transition = &net->transitions[build_arc->transition];
+		if (build_arc->inhibitor)
+			transition->inhibitor++;
+		else if (build_arc->weight < 0)
+			transition->input++;
+		else
+			transition->output++;
+	}
+
+	for (int num_transition = 0; num_transition < CPU_NUMBER_TRANSITIONS; num_transition++) {
+		transition = &net->transitions[num_transition];
+		inputs = transition->input;
+		outputs = transition->output;
+		inhibitors = transition->inhibitor;
+
+		transition->input = arcs_number;
+		transition->output = transition->input + inputs;
+		transition->inhibitor = transition->output + outputs;
+		transition->end = transition->inhibitor + inhibitors;
+		arcs_number = transition->end;
+	}
+
+	//cursors[3 * t + kind] is the next free arc of that kind for transition t
+	cursors = (int *)init_pointer(3 * CPU_NUMBER_TRANSITIONS * sizeof(int));
+	for (int num_transition = 0; num_transition < CPU_NUMBER_TRANSITIONS; num_transition++) {
+		transition = &net->transitions[num_transition];
+		cursors[3 * num_transition] = transition->input;
+		cursors[3 * num_transition + 1] = transition->output;
+		cursors[3 * num_transition + 2] = transition->inhibitor;
+	}
+
+	for (int i = 0; i < build_arcs_number; i++) {
+		build_arc = &build_arcs[i];
+		kind = build_arc->inhibitor ? 2 : (build_arc->weight < 0 ? 0 : 1);
+		net->arcs[cursors[3 * build_arc->transition + kind]].place = build_arc->place;
+		net->arcs[cursors[3 * build_arc->transition + kind]].weight = build_arc->weight;
+		cursors[3 * build_arc->transition + kind]++;
+	}
+
+	free(cursors, M_DEVBUF);
+	free(build_arcs, M_DEVBUF);
+	build_arcs = NULL;
+
+	compile_marking(net, image);
+	compile_subnet(net);
+	compile_coordinator(net);
+}
+
+/**
+ * pack the 1-safe places as bits of their block and keep the counting
+ * place in the upper half of the block mark. every cpu owns the block of
+ * its subnet, the global places live in the coordinator blocks, and the
+ * global queues after the first one in a block each
+*/
+void
+compile_marking(struct petri_cpu_resource_net *net, const struct petri_net_image *image)
+{
+	struct petri_place_map *place_map;
+	const struct petri_net_image_place *place;
+	int *block_counters, block_place, block_n;
+
+	block_counters = (int *)init_pointer(PETRI_BLOCKS * sizeof(int));
+	for (int num_place = 0; num_place < CPU_NUMBER_PLACES; num_place++) {
+		place_map = &net->places[num_place];
+		if (num_place < PLACE_GLOBAL_QUEUE) {
+			block_n = num_place / CPU_BASE_PLACES;
+			block_place = num_place % CPU_BASE_PLACES;
+			place = &image->pni_cpu_place[block_place];
+		} else if (num_place < PLACE_GLOBAL_QUEUE + GLOBAL_PLACES) {
+			block_place = num_place - PLACE_GLOBAL_QUEUE;
+			place = &image->pni_global_place[block_place];
+			block_n = GLOBAL_BLOCK + place->pnp_block;
+		} else {
+			block_place = GLOBAL_PLACE_QUEUE;
+			place = &image->pni_global_place[block_place];
+			block_n = GLOBAL_QUEUE_BLOCK(num_place - (PLACE_GLOBAL_QUEUE + GLOBAL_PLACES) + 1);
+		}
+		place_map->block = block_n;
+		place_map->safe = (place->pnp_flags & PETRI_NET_PLACE_SAFE) != 0;
+
+		if (place_map->safe) {
+			place_map->slot = block_place;
+			KASSERT(place_map->slot < PETRI_SAFE_BITS,
+			    ("resource net: too many 1-safe places in block %d", block_n));
+			continue;
+		}
+
+		place_map->slot = block_counters[block_n]++;
+		KASSERT(place_map->slot < PETRI_BLOCK_COUNTERS,
+		    ("resource net: too many counting places in block %d", block_n));
+	}
+
+	free(block_counters, M_DEVBUF);
+}
+
+static void
+compile_word_arc(struct petri_word_arcs *word_arcs, struct petri_place_map *place_map, int weight, bool inhibitor)
+{
+	uint64_t bit;
+
+	if (place_map->safe) {
+		bit = (uint64_t)1 << place_map->slot;
+		if (inhibitor)
+			word_arcs->inhibit |= bit;
+		else if (weight < 0)
+			word_arcs->required |= bit;
+		else
+			word_arcs->produce |= bit;
+	} else if (inhibitor)
+		word_arcs->counter_inhibitor = true;
+	else if (weight < 0)
+		word_arcs->tokens -= weight;
+	else
+		word_arcs->output_tokens += weight;
+}
+
+/**
+ * compile the cpu subnet once: every cpu repeats the same local arcs over
+ * its own block, so they are taken from cpu 0 (whose places are numbered
+ * as the base places) and shared by all the cpus
+*/
+void
+compile_subnet(struct petri_cpu_resource_net *net)
+{
+	struct petri_transition_arcs *transition;
+	struct petri_place_map *place_map;
+	struct petri_arc *arc;
+	bool inhibitor;
+
+	for (int base_transition = 0; base_transition < CPU_BASE_TRANSITIONS; base_transition++) {
+		transition = &net->transitions[TRANSITION(0, base_transition)];
+		for (int i = transition->input; i < transition->end; i++) {
+			arc = &net->arcs[i];
+			place_map = &net->places[arc->place];
+			if (place_map->block != 0)
+				continue;
+
+			inhibitor = i >= transition->inhibitor;
+			compile_word_arc(&net->local[base_transition], place_map, arc->weight, inhibitor);
+
+			//output arcs never disable a transition
+			if (!inhibitor && arc->weight > 0)
+				continue;
+
+			if (place_map->safe) {
+				net->local_dependents[place_map->slot] |= (1u << base_transition);
+				continue;
+			}
+			net->local_counter_dependents |= (1u << base_transition);
+			net->local_counter_threshold = MAX(net->local_counter_threshold, inhibitor ? 1 : -arc->weight);
+		}
+	}
+}
+
+/**
+ * compile the arcs of every transition over the coordinator places, one
+ * word arc per coordinator block. these are the only arcs that make a
+ * transition touch state shared by all the cpus
+*/
+void
+compile_coordinator(struct petri_cpu_resource_net *net)
+{
+	struct petri_transition_arcs *transition;
+	struct petri_coordinator_arc *coordinator_arc, *word_arc;
+	struct petri_place_map *place_map;
+	struct petri_arc *arc;
+	volatile uint64_t *word;
+	bool inhibitor;
+
+	coordinator_arc = net->coordinator_arcs;
+	for (int num_transition = 0; num_transition < CPU_NUMBER_TRANSITIONS; num_transition++) {
+		transition = &net->transitions[num_transition];
+
+		transition->coordinator = coordinator_arc - net->coordinator_arcs;
+		for (int i = transition->input; i < transition->end; i++) {
+			arc = &net->arcs[i];
+			place_map = &net->places[arc->place];
+			if (place_map->block < GLOBAL_BLOCK)
+				continue;
+
+			word = &net->blocks[place_map->block].mark;
+			for (word_arc = &net->coordinator_arcs[transition->coordinator]; word_arc < coordinator_arc; word_arc++)
+				if (word_arc->word == word)
+					break;
+			if (word_arc == coordinator_arc) {
+				word_arc->word = word;
+				coordinator_arc++;
+			}
+
+			inhibitor = i >= transition->inhibitor;
+			compile_word_arc(&word_arc->arcs, place_map, arc->weight, inhibitor);
+			if (!inhibitor) {
+				word_arc->incidence = true;
+				transition->coordinator_incidence = true;
+			}
+		}
+		transition->coordinator_end = coordinator_arc - net->coordinator_arcs;
+	}
+}
+
+/**
+ * build a net from a checked image, without touching the running one
+*/
+struct petri_cpu_resource_net *
+build_resource_net(const struct petri_net_image *image)
+{
+	struct petri_cpu_resource_net *net;
+	size_t image_size = PETRI_NET_IMAGE_SIZE(image->pni_arcs);
+
+	collect_arcs(image);
+	net = allocate_resource_net(image_size);
+	memcpy(net->image, image, image_size);
+	net->generated = image_is_generated(image);
+	compile_resource_net(net, image);
+	init_hierarchical_transitions(net, image);
+	init_topology(net->topo_groups, net->topo_group);
+	init_resource_mark(net, image);
+
+	return net;
+}
+
+/**
+ * put net in place of the running one, carrying the marking over place by
+ * place. nothing may be firing meanwhile, the caller keeps every cpu out
+ * of the net. it fails with EBUSY when a place holds more tokens than net
+ * can store there, the running net is then left as it was
+*/
+int
+install_resource_net(struct petri_cpu_resource_net *net)
+{
+	int tokens;
+
+	for (int place = 0; place < CPU_NUMBER_PLACES; place++) {
+		tokens = resource_net_tokens(place);
+		if (net->places[place].safe && tokens > 1)
+			return EBUSY;
+		set_place_tokens(net, place, tokens);
+	}
+	init_enabled(net);
+	CPU_COPY(resource_net->idle_cpus, net->idle_cpus);
+
+	//the generated functions only fire the cpu subnet of petri_net.def
+	if (!net->generated)
+		petri_interpreted = 1;
+	hierarchical_transitions = net->hierarchical;
+	resource_net = net;
+
+	return 0;
+}
+
+void 
+init_resource_net(void)
+{
+	const struct petri_net_image *image = boot_image;
+	struct petri_net_image *builtin = NULL;
+	size_t size;
+
+	init_global_variables();
+	init_global_resources();
+	if (image == NULL)
+		image = builtin = petri_net_builtin_image(&size);
+
+	//the userspace tools build the net again for every cpu count
+	if (resource_net != NULL)
+		free_resource_net(resource_net);
+	resource_net = build_resource_net(image);
+	hierarchical_transitions = resource_net->hierarchical;
+	if (!resource_net->generated)
+		petri_interpreted = 1;
+
+	if (builtin != NULL)
+		free(builtin, M_DEVBUF);
+
+	log(LOG_KERN, "Petri scheduler resource net %s initialized\n", resource_net->image->pni_name);
+}
+
+static int
+resource_net_place_tokens(struct petri_cpu_resource_net *net, int place)
+{
+	struct petri_place_map *place_map = &net->places[place];
+	uint64_t mark = atomic_load_64(&net->blocks[place_map->block].mark);
+
+	if (!place_map->safe)
+		return PETRI_MARK_COUNTER(mark);
+
+	return (mark >> place_map->slot) & 1;
+}
+
+int
+resource_net_tokens(int place)
+{
+
+	PETRI_NET_ASSERT_READER();
+	return resource_net_place_tokens(resource_net, place);
+}
+
+static void
+set_place_tokens(struct petri_cpu_resource_net *net, int place, int tokens)
+{
+	struct petri_place_map *place_map = &net->places[place];
+	struct petri_cpu_block *block = &net->blocks[place_map->block];
+
+	if (!place_map->safe)
+		block->mark = (block->mark & ~(~(uint64_t)0 << PETRI_COUNTER_SHIFT)) | PETRI_COUNTER_TOKENS(tokens);
+	else if (tokens > 0)
+		block->mark |= ((uint64_t)1 << place_map->slot);
+	else
+		block->mark &= ~((uint64_t)1 << place_map->slot);
+}
+
+/* also called by the modules with interrupts enabled */
+bool 
+is_cpu_suspended(int cpu_n)
+{
+	bool suspended;
+
+	spinlock_enter();
+	suspended = resource_net_tokens(PLACE(cpu_n, PLACE_SUSPENDED)) > 0;
+	spinlock_exit();
+
+	return suspended;
+}
+
+/**
+ * fire the transition passed as param to the function
+ * and check for automatic transitions to be fired
+*/
+void resource_fire_net(struct thread *pt, int transition_index, char *func)
+{
+
+	PETRI_NET_ASSERT_READER();
+
+	if (pt && !PETRI_CHECK_HOOK_FIRINGS && (transition_index >= PER_CPU_LAST_TRANSITION ||
+		(PETRI_CHECKED_TRANSITIONS & (1u << (transition_index % CPU_BASE_TRANSITIONS))) == 0)) {
+		if (!smp_set && smp_started && atomic_cmpset_int(&smp_set, 0, 1))
+			resource_fire_single_transition(pt, TRAN_START_SMP, func, true);
+		resource_fire_single_transition(pt, transition_index, func, false);
+		return;
+	}
+
+	if (pt && !resource_try_fire_net(pt, transition_index, func)) {
+		char name[32];
+
+		log(LOG_WARNING, "(resource_net) from %s Thread %2d (%s), CPU%2d: %s (%d) no sensibilizada\n", func, pt->td_tid, pt->td_proc->p_comm, PCPU_GET(cpuid), transition_name(transition_index, name, sizeof(name)), transition_index);
+		print_resource_net();
+	}
+}
+
+/**
+ * fire the transition only if it is sensitized, returning whether it was
+ * fired. the check and the firing are a single atomic step, so callers
+ * racing for the same tokens from different cpus see exactly one success
+*/
+bool
+resource_try_fire_net(struct thread *pt, int transition_index, char *func)
+{
+
+	PETRI_NET_ASSERT_READER();
+
+	if (!pt)
+		return false;
+
+	if (!smp_set && smp_started && atomic_cmpset_int(&smp_set, 0, 1))
+		resource_fire_single_transition(pt, TRAN_START_SMP, func, true);
+
+	return resource_fire_single_transition(pt, transition_index, func, true);
+}
+
+/**
+ * the name of a transition of the resource net for the logs: its base
+ * transition and cpu, or its global transition and, for the ones repeated
+ * for every global queue after the first, the queue. buf holds it unless
+ * it is a constant one
+*/
+static const char *
+transition_name(int transition_index, char *buf, size_t size)
+{
+	int global;
+
+	if (transition_index < PER_CPU_LAST_TRANSITION) {
+		snprintf(buf, size, "%s_P%d", base_transitions_names[transition_index % CPU_BASE_TRANSITIONS],
+			transition_index / CPU_BASE_TRANSITIONS);
+		return buf;
+	}
+
+	global = transition_index - PER_CPU_LAST_TRANSITION;
+	if (global < GLOBAL_TRANSITIONS)
+		return global_transitions_names[global];
+
+	//the sharded ones, REMOVE_GLOBAL_QUEUE and QUEUE_GLOBAL of each queue in turn
+	global -= GLOBAL_TRANSITIONS;
+	snprintf(buf, size, "%s_%d",
+		global_transitions_names[global % 2 ? GLOBAL_TRAN_QUEUE : GLOBAL_TRAN_REMOVE_QUEUE], global / 2 + 1);
+	return buf;
+}
+
+/**
+ * update the resource net state and in case
+ * of firing a transition hierarchical to another
+ * in the threads net, fire the hierarchical transition.
+ * unchecked firings are always applied
+*/
+static bool 
+resource_fire_single_transition(struct thread *pt, int transition_index, char *func, bool checked) 
+{
+	int local_transition = 0;
+
+	if (!checked)
+		apply_transition(transition_index);
+	else if (!fire_transition(transition_index))
+		return false;
+
+	if (transition_index < PER_CPU_LAST_TRANSITION)
+		publish_idle(transition_index / CPU_BASE_TRANSITIONS, transition_index % CPU_BASE_TRANSITIONS);
+
+	if (petri_trace_enabled)
+		trace_firing(pt, transition_index);
+
+	if (print > 0) {
+		char name[32];
+
+		log(LOG_INFO, "(resource_net) from %s\tThread %2d (%s)\t-> %s\n", func, pt->td_tid, pt->td_proc->p_comm, transition_name(transition_index, name, sizeof(name)));
+		print--;
+	}
+
+	local_transition = hierarchical_transitions[transition_index];
+	if (local_transition != NO_HIERARCHICAL_TRANSITION) //If we need to fire a local thread transition we fire it here
+		thread_petri_fire(pt, local_transition, print);
+
+	return true;
+}
+
+/**
+ * append a firing to the trace ring of the current cpu, with the marking
+ * word it left in its block
+*/
+static void
+trace_firing(struct thread *pt, int transition_index)
+{
+	struct petri_transition_arcs *transition;
+	int block;
+
+	if (transition_index < PER_CPU_LAST_TRANSITION)
+		block = transition_index / CPU_BASE_TRANSITIONS;
+	else {
+		transition = &resource_net->transitions[transition_index];
+		block = (struct petri_cpu_block *)resource_net->coordinator_arcs[transition->coordinator].word -
+		    resource_net->blocks;
+	}
+
+	trace_record(PETRI_TRACE_FIRING, pt->td_tid, transition_index, block,
+	    atomic_load_64(&resource_net->blocks[block].mark));
+}
+
+/**
+ * append a record to the trace ring of the current cpu. it is the only
+ * writer of the ring, so the record is filled in place and published by
+ * advancing the head, see sys/petri_trace.h
+*/
+static void
+trace_record(u_int kind, lwpid_t tid, int transition, int block, uint64_t mark)
+{
+	struct petri_trace_ring *ring;
+	struct petri_trace_record *record;
+	uint64_t head;
+
+	if (petri_trace_base == NULL)
+		return;
+
+	critical_enter();
+	ring = (struct petri_trace_ring *)(petri_trace_base + curcpu * petri_trace_ring_size);
+	head = ring->ptr_head;
+	record = &ring->ptr_record[head & (ring->ptr_records - 1)];
+	//readers must not see the slot change before the head that makes it stale
+	atomic_thread_fence_rel();
+	record->ptr_ticks = cpu_ticks();
+	record->ptr_mark = mark;
+	record->ptr_tid = tid;
+	record->ptr_transition = transition;
+	record->ptr_cpu = curcpu;
+	record->ptr_block = block;
+	record->ptr_kind = kind;
+	atomic_store_rel_64(&ring->ptr_head, head + 1);
+	critical_exit();
+}
 
-int print = 0;
-int smp_set = 0;
-struct petri_cpu_resource_net *resource_net;
-int *monopolized_cpus_per_proc = NULL;
+/**
+ * record a scheduler hook acting on cpu, before the transition it decided
+ * to fire. threads queued by sched_pickcpu() also get their cpuset
+ * recorded, so a replay can choose a cpu for them again
+*/
+void
+petri_trace_hook(struct thread *td, u_int kind, int cpu, uint64_t arg, int transition)
+{
+	const cpuset_t *mask;
+
+	if (kind == PETRI_TRACE_ADD && PETRI_TRACE_ADD_REASON(arg) == PETRI_TRACE_ADD_PICKED) {
+		mask = &td->td_cpuset->cs_mask;
+		for (int word = 0; word < nitems(mask->__bits); word++)
+			if (mask->__bits[word] != 0)
+				trace_record(PETRI_TRACE_CPUSET, td->td_tid, word, cpu & PETRI_TRACE_NOCPU,
+				    (uint64_t)mask->__bits[word]);
+	}
 
-const int base_resource_matrix[CPU_BASE_PLACES][CPU_BASE_TRANSITIONS] = {
-	/*Base matrix */
-//AD EX EXID FRGL REMQ RETIN RETV SUS UNQ WUP	
-	{ 0, 0,-1,-1, 0, 1, 1, 0,-1, 0 },//CPU
-	{ 0, 1, 0, 0, 0,-1,-1, 0, 0, 0 },//EXEC
-	{ 1, 0, 0, 0,-1, 0, 0, 0,-1, 0 },//Q
-	{ 0, 0, 0, 0, 0, 0, 0, 1, 0,-1 },//SUSD
-	{ 0,-1, 1, 1, 0, 0, 0, 0, 1, 0 }//TOEX
-};
+	trace_record(kind, td->td_tid, transition, cpu & PETRI_TRACE_NOCPU, arg);
+}
 
-const int base_resource_inhibition_matrix[CPU_BASE_PLACES][CPU_BASE_TRANSITIONS] = {
-	/*Base inhibition matrix */
-	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-	{ 0, 0, 1, 0, 0, 0, 0, 0, 0, 0 },
-	{ 1, 0, 0, 1, 0, 0, 0, 0, 0, 0 },
-	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
-};
+/**
+ * record the marking of every block and the monopolized cpus, the state a
+ * replay starts from
+*/
+void
+petri_trace_snapshot(void)
+{
 
-int hierarchical_transitions[HIERARCHICAL_TRANSITIONS] = {
-	TRAN_ADDTOQUEUE,
-	TRAN_EXEC,
-	TRAN_EXEC_IDLE,
-	TRAN_RETURN_INVOL,
-	TRAN_RETURN_VOL,
-	TRAN_REMOVE_QUEUE
-};
+	spinlock_enter();
+	for (int block = 0; block < PETRI_BLOCKS; block++)
+		trace_record(PETRI_TRACE_MARKING, curthread->td_tid, 0, block,
+		    atomic_load_64(&resource_net->blocks[block].mark));
+	spinlock_exit();
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++)
+		if (monopolized_cpus_per_proc[cpu_n] != -1)
+			trace_record(PETRI_TRACE_MONOPOLIZE, curthread->td_tid, 0, cpu_n,
+			    monopolized_cpus_per_proc[cpu_n]);
+}
 
-const int hierarchical_corresponse[HIERARCHICAL_TRANSITIONS] = { 
-	TRAN_ON_QUEUE, 
-	TRAN_SET_RUNNING, 
-	TRAN_ON_QUEUE, 
-	TRAN_SWITCH_OUT, 
-	TRAN_TO_WAIT_CHANNEL, 
-	TRAN_REMOVE, 	
-	TRAN_ON_QUEUE, 	
-	TRAN_REMOVE 
-};
+/**
+ * fire a transition without any lock. transitions that only read the
+ * coordinator are one compare-and-swap on the block of their cpu, as are
+ * coordinator transitions over a single word. otherwise the input tokens
+ * are consumed word by word, and given back if one of them is missing,
+ * before the outputs are produced
+*/
+static bool
+fire_transition(int transition_index)
+{
+	struct petri_transition_arcs *transition = &resource_net->transitions[transition_index];
+	struct petri_coordinator_arc *coordinator_arc;
+	struct petri_word_arcs *local = NULL;
+	int cpu_n = NOCPU, i;
+
+	if (transition_index < PER_CPU_LAST_TRANSITION) {
+		cpu_n = transition_index / CPU_BASE_TRANSITIONS;
+		local = &resource_net->local[transition_index % CPU_BASE_TRANSITIONS];
+	}
 
-const char *transitions_names[] = {
-	"ADDTOQUEUE_P0", "EXEC_P0", "EXEC_IDLE_P0", "FROM_GLOBAL_CPU_P0", "REMOVE_QUEUE_P0", "RETURN_INVOL_P0", "RETURN_VOL_P0", "SUSPEND_PROC_P0", "UNQUEUE_P0", "WAKEUP_PROC_P0",
-	"ADDTOQUEUE_P1", "EXEC_P1", "EXEC_IDLE_P1", "FROM_GLOBAL_CPU_P1", "REMOVE_QUEUE_P1", "RETURN_INVOL_P1", "RETURN_VOL_P1", "SUSPEND_PROC_P1", "UNQUEUE_P1", "WAKEUP_PROC_P1",
-	"ADDTOQUEUE_P2", "EXEC_P2", "EXEC_IDLE_P2", "FROM_GLOBAL_CPU_P2", "REMOVE_QUEUE_P2", "RETURN_INVOL_P2", "RETURN_VOL_P2", "SUSPEND_PROC_P2", "UNQUEUE_P2", "WAKEUP_PROC_P2",
-	"ADDTOQUEUE_P3", "EXEC_P3", "EXEC_IDLE_P3", "FROM_GLOBAL_CPU_P3", "REMOVE_QUEUE_P3", "RETURN_INVOL_P3", "RETURN_VOL_P3", "SUSPEND_PROC_P3", "UNQUEUE_P3", "WAKEUP_PROC_P3",
-	"REMOVE_GLOBAL_QUEUE", "START_SMP", "QUEUE_GLOBAL"
-};
+	if (!transition->coordinator_incidence) {
+		KASSERT(local != NULL, ("resource net: transition %d has no arcs", transition_index));
+		if (!coordinator_arcs_are_sensitized(transition_index))
+			return false;
+		if (!petri_interpreted)
+			return fire_local_transition(cpu_n, transition_index % CPU_BASE_TRANSITIONS, true);
+		return fire_word(&resource_net->blocks[cpu_n].mark, cpu_n, local, PETRI_WORD_FIRE);
+	}
 
-const char *cpu_places_names[] = { "CPU", "EXECUTING", "QUEUE", "SUSPENDED", "TOEXEC" };
+	if (local == NULL && transition->coordinator_end - transition->coordinator == 1) {
+		coordinator_arc = &resource_net->coordinator_arcs[transition->coordinator];
+		return fire_word(coordinator_arc->word, NOCPU, &coordinator_arc->arcs, PETRI_WORD_FIRE);
+	}
 
-static void resource_fire_single_transition(struct thread *pt, int transition_index);
-int get_monopolized_cpu_by_proc_id(int proc_id);
-bool toggle_active_cpu(int cpu, bool turn_off);
-bool toggle_pin_cpu_to_proc(int proc_id, int cpu, bool release);
-void allocate_resource_net(void);
-void init_cpu_mark(int cpu_n);
-void init_cpu_matrix(int cpu_n);
-void init_global_resources(void);
-void init_global_variables(void);
-void init_per_cpu_resources(void);
-void print_resource_net(void);
+	for (i = transition->coordinator; i < transition->coordinator_end; i++) {
+		coordinator_arc = &resource_net->coordinator_arcs[i];
+		if (!coordinator_arc->incidence) {
+			if (!word_arcs_are_sensitized(&coordinator_arc->arcs, atomic_load_64(coordinator_arc->word)))
+				goto restore;
+			continue;
+		}
+		if (!fire_word(coordinator_arc->word, NOCPU, &coordinator_arc->arcs, PETRI_WORD_CONSUME))
+			goto restore;
+	}
+	if (local != NULL && !fire_word(&resource_net->blocks[cpu_n].mark, cpu_n, local, PETRI_WORD_CONSUME))
+		goto restore;
 
-/* this is needed because mp_ncpus is set at runtime */
-void 
-init_global_variables(void)
-{
+	for (i = transition->coordinator; i < transition->coordinator_end; i++) {
+		coordinator_arc = &resource_net->coordinator_arcs[i];
+		if (coordinator_arc->incidence)
+			fire_word(coordinator_arc->word, NOCPU, &coordinator_arc->arcs, PETRI_WORD_PRODUCE);
+	}
+	if (local != NULL)
+		fire_word(&resource_net->blocks[cpu_n].mark, cpu_n, local, PETRI_WORD_PRODUCE);
 
-	CPU_NUMBER 						= mp_ncpus;
-	CPU_NUMBER_PLACES 				= (CPU_BASE_PLACES*CPU_NUMBER) + GLOBAL_PLACES;
-	CPU_NUMBER_TRANSITIONS 			= (CPU_BASE_TRANSITIONS*CPU_NUMBER) + GLOBAL_TRANSITIONS;
-	PER_CPU_LAST_TRANSITION	 		= (CPU_NUMBER_TRANSITIONS - GLOBAL_TRANSITIONS);
-	PLACE_GLOBAL_QUEUE 				= (CPU_NUMBER_PLACES - 3);
-	PLACE_SMP_NOT_READY 			= (CPU_NUMBER_PLACES - 2);
-	PLACE_SMP_READY 				= (CPU_NUMBER_PLACES - 1);
-	TRAN_REMOVE_GLOBAL_QUEUE 		= (CPU_NUMBER_TRANSITIONS - 3);
-	TRAN_START_SMP 					= (CPU_NUMBER_TRANSITIONS - 2);
-	TRAN_QUEUE_GLOBAL 				= (CPU_NUMBER_TRANSITIONS - 1);
+	return true;
+
+restore:
+	while (--i >= transition->coordinator) {
+		coordinator_arc = &resource_net->coordinator_arcs[i];
+		if (coordinator_arc->incidence)
+			fire_word(coordinator_arc->word, NOCPU, &coordinator_arc->arcs, PETRI_WORD_RESTORE);
+	}
+
+	return false;
 }
 
-void 
-allocate_resource_net(void)
+/**
+ * fire a transition known to be sensitized: every word it changes is
+ * updated on its own, with no sensitization check and nothing to restore
+*/
+static void
+apply_transition(int transition_index)
 {
+	struct petri_transition_arcs *transition = &resource_net->transitions[transition_index];
+	struct petri_coordinator_arc *coordinator_arc;
+	int cpu_n, base_transition;
+
+	if (transition_index < PER_CPU_LAST_TRANSITION) {
+		cpu_n = transition_index / CPU_BASE_TRANSITIONS;
+		base_transition = transition_index % CPU_BASE_TRANSITIONS;
+		if (!petri_interpreted)
+			fire_local_transition(cpu_n, base_transition, false);
+		else
+			fire_word(&resource_net->blocks[cpu_n].mark, cpu_n, &resource_net->local[base_transition],
+			    PETRI_WORD_APPLY);
+	}
 
-	resource_net = (struct petri_cpu_resource_net *)init_pointer(sizeof(struct petri_cpu_resource_net));
-    
-	resource_net->mark = (int *)init_pointer(CPU_NUMBER_PLACES * sizeof(int));
+	for (int i = transition->coordinator; i < transition->coordinator_end; i++) {
+		coordinator_arc = &resource_net->coordinator_arcs[i];
+		if (coordinator_arc->incidence)
+			fire_word(coordinator_arc->word, NOCPU, &coordinator_arc->arcs, PETRI_WORD_APPLY);
+	}
+}
 
-	resource_net->incidence_matrix = (char **)init_double_pointer(CPU_NUMBER_PLACES, CPU_NUMBER_TRANSITIONS, sizeof(char));
-	resource_net->inhibition_matrix = (char **)init_double_pointer(CPU_NUMBER_PLACES, CPU_NUMBER_TRANSITIONS, sizeof(char));
+/**
+ * compute the next value of a marking word, PETRI_WORD_FIRE and
+ * PETRI_WORD_CONSUME fail when the arcs are not sensitized by it
+*/
+static __inline bool
+word_next_mark(struct petri_word_arcs *word_arcs, int op, uint64_t mark, uint64_t *next)
+{
+
+	switch (op) {
+	case PETRI_WORD_FIRE:
+		if (!word_arcs_are_sensitized(word_arcs, mark))
+			return false;
+		/* FALLTHROUGH */
+	case PETRI_WORD_APPLY:
+		KASSERT((mark & ~word_arcs->required & word_arcs->produce) == 0,
+		    ("resource net: firing marks a 1-safe place twice"));
+		*next = ((mark & ~word_arcs->required) | word_arcs->produce) -
+		    PETRI_COUNTER_TOKENS(word_arcs->tokens) + PETRI_COUNTER_TOKENS(word_arcs->output_tokens);
+		return true;
+	case PETRI_WORD_CONSUME:
+		if (!word_arcs_are_sensitized(word_arcs, mark))
+			return false;
+		*next = (mark & ~word_arcs->required) - PETRI_COUNTER_TOKENS(word_arcs->tokens);
+		return true;
+	case PETRI_WORD_PRODUCE:
+		KASSERT((mark & word_arcs->produce) == 0,
+		    ("resource net: firing marks a 1-safe place twice"));
+		*next = (mark | word_arcs->produce) + PETRI_COUNTER_TOKENS(word_arcs->output_tokens);
+		return true;
+	default:
+		KASSERT((mark & word_arcs->required) == 0,
+		    ("resource net: restoring a 1-safe place twice"));
+		*next = (mark | word_arcs->required) + PETRI_COUNTER_TOKENS(word_arcs->tokens);
+		return true;
+	}
 }
 
-void 
-init_global_resources(void) 
+/**
+ * apply op to a marking word with a compare-and-swap loop, retrying when
+ * another cpu changed the word in between. the enabled bits of a cpu block
+ * are recomputed in the same swap, so they always match its marking
+*/
+static bool
+fire_word(volatile uint64_t *word, int cpu_n, struct petri_word_arcs *word_arcs, int op)
 {
+	uint64_t mark, next;
 
-	//add global hierarchical transitions
-	hierarchical_transitions[PER_CPU_HIER_TRANSITIONS] = TRAN_QUEUE_GLOBAL;
-	hierarchical_transitions[PER_CPU_HIER_TRANSITIONS + 1] = TRAN_REMOVE_GLOBAL_QUEUE;
+	mark = atomic_load_64(word);
+	do {
+		if (!word_next_mark(word_arcs, op, mark, &next))
+			return false;
+		if (cpu_n != NOCPU)
+			next = local_mark_refresh(mark, next);
+	} while (!atomic_fcmpset_64(word, &mark, next));
+
+	if (cpu_n != NOCPU) {
+		publish_enabled(cpu_n, PETRI_MARK_ENABLED(mark ^ next));
+		if ((mark ^ next) & resource_net->published_bits)
+			publish_marked(cpu_n, marked_places(resource_net, mark) ^ marked_places(resource_net, next));
+	}
 
-	//Transition to remove from global queue
-	resource_net->incidence_matrix[PLACE_GLOBAL_QUEUE][TRAN_REMOVE_GLOBAL_QUEUE] = -1;
+	return true;
+}
 
-	//Represents arc to queue on the global queue
-	resource_net->incidence_matrix[PLACE_GLOBAL_QUEUE][TRAN_QUEUE_GLOBAL] = 1;
+/**
+ * fire a base transition on the block of a cpu through its generated
+ * firing function, which folds the arcs of the cpu subnet into constants
+ * and refreshes only the enabled bits the transition can change. checked
+ * firings fail when it is not enabled
+*/
+static bool
+fire_local_transition(int cpu_n, int base_transition, bool checked)
+{
+	volatile uint64_t *word = &resource_net->blocks[cpu_n].mark;
+	uint64_t mark, next;
 
-	//Transitions to go from smp not ready to ready
-	resource_net->incidence_matrix[PLACE_SMP_NOT_READY][TRAN_START_SMP] = -1;
-	resource_net->incidence_matrix[PLACE_SMP_READY][TRAN_START_SMP] = 1;
+	mark = atomic_load_64(word);
+	do {
+		if (checked && (PETRI_MARK_ENABLED(mark) & (1u << base_transition)) == 0)
+			return false;
+		KASSERT((mark & ~resource_net->local[base_transition].required &
+		    resource_net->local[base_transition].produce) == 0,
+		    ("resource net: firing marks a 1-safe place twice"));
+		next = petri_cpu_fire[base_transition](mark);
+	} while (!atomic_fcmpset_64(word, &mark, next));
 
-	//We add a token to SMP NOT READY
-	resource_net->mark[PLACE_SMP_NOT_READY] = 1;
+	publish_enabled(cpu_n, PETRI_MARK_ENABLED(mark ^ next));
+	if ((mark ^ next) & resource_net->published_bits)
+		publish_marked(cpu_n, marked_places(resource_net, mark) ^ marked_places(resource_net, next));
 
-	//cpu pinned array: CPU_NUMBER elems initialized in -1
-	monopolized_cpus_per_proc = (int *)init_pointer(CPU_NUMBER * sizeof(int));
-	memset(monopolized_cpus_per_proc, -1, CPU_NUMBER * sizeof(int));
+	return true;
 }
 
-void
-init_cpu_matrix(int cpu_n)
+/**
+ * recompute the enabled bits of a cpu block for the base transitions
+ * depending on the places that changed between mark and next
+*/
+static __inline uint64_t
+local_mark_refresh(uint64_t mark, uint64_t next)
 {
+	uint64_t changed = (mark ^ next) & PETRI_SAFE_MASK;
+	int counter = PETRI_MARK_COUNTER(mark), next_counter = PETRI_MARK_COUNTER(next);
+	u_int rescan = 0;
 
-	for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++) {
-		for (int num_transition = 0; num_transition < CPU_BASE_TRANSITIONS; num_transition++) {
- 			resource_net->incidence_matrix[PLACE(cpu_n, num_place)][TRANSITION(cpu_n, num_transition)] = base_resource_matrix[num_place][num_transition];
-			resource_net->inhibition_matrix[PLACE(cpu_n, num_place)][TRANSITION(cpu_n, num_transition)] = base_resource_inhibition_matrix[num_place][num_transition];
-		}
+	while (changed != 0) {
+		rescan |= resource_net->local_dependents[ffsll(changed) - 1];
+		changed &= changed - 1;
 	}
 
-	//incidence between each cpu and global resources
-	resource_net->incidence_matrix[PLACE_GLOBAL_QUEUE][TRANSITION(cpu_n, TRAN_FROM_GLOBAL_CPU)] = -1;
+	//a counter that stays above every input weight does not change any enabling
+	if (counter != next_counter &&
+		(counter < resource_net->local_counter_threshold ||
+		next_counter < resource_net->local_counter_threshold))
+		rescan |= resource_net->local_counter_dependents;
 
-	if (cpu_n != 0) { //inhibit executing to cpus other than 0 because smp hasnt started
-		resource_net->inhibition_matrix[PLACE_SMP_NOT_READY][TRANSITION(cpu_n, TRAN_FROM_GLOBAL_CPU)] = 1;
-		resource_net->inhibition_matrix[PLACE_SMP_NOT_READY][TRANSITION(cpu_n, TRAN_EXEC)] = 1;
+	return local_mark_enabled(next, rescan);
+}
+
+static __inline uint64_t
+local_mark_enabled(uint64_t mark, u_int rescan)
+{
+	u_int enabled = PETRI_MARK_ENABLED(mark);
+	int base_transition;
+
+	while (rescan != 0) {
+		base_transition = ffs(rescan) - 1;
+		rescan &= rescan - 1;
+		if (petri_interpreted ?
+		    word_arcs_are_sensitized(&resource_net->local[base_transition], mark) :
+		    petri_cpu_enabled[base_transition](mark))
+			enabled |= (1u << base_transition);
+		else
+			enabled &= ~(1u << base_transition);
 	}
 
-	//inhibit smp execution when not ready
-	resource_net->inhibition_matrix[PLACE_SMP_NOT_READY][TRANSITION(cpu_n, TRAN_ADDTOQUEUE)] = 1;
+	return (mark & ~PETRI_ENABLED_MASK) | ((uint64_t)enabled << PETRI_ENABLED_SHIFT);
 }
 
-void
-init_cpu_mark(int cpu_n)
+/**
+ * mirror the published enablings that changed into the shared cpusets.
+ * a concurrent firing on the same cpu may publish in the opposite order,
+ * so the bit is written again until it matches the block after the write
+*/
+static void
+publish_enabled(int cpu_n, u_int changed)
 {
+	cpuset_t *enabled_cpus;
+	u_int bit, enabled;
+
+	changed &= PETRI_PUBLISHED_TRANSITIONS;
+	while (changed != 0) {
+		enabled_cpus = &resource_net->enabled_cpus[ffs(changed) - 1];
+		bit = changed & -changed;
+		changed &= changed - 1;
+		do {
+			enabled = PETRI_MARK_ENABLED(atomic_load_64(&resource_net->blocks[cpu_n].mark)) & bit;
+			if (enabled)
+				CPU_SET_ATOMIC(cpu_n, enabled_cpus);
+			else
+				CPU_CLR_ATOMIC(cpu_n, enabled_cpus);
+		} while ((PETRI_MARK_ENABLED(atomic_load_64(&resource_net->blocks[cpu_n].mark)) & bit) != enabled);
+	}
+}
 
-	if (cpu_n == 0) //cpu 0 starts executing, others start available
-		resource_net->mark[PLACE(cpu_n, PLACE_EXECUTING)] = 1;
-	else
-		resource_net->mark[PLACE(cpu_n, PLACE_CPU)] = 1;
+/* the same for the published places whose tokens changed */
+static void
+publish_marked(int cpu_n, u_int changed)
+{
+	cpuset_t *marked_cpus;
+	u_int bit, marked;
+
+	while (changed != 0) {
+		marked_cpus = &resource_net->marked_cpus[ffs(changed) - 1];
+		bit = changed & -changed;
+		changed &= changed - 1;
+		do {
+			marked = marked_places(resource_net, atomic_load_64(&resource_net->blocks[cpu_n].mark)) & bit;
+			if (marked)
+				CPU_SET_ATOMIC(cpu_n, marked_cpus);
+			else
+				CPU_CLR_ATOMIC(cpu_n, marked_cpus);
+		} while ((marked_places(resource_net, atomic_load_64(&resource_net->blocks[cpu_n].mark)) & bit) != marked);
+	}
 }
 
-void 
-init_per_cpu_resources(void) 
+/**
+ * only the cpu itself fires the transitions that pick its next thread, so
+ * they are published in order. the cpuset is only written when it changes
+*/
+static __inline void
+publish_idle(int cpu_n, int base_transition)
 {
+	u_int bit = 1u << base_transition;
 
-	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
-		init_cpu_matrix(cpu_n);
-		init_cpu_mark(cpu_n);
-	}
+	if ((PETRI_IDLE_TRANSITIONS & bit) && !CPU_ISSET(cpu_n, resource_net->idle_cpus))
+		CPU_SET_ATOMIC(cpu_n, resource_net->idle_cpus);
+	else if ((PETRI_BUSY_TRANSITIONS & bit) && CPU_ISSET(cpu_n, resource_net->idle_cpus))
+		CPU_CLR_ATOMIC(cpu_n, resource_net->idle_cpus);
 }
 
-void 
-init_resource_net(void)
+/**
+ * per-cpu transitions are enabled when their local arcs are, which is kept
+ * in the cpu block, and their few coordinator arcs are checked on demand
+*/
+bool 
+transition_is_sensitized(int transition_index) 
 {
 
-	init_global_variables();
-	allocate_resource_net();
-	init_per_cpu_resources();
-	init_global_resources();
+	PETRI_NET_ASSERT_READER();
+
+	if (transition_index >= PER_CPU_LAST_TRANSITION)
+		return coordinator_arcs_are_sensitized(transition_index);
 
-	log(LOG_KERN, "Petri scheduler resource net initialized\n");
+	return TRANSITION_IS_ENABLED_ON_CPU(transition_index / CPU_BASE_TRANSITIONS, transition_index % CPU_BASE_TRANSITIONS) &&
+		coordinator_arcs_are_sensitized(transition_index);
 }
 
-static __inline int 
-is_inhibited(int places_index, int transition_index) 
+static __inline bool
+word_arcs_are_sensitized(struct petri_word_arcs *word_arcs, uint64_t mark)
 {
-	return ((resource_net->inhibition_matrix[places_index][transition_index] == 1) && (resource_net->mark[places_index] > 0));
+	int counter = PETRI_MARK_COUNTER(mark);
+
+	return (mark & word_arcs->required) == word_arcs->required &&
+		(mark & word_arcs->inhibit) == 0 &&
+		counter >= word_arcs->tokens &&
+		(!word_arcs->counter_inhibitor || counter == 0);
 }
 
-static __inline int 
-is_hierarchical(int transition) 
+static bool 
+coordinator_arcs_are_sensitized(int transition_index) 
 {
+	struct petri_transition_arcs *transition;
+	struct petri_coordinator_arc *coordinator_arc;
 
-	for (int i = 0; i < HIERARCHICAL_TRANSITIONS; i++) {
-		if (transition == hierarchical_transitions[i] ||
-			((transition < TRAN_REMOVE_GLOBAL_QUEUE) && 
-			(transition % CPU_BASE_TRANSITIONS) == hierarchical_transitions[i]))
-			return hierarchical_corresponse[i];
+	transition = &resource_net->transitions[transition_index];
+	for (int i = transition->coordinator; i < transition->coordinator_end; i++) {
+		coordinator_arc = &resource_net->coordinator_arcs[i];
+		if (!word_arcs_are_sensitized(&coordinator_arc->arcs, atomic_load_64(coordinator_arc->word)))
+			return false;
 	}
-	return 0;
+
+	return true;
 }
 
-bool 
-is_cpu_suspended(int cpu_n)
+/**
+ * first cpu of set from start on, wrapping around to the lowest ones.
+ * returns it plus one like CPU_FFS(), or 0 when set is empty
+*/
+static __inline int
+cpuset_ffs_from(const cpuset_t *set, int start)
 {
-	return resource_net->mark[PLACE(cpu_n, PLACE_SUSPENDED)] > 0;
+	int cpu_n;
+
+	if ((cpu_n = BIT_FFS_AT(CPU_SETSIZE, set, start)) == 0)
+		cpu_n = CPU_FFS(set);
+
+	return cpu_n;
 }
 
 /**
- * fire the transition passed as param to the function
- * and check for automatic transitions to be fired
+ * first cpu of set, only among the ones of group when not NULL, that
+ * can take a thread of proc_id. the search starts from the rotor of this
+ * cpu, cpus whose coordinator arcs do not confirm the published enabling
+ * are dropped from set. returns NOCPU when there is none
 */
-void resource_fire_net(struct thread *pt, int transition_index, char *func)
+static int
+choose_cpu_in(cpuset_t *set, const cpuset_t *group, int proc_id)
 {
+	cpuset_t search;
+	int cpu_n;
 
-	if (pt) {
-		if (!smp_set && smp_started) {
-			smp_set = 1;
-			resource_fire_single_transition(pt, TRAN_START_SMP);
+	if (group != NULL)
+		CPU_AND(&search, set, group);
+	else
+		CPU_COPY(set, &search);
+
+	while ((cpu_n = cpuset_ffs_from(&search, DPCPU_GET(choose_rotor))) != 0) {
+		cpu_n--;
+		if (coordinator_arcs_are_sensitized(TRANSITION(cpu_n, TRAN_ADDTOQUEUE)) &&
+			cpu_available_for_proc(proc_id, cpu_n)) {
+			DPCPU_SET(choose_rotor, (cpu_n + 1) % CPU_NUMBER);
+			return cpu_n;
 		}
+		CPU_CLR(cpu_n, &search);
+		CPU_CLR(cpu_n, set);
+	}
 
-		if (transition_is_sensitized(transition_index)) {
-			if (print > 0) {
-				log(LOG_INFO, "(resource_net) from %s\tThread %2d (%s)\t-> %s\n", func, pt->td_tid, pt->td_proc->p_comm, transitions_names[transition_index]);
-				print--;
-			}
-			resource_fire_single_transition(pt, transition_index);
+	return NOCPU;
+}
 
-		} else {
-			log(LOG_WARNING, "(resource_net) from %s Thread %2d (%s), CPU%2d: %s (%d) no sensibilizada\n", func, pt->td_tid, pt->td_proc->p_comm, PCPU_GET(cpuid), transitions_names[transition_index], transition_index);
-			print_resource_net();
-		} 
+/**
+ * the cpus of the thread cpuset where addtoqueue is enabled, not suspended
+ * nor monopolized: the thread did not monopolize any cpu, so every
+ * monopolized one is taken
+*/
+static __inline void
+choose_candidates(struct thread *td, cpuset_t *candidates)
+{
+
+	CPU_AND(candidates, &td->td_cpuset->cs_mask, &resource_net->enabled_cpus[TRAN_ADDTOQUEUE]);
+	CPU_ANDNOT(candidates, candidates, &resource_net->marked_cpus[PLACE_SUSPENDED]);
+	CPU_ANDNOT(candidates, candidates, &monopolized_cpus);
+}
+
+/**
+ * the cpu a thread just woken by another one is queued to when that same
+ * thread woke it at least petri_wake_affine times in a row, so the data
+ * the waker left in its cache is still there: the last cpu of td when it
+ * is idle and shares the cache of the waker, another idle cpu sharing it
+ * or its last level cache, else the cpu of the waker itself when neither
+ * its queue nor the global queue it pulls from hold a thread it could run
+ * before td. returns NOCPU when td was not just woken, its process
+ * monopolized a cpu or none of those cpus can take it, the usual choice
+ * applies then
+*/
+int
+resource_wake_affine_cpu(struct thread *td)
+{
+	cpuset_t candidates, idle;
+	const cpuset_t *cache;
+	int cpu_n, last_cpu, proc_id, waker_cpu, level;
+
+	waker_cpu = td->td_petri_wakecpu;
+	if (petri_wake_affine == 0 || waker_cpu == NOCPU || td->td_petri_wakes < petri_wake_affine)
+		return NOCPU;
+	proc_id = td->td_proc->p_pid;
+	if (get_monopolized_cpu_by_proc_id(proc_id) != -1)
+		return NOCPU;
+
+	choose_candidates(td, &candidates);
+	CPU_AND(&idle, &candidates, resource_net->idle_cpus);
+	cache = PETRI_TOPO_GROUP(resource_net, waker_cpu, PETRI_TOPO_CACHE);
+
+	last_cpu = td->td_lastcpu;
+	if (last_cpu != NOCPU &&
+		CPU_ISSET(last_cpu, &idle) &&
+		CPU_ISSET(last_cpu, cache) &&
+		transition_is_sensitized(TRANSITION(last_cpu, TRAN_ADDTOQUEUE)) &&
+		cpu_available_for_proc(proc_id, last_cpu))
+			return last_cpu;
+	for (level = PETRI_TOPO_CACHE; level <= PETRI_TOPO_LLC; level++)
+		if ((cpu_n = choose_cpu_in(&idle, PETRI_TOPO_GROUP(resource_net, waker_cpu, level),
+			proc_id)) != NOCPU)
+			return cpu_n;
+
+	if (CPU_ISSET(waker_cpu, &candidates) &&
+		resource_net_place_tokens(resource_net, PLACE(waker_cpu, PLACE_QUEUE)) == 0 &&
+		resource_net_place_tokens(resource_net,
+		PLACE_GLOBAL_QUEUE_OF(GLOBAL_QUEUE_OF_CPU(waker_cpu))) == 0 &&
+		transition_is_sensitized(TRANSITION(waker_cpu, TRAN_ADDTOQUEUE)) &&
+		cpu_available_for_proc(proc_id, waker_cpu))
+			return waker_cpu;
+
+	return NOCPU;
+}
+
+/**
+ * count the load, the busy cpus plus the threads queued and one more, and
+ * the cpus that are neither suspended nor monopolized. the marking is read
+ * without a lock
+*/
+static void
+pack_count_load(void)
+{
+	int cpu_n, queue, active, load;
+
+	active = 0;
+	load = 1;
+	for (cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		if (CPU_ISSET(cpu_n, &resource_net->marked_cpus[PLACE_SUSPENDED]) ||
+			CPU_ISSET(cpu_n, &monopolized_cpus))
+			continue;
+		active++;
+		load += resource_net_place_tokens(resource_net, PLACE(cpu_n, PLACE_QUEUE)) +
+			!CPU_ISSET(cpu_n, resource_net->idle_cpus);
 	}
+	for (queue = 0; queue < GLOBAL_QUEUES; queue++)
+		load += resource_net_place_tokens(resource_net, PLACE_GLOBAL_QUEUE_OF(queue));
+
+	pack_active = active;
+	pack_load = load;
 }
 
 /**
- * update the resource net state and in case
- * of firing a transition hierarchical to another
- * in the threads net, fire the hierarchical transition
+ * whether threads are packed on the busy cpus: packing is on, they did not
+ * wait too long in the run queues lately and the load is under petri_pack
+ * percent of the active cpus. the load is counted once a tick, not on each
+ * sched_add(), and every thread packed since adds one to it, so a burst of
+ * wakeups stops packing at the threshold. threads that left the queues in
+ * the meantime are only seen on the next tick. a thread racing the count
+ * is just spread or packed once
 */
-static void 
-resource_fire_single_transition(struct thread *pt, int transition_index) 
+static bool
+pack_applies(void)
 {
-	int local_transition = 0;
-	
-	//Fire cpu net	
-	for (int num_place = 0; num_place < CPU_NUMBER_PLACES; num_place++)
-		resource_net->mark[num_place] += resource_net->incidence_matrix[num_place][transition_index];
-	
-	local_transition = is_hierarchical(transition_index);
-	if (local_transition) //If we need to fire a local thread transition we fire it here
-		thread_petri_fire(pt, local_transition, print); 
+	int tick;
+
+	if (petri_pack == 0 || pack_spreading)
+		return false;
+
+	tick = ticks;
+	if (pack_tick != tick) {
+		pack_tick = tick;
+		pack_count_load();
+	}
+
+	return pack_load * 100 < petri_pack * pack_active;
 }
 
-bool 
-transition_is_sensitized(int transition_index) 
+/* 0 for the same cpu, then 1 plus the first PETRI_TOPO level they share */
+static __inline int
+topo_distance(int from, int to)
 {
 
-	for (int places_index = 0; places_index < CPU_NUMBER_PLACES; places_index++) {
-		if (((resource_net->incidence_matrix[places_index][transition_index] < 0) && 
-			//If incidence is positive we really dont care if there are tokens or not
-			((resource_net->incidence_matrix[places_index][transition_index] + resource_net->mark[places_index]) < 0)) ||
-			is_inhibited(places_index, transition_index)) {
-			return false;
+	if (from == to)
+		return 0;
+	for (int level = 0; from != NOCPU && level < PETRI_TOPO_LEVELS; level++)
+		if (CPU_ISSET(to, PETRI_TOPO_GROUP(resource_net, from, level)))
+			return level + 1;
+
+	return PETRI_TOPO_LEVELS + 1;
+}
+
+/**
+ * the busy cpu td is packed on while pack_applies(), so the idle ones are
+ * not woken and stay idle long enough to reach their deep sleep states:
+ * the candidate with the fewest threads queued, the nearest to the last
+ * cpu of td among them, the lowest one last. returns NOCPU when td goes
+ * where it would without packing, also when its process monopolized a
+ * cpu or no busy cpu can take it
+*/
+int
+resource_pack_cpu(struct thread *td)
+{
+	cpuset_t busy;
+	int cpu_n, best, tokens, best_tokens, distance, best_distance, proc_id;
+
+	if (!pack_applies())
+		return NOCPU;
+	proc_id = td->td_proc->p_pid;
+	if (get_monopolized_cpu_by_proc_id(proc_id) != -1)
+		return NOCPU;
+
+	choose_candidates(td, &busy);
+	CPU_ANDNOT(&busy, &busy, resource_net->idle_cpus);
+	for (;;) {
+		best = NOCPU;
+		best_tokens = best_distance = 0;
+		for (cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+			if (!CPU_ISSET(cpu_n, &busy))
+				continue;
+			tokens = resource_net_place_tokens(resource_net, PLACE(cpu_n, PLACE_QUEUE));
+			distance = topo_distance(td->td_lastcpu, cpu_n);
+			if (best == NOCPU || tokens < best_tokens ||
+				(tokens == best_tokens && distance < best_distance)) {
+				best = cpu_n;
+				best_tokens = tokens;
+				best_distance = distance;
+			}
+		}
+		if (best == NOCPU)
+			return NOCPU;
+		//the cpusets may be briefly behind the marking
+		if (transition_is_sensitized(TRANSITION(best, TRAN_ADDTOQUEUE)) &&
+			cpu_available_for_proc(proc_id, best)) {
+			atomic_add_int(&pack_load, 1);
+			return best;
 		}
+		CPU_CLR(best, &busy);
 	}
+}
 
-	return true;
+/**
+ * account the us a thread waited in a run queue before it ran. once their
+ * average goes over petri_pack_wait the threads spread again, until it
+ * falls under half of it. the average is kept without a lock, a wait lost
+ * to a race does not matter
+*/
+void
+resource_pack_waited(int wait)
+{
+	int avg;
+
+	if (petri_pack == 0)
+		return;
+
+	avg = pack_wait_avg;
+	avg += (wait - avg) / 8;
+	pack_wait_avg = avg;
+	if (avg > petri_pack_wait)
+		pack_spreading = true;
+	else if (avg < petri_pack_wait / 2)
+		pack_spreading = false;
 }
 
 /**
  * similar functioning to sched_4bsd pickcpu, but adding monopolizing cpus by threads
- * first check if the thread monopolized a cpu
- * if not, check if last cpu used by thread is available
- * and then check for other cpu availables to queue
+ * and the cache topology. first check if the thread monopolized a cpu
+ * that still takes threads, a suspended one is skipped like the others,
+ * and whether it goes near the thread that woke it, see
+ * resource_wake_affine_cpu(), or is packed on a busy cpu, see
+ * resource_pack_cpu(). if not, pick a cpu to queue from the
+ * published cpusets: the ones of the thread cpuset where addtoqueue is
+ * enabled, not suspended nor monopolized.
+ * the last cpu of the thread if it is idle, then an idle cpu sharing its
+ * cache, its last level cache or its domain, then any idle one. when all
+ * of them are busy, the last cpu again, then one of its domain, then any.
+ * each cpu starts looking after the cpu it picked last, so the choices
+ * within a group spread over it instead of piling on its lowest cpu
 */
 int 
 resource_choose_cpu(struct thread* td) 
 {
-	int monopolized_cpu, last_cpu, proc_id;
+	cpuset_t candidates, idle;
+	int cpu_n, monopolized_cpu, last_cpu, proc_id;
 
 	proc_id = td->td_proc->p_pid;
 
 	monopolized_cpu = get_monopolized_cpu_by_proc_id(proc_id);
-	if (monopolized_cpu != -1)
+	if (monopolized_cpu != -1 &&
+		transition_is_sensitized(TRANSITION(monopolized_cpu, TRAN_ADDTOQUEUE)))
 		return TRANSITION(monopolized_cpu, TRAN_ADDTOQUEUE);
-	
+
+	if ((cpu_n = resource_wake_affine_cpu(td)) != NOCPU ||
+		(cpu_n = resource_pack_cpu(td)) != NOCPU)
+		return TRANSITION(cpu_n, TRAN_ADDTOQUEUE);
+
+	choose_candidates(td, &candidates);
+	CPU_AND(&idle, &candidates, resource_net->idle_cpus);
+
 	last_cpu = td->td_lastcpu;
 	if (last_cpu != NOCPU && 
 		THREAD_CAN_SCHED(td, last_cpu) &&
+		CPU_ISSET(last_cpu, &idle) &&
 		transition_is_sensitized(TRANSITION(last_cpu, TRAN_ADDTOQUEUE)) &&
 		cpu_available_for_proc(proc_id, last_cpu))
 			return TRANSITION(last_cpu, TRAN_ADDTOQUEUE);
 
-	//Only check for transitions of addtoqueue
-	for (int transition_index = TRAN_ADDTOQUEUE; transition_index < PER_CPU_LAST_TRANSITION; transition_index += CPU_BASE_TRANSITIONS) {
-		int cpu_number = (transition_index / CPU_BASE_TRANSITIONS);
-		if (THREAD_CAN_SCHED(td, cpu_number) &&
-			transition_is_sensitized(transition_index) &&
-			cpu_available_for_proc(proc_id, cpu_number))
-			return transition_index;
-	}
+	//the cpusets may be briefly behind the marking, the coordinator arcs confirm
+	for (int level = 0; last_cpu != NOCPU && level < PETRI_TOPO_LEVELS; level++)
+		if ((cpu_n = choose_cpu_in(&idle, PETRI_TOPO_GROUP(resource_net, last_cpu, level), proc_id)) != NOCPU)
+			return TRANSITION(cpu_n, TRAN_ADDTOQUEUE);
+	if ((cpu_n = choose_cpu_in(&idle, NULL, proc_id)) != NOCPU)
+		return TRANSITION(cpu_n, TRAN_ADDTOQUEUE);
+
+	if (last_cpu != NOCPU && 
+		THREAD_CAN_SCHED(td, last_cpu) &&
+		transition_is_sensitized(TRANSITION(last_cpu, TRAN_ADDTOQUEUE)) &&
+		cpu_available_for_proc(proc_id, last_cpu))
+			return TRANSITION(last_cpu, TRAN_ADDTOQUEUE);
+
+	if (last_cpu != NOCPU &&
+		(cpu_n = choose_cpu_in(&candidates, PETRI_TOPO_GROUP(resource_net, last_cpu, PETRI_TOPO_DOMAIN),
+		proc_id)) != NOCPU)
+		return TRANSITION(cpu_n, TRAN_ADDTOQUEUE);
+	if ((cpu_n = choose_cpu_in(&candidates, NULL, proc_id)) != NOCPU)
+		return TRANSITION(cpu_n, TRAN_ADDTOQUEUE);
 	
 	return TRAN_QUEUE_GLOBAL;
 }
 
+/**
+ * the cpus an ipi may wake for td: idle ones of its cpuset that are not
+ * suspended, leaving out the ones monopolized by another process. the
+ * published cpusets are read without a lock, a cpu that stopped being idle
+ * meanwhile just takes an ast it does not need
+*/
+void
+resource_wakeup_cpus(struct thread *td, cpuset_t *cpus)
+{
+	cpuset_t taken;
+	int cpu_n;
+
+	CPU_AND(cpus, &td->td_cpuset->cs_mask, resource_net->idle_cpus);
+	CPU_ANDNOT(cpus, cpus, &resource_net->marked_cpus[PLACE_SUSPENDED]);
+	CPU_AND(&taken, cpus, &monopolized_cpus);
+	while ((cpu_n = CPU_FFS(&taken)) != 0) {
+		cpu_n--;
+		if (!cpu_available_for_proc(td->td_proc->p_pid, cpu_n))
+			CPU_CLR(cpu_n, cpus);
+		CPU_CLR(cpu_n, &taken);
+	}
+}
+
+/**
+ * the cpu whose queue an idle cpu_n steals a thread from: the one with the
+ * most tokens in its queue among the cpus sharing its cache, then its last
+ * level cache, then its domain, then all of them. idle cpus were already
+ * kicked to take their own threads and monopolized ones keep them for
+ * their process. the cpus of tried, where the caller found no thread it
+ * could take, are skipped. returns NOCPU when there is none, or while
+ * threads are packed on the busy cpus, see resource_pack_cpu()
+*/
+int
+resource_choose_victim(int cpu_n, const cpuset_t *tried)
+{
+	const cpuset_t *group;
+	int victim, best, tokens, best_tokens;
+
+	if (pack_applies())
+		return NOCPU;
+
+	for (int level = 0; level <= PETRI_TOPO_LEVELS; level++) {
+		group = level < PETRI_TOPO_LEVELS ? PETRI_TOPO_GROUP(resource_net, cpu_n, level) : NULL;
+		best = NOCPU;
+		best_tokens = 0;
+		for (victim = 0; victim < CPU_NUMBER; victim++) {
+			if (victim == cpu_n || (group != NULL && !CPU_ISSET(victim, group)) ||
+				CPU_ISSET(victim, tried) || CPU_ISSET(victim, resource_net->idle_cpus) ||
+				CPU_ISSET(victim, &monopolized_cpus))
+				continue;
+			tokens = resource_net_place_tokens(resource_net, PLACE(victim, PLACE_QUEUE));
+			if (tokens > best_tokens) {
+				best = victim;
+				best_tokens = tokens;
+			}
+		}
+		if (best != NOCPU)
+			return best;
+	}
+
+	return NOCPU;
+}
+
+/**
+ * the most and the least loaded cpus of group, or of all of them when
+ * NULL, for the balancer to move queued threads between. the load of a
+ * cpu is the tokens of its queue plus one when it is not idle. suspended
+ * and monopolized cpus are left out. returns the difference of their loads,
+ * 0 when the group has less than two of them or while threads are packed
+ * on the busy cpus, see resource_pack_cpu()
+*/
+int
+resource_balance_pair(const cpuset_t *group, int *from, int *to)
+{
+	int cpu_n, load, most, least;
+
+	*from = *to = NOCPU;
+	if (pack_applies())
+		return 0;
+	most = least = 0;
+	for (cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		if ((group != NULL && !CPU_ISSET(cpu_n, group)) ||
+			CPU_ISSET(cpu_n, &resource_net->marked_cpus[PLACE_SUSPENDED]) ||
+			CPU_ISSET(cpu_n, &monopolized_cpus))
+			continue;
+		load = resource_net_place_tokens(resource_net, PLACE(cpu_n, PLACE_QUEUE)) +
+			!CPU_ISSET(cpu_n, resource_net->idle_cpus);
+		if (*from == NOCPU || load > most) {
+			*from = cpu_n;
+			most = load;
+		}
+		if (*to == NOCPU || load < least) {
+			*to = cpu_n;
+			least = load;
+		}
+	}
+
+	return *from == *to ? 0 : most - least;
+}
+
+/**
+ * the global queue an idle cpu_n pulls a thread from when its own is
+ * empty: the one with the most tokens among the queues of its domain, the
+ * ones of other domains only when those are empty too. the queues set in
+ * tried, where the caller found no thread it could take, are skipped.
+ * returns -1 when there is none
+*/
+int
+resource_choose_global_queue(int cpu_n, const cpuset_t *tried)
+{
+	const cpuset_t *domain = PETRI_TOPO_GROUP(resource_net, cpu_n, PETRI_TOPO_DOMAIN);
+	int queue, best, tokens, best_tokens;
+	bool local, best_local;
+
+	best = -1;
+	best_tokens = 0;
+	best_local = false;
+	for (queue = 0; queue < GLOBAL_QUEUES; queue++) {
+		if (queue == GLOBAL_QUEUE_OF_CPU(cpu_n) || CPU_ISSET(queue, tried) ||
+			(tokens = resource_net_place_tokens(resource_net, PLACE_GLOBAL_QUEUE_OF(queue))) == 0)
+			continue;
+		local = CPU_ISSET(CPU_FFS(&global_queue_cpus[queue]) - 1, domain);
+		if (best == -1 || (local && !best_local) || (local == best_local && tokens > best_tokens)) {
+			best = queue;
+			best_tokens = tokens;
+			best_local = local;
+		}
+	}
+
+	return best;
+}
+
 void 
 resource_expulse_thread(struct thread *td, int flags, char *func) 
 {
@@ -331,34 +2138,57 @@ resource_expulse_thread(struct thread *td, int flags, char *func)
 	transition_number = (flags & SW_VOL) ? 
 						TRANSITION(td->td_lastcpu, TRAN_RETURN_VOL) : 
 						TRANSITION(td->td_lastcpu, TRAN_RETURN_INVOL);
-	td->td_frominh = (flags & SW_VOL) ? 1 : 0;
-		
+	if (flags & SW_VOL)
+		td->td_petri_state |= TD_PETRI_FROMINH;
+	else
+		td->td_petri_state &= ~TD_PETRI_FROMINH;
+
+	PETRI_TRACE_HOOK(td, PETRI_TRACE_SWITCH, td->td_lastcpu, flags, transition_number);
 	resource_fire_net(td, transition_number, func);
 }
 
 bool 
 toggle_active_cpu(int cpu, bool turn_off)
 {
+	bool fired, ready;
 
 	if (cpu <= 0 || cpu >= CPU_NUMBER) {
 		log(LOG_WARNING, "CPU %d on-off state cannot be changed\n", cpu);
 		return false;
 	}
 
-	if (resource_net->mark[PLACE_SMP_READY] == 0) {
-		log(LOG_WARNING, "cannot change CPU on-off state before SMP_READY\n");
-		return false;
-	}
-
 	int transition = turn_off ? TRAN_SUSPEND_PROC : TRAN_WAKEUP_PROC;
 	char *action = turn_off ? "turned off" : "turned on";
 
-	if (transition_is_sensitized(TRANSITION(cpu, transition))) {
+	//with the run queue lock of the cpu, which sched_add() checks ADDTOQUEUE under
+	//before firing it unchecked, so no thread is queued to a cpu suspended in between.
+	//the net is read with interrupts disabled like in the hooks, see resource_net
+	if (petri_lock_cpu != NULL)
+		petri_lock_cpu(cpu);
+	spinlock_enter();
+	ready = resource_net_tokens(PLACE_SMP_READY) != 0;
+	if (ready)
+		PETRI_TRACE_HOOK(curthread, turn_off ? PETRI_TRACE_SUSPEND : PETRI_TRACE_WAKEUP, cpu, 0,
+		    TRANSITION(cpu, transition));
+	fired = ready && transition_is_sensitized(TRANSITION(cpu, transition));
+	if (fired) {
 		//if turning on, we need to check if its already on? i.e. if i can suspend it
 		//because i have doubts that if im not suspended, i can trigger TRAN_WAKEUP_PROC multiple times
 		resource_fire_net(curthread, TRANSITION(cpu, transition), action);
+	}
+	spinlock_exit();
+	if (petri_unlock_cpu != NULL)
+		petri_unlock_cpu(cpu);
+	if (!ready) {
+		log(LOG_WARNING, "cannot change CPU on-off state before SMP_READY\n");
+		return false;
+	}
+	if (fired) {
+		//nothing is queued to a suspended cpu anymore, what already was leaves
+		if (turn_off && petri_drain_cpu != NULL)
+			petri_drain_cpu(cpu);
 		return true;
-	} 
+	}
 		
 	log(LOG_WARNING, "CPU %d cannot be %s\n", cpu, action);
 
@@ -390,7 +2220,9 @@ toggle_pin_cpu_to_proc(int proc_id, int cpu, bool release)
 	}
 
 	if (release) { //early release
+		PETRI_TRACE_HOOK(curthread, PETRI_TRACE_RELEASE, cpu, proc_id, 0);
 		monopolized_cpus_per_proc[cpu] = -1;
+		CPU_CLR_ATOMIC(cpu, &monopolized_cpus);
 		log(LOG_INFO, "CPU %d released by Process %2d\n", cpu, proc_id);
 		return true;
 	}
@@ -398,7 +2230,9 @@ toggle_pin_cpu_to_proc(int proc_id, int cpu, bool release)
 	if (!cpu_available_for_proc(proc_id, cpu) || is_cpu_suspended(cpu) || (proc_id < 1))
 		return false;
 		
+	PETRI_TRACE_HOOK(curthread, PETRI_TRACE_MONOPOLIZE, cpu, proc_id, 0);
 	monopolized_cpus_per_proc[cpu] = proc_id; //monopolize
+	CPU_SET_ATOMIC(cpu, &monopolized_cpus);
 	log(LOG_INFO, "CPU %d monopolized by Process %2d\n", cpu, proc_id);
 
 	return true;
@@ -425,15 +2259,26 @@ cpu_available_for_proc(int proc_id, int cpu)
 	return (monopolized_cpus_per_proc[cpu] == proc_id || monopolized_cpus_per_proc[cpu] == -1);
 }
 
+/**
+ * the cpu proc_id monopolized, or -1. only the cpus of monopolized_cpus are
+ * looked at, so with none monopolized it costs a cpuset test, not a scan
+ * of every cpu on each sched_add()
+*/
 int 
 get_monopolized_cpu_by_proc_id(int proc_id) 
 {
-    
-	for (int i = 0; i < CPU_NUMBER; i++) 
-        if (monopolized_cpus_per_proc[i] == proc_id) 
-            return i;
+	cpuset_t taken;
+	int cpu_n;
+
+	CPU_COPY(&monopolized_cpus, &taken);
+	while ((cpu_n = CPU_FFS(&taken)) != 0) {
+		cpu_n--;
+		if (monopolized_cpus_per_proc[cpu_n] == proc_id)
+			return cpu_n;
+		CPU_CLR(cpu_n, &taken);
+	}
 
-    return -1;
+	return -1;
 }
 
 void
@@ -452,11 +2297,11 @@ print_resource_net(void)
 		log(LOG_WARNING, "\t(resource_net) CPU%2d: ", cpu_n);
 		
 		for (int i = 0; i < CPU_BASE_PLACES; i++) {
-				log(LOG_WARNING, "%s (%d) | ", cpu_places_names[i], resource_net->mark[i + cpu_base_place]);
+				log(LOG_WARNING, "%s (%d) | ", cpu_places_names[i], resource_net_tokens(i + cpu_base_place));
 		}
 		log(LOG_WARNING, "\n");
 	}
-	log(LOG_WARNING, "\t(resource_net) Cola global: %d | SMP_%s\n", resource_net->mark[PLACE_GLOBAL_QUEUE], resource_net->mark[PLACE_SMP_NOT_READY] == 1 ? "NOT_READY" : "READY");
+	log(LOG_WARNING, "\t(resource_net) Cola global: %d | SMP_%s\n", resource_net_tokens(PLACE_GLOBAL_QUEUE), resource_net_tokens(PLACE_SMP_NOT_READY) == 1 ? "NOT_READY" : "READY");
 }
 
 /**
@@ -465,18 +2310,6 @@ print_resource_net(void)
  * causes that the syscall never fail to alloc memory
  * i.e., keeps waiting until mem is available
 */
-void** 
-init_double_pointer(int rows, int cols, size_t size) 
-{
-
-    void** pointer = malloc(rows * sizeof(void*), M_DEVBUF, MALLOC_FLAGS);
-
-    for (int i = 0; i < rows; i++) 
-        pointer[i] = malloc(cols * size, M_DEVBUF, MALLOC_FLAGS);
-
-    return pointer;
-}
-
 void * 
 init_pointer(size_t size) 
 {
@@ -0,0 +1,179 @@
+/*
+ * petri_net_image.c: builds the resource net from an image preloaded by the
+ * loader instead of the built-in one, and swaps the running net for the one
+ * of another image through kern.sched.petri_net.image.
+ *
+ * The format of the images and how they are checked and built are in
+ * sys/petri_net_image.h and petri_global_net.c.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/linker.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/sched.h>
+#include <sys/smp.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/syslog.h>
+#include <sys/petri_net_image.h>
+#include <sys/sched_petri.h>
+
+/* what the rendezvous of a swap needs, the net is only installed by the cpu that built it */
+struct petri_net_swap {
+	struct petri_cpu_resource_net *net;
+	int cpu;
+	int error;
+};
+
+static char petri_net_file[MAXPATHLEN];
+/* held by the swaps and by the sysctls reading resource_net with interrupts enabled */
+static struct sx petri_net_lock;
+
+SX_SYSINIT(petri_net_lock, &petri_net_lock, "petri net swap");
+
+SYSCTL_NODE(_kern_sched, OID_AUTO, petri_net, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "Resource net of SCHED_PETRI");
+SYSCTL_STRING(_kern_sched_petri_net, OID_AUTO, file, CTLFLAG_RDTUN, petri_net_file,
+    sizeof(petri_net_file), "Preloaded net image to build the net from");
+
+/**
+ * pick the image the loader preloaded, before sched_setup() builds the net.
+ * kern.sched.petri_net.file selects it by name when several were preloaded,
+ * otherwise the first one of type petri_net is used
+*/
+static void
+petri_net_preload(void *dummy __unused)
+{
+	caddr_t file;
+	void *image;
+
+	if (petri_net_file[0] != '\0')
+		file = preload_search_by_name(petri_net_file);
+	else
+		file = preload_search_by_type(PETRI_NET_IMAGE_TYPE);
+	if (file == NULL)
+		return;
+
+	image = preload_fetch_addr(file);
+	if (image == NULL || petri_net_use_image(image, preload_fetch_size(file)) != 0)
+		printf("petri: preloaded net image is not usable, using the built-in net\n");
+}
+
+SYSINIT(petri_net_preload, SI_SUB_CPU, SI_ORDER_ANY, petri_net_preload, NULL);
+
+static int
+sysctl_petri_net_name(SYSCTL_HANDLER_ARGS)
+{
+	int error;
+
+	sx_slock(&petri_net_lock);
+	error = sysctl_handle_string(oidp, resource_net->image->pni_name, 0, req);
+	sx_sunlock(&petri_net_lock);
+
+	return (error);
+}
+
+SYSCTL_PROC(_kern_sched_petri_net, OID_AUTO, name, CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+    NULL, 0, sysctl_petri_net_name, "A", "Name of the running net");
+
+static void
+petri_net_swap_action(void *arg)
+{
+	struct petri_net_swap *swap = arg;
+
+	if (curcpu == swap->cpu)
+		swap->error = install_resource_net(swap->net);
+}
+
+/**
+ * reading returns the image of the running net. writing an image builds
+ * its net and installs it while every cpu waits in a rendezvous with
+ * interrupts disabled, and the marking is carried over. resource_net is
+ * only read with interrupts disabled or under petri_net_lock (see
+ * sys/sched_petri.h), so once the rendezvous is over no cpu is still
+ * reading the previous net and it is freed right away
+*/
+static int
+sysctl_petri_net_image(SYSCTL_HANDLER_ARGS)
+{
+	struct petri_cpu_resource_net *previous;
+	struct petri_net_image *image;
+	struct petri_net_swap swap;
+	size_t size;
+	int error;
+
+	sx_xlock(&petri_net_lock);
+	error = SYSCTL_OUT(req, resource_net->image, resource_net->image_size);
+	if (error != 0 || req->newptr == NULL)
+		goto out;
+
+	size = req->newlen - req->newidx;
+	if (size > PETRI_NET_IMAGE_SIZE(PETRI_NET_IMAGE_ARCS)) {
+		error = E2BIG;
+		goto out;
+	}
+	image = malloc(size, M_DEVBUF, M_WAITOK);
+	error = SYSCTL_IN(req, image, size);
+	if (error == 0)
+		error = petri_net_image_check(image, size);
+	if (error != 0) {
+		free(image, M_DEVBUF);
+		goto out;
+	}
+
+	swap.net = build_resource_net(image);
+	swap.error = 0;
+	free(image, M_DEVBUF);
+
+	previous = resource_net;
+	sched_pin();
+	swap.cpu = curcpu;
+	smp_rendezvous(NULL, petri_net_swap_action, NULL, &swap);
+	sched_unpin();
+
+	error = swap.error;
+	if (error != 0) {
+		free_resource_net(swap.net);
+		goto out;
+	}
+	free_resource_net(previous);
+	log(LOG_INFO, "Petri scheduler resource net %s installed\n", resource_net->image->pni_name);
+
+out:
+	sx_xunlock(&petri_net_lock);
+
+	return (error);
+}
+
+SYSCTL_PROC(_kern_sched_petri_net, OID_AUTO, image, CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_MPSAFE,
+    NULL, 0, sysctl_petri_net_image, "S,petri_net_image", "Image of the running net, write to swap it");
+
+/**
+ * the generated functions only fire the cpu subnet of petri_net.def, nets
+ * built from other images stay interpreted
+*/
+static int
+sysctl_petri_interpreted(SYSCTL_HANDLER_ARGS)
+{
+	int error, value = petri_interpreted;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	sx_slock(&petri_net_lock);
+	if (value == 0 && !resource_net->generated)
+		error = EINVAL;
+	else
+		petri_interpreted = value != 0;
+	sx_sunlock(&petri_net_lock);
+
+	return (error);
+}
+
+SYSCTL_PROC(_kern_sched, OID_AUTO, petri_interpreted, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE,
+    NULL, 0, sysctl_petri_interpreted, "I",
+    "Fire the petri nets through their matrices instead of the generated functions");
@@ -0,0 +1,124 @@
+/*
+ * petri_trace.c: per-cpu rings with the firings of the resource net and
+ * the scheduler hooks, and the /dev/petri_trace device that maps them to
+ * userspace.
+ *
+ * The rings are filled by trace_record() in petri_global_net.c, see
+ * sys/petri_trace.h for their layout and how to read them.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/conf.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/mman.h>
+#include <sys/smp.h>
+#include <sys/sysctl.h>
+#include <sys/petri_trace.h>
+#include <sys/sched_petri.h>
+
+#include <vm/vm.h>
+#include <vm/pmap.h>
+
+char *petri_trace_base = NULL;
+size_t petri_trace_ring_size = 0;
+int petri_trace_enabled = 1;
+
+static size_t petri_trace_size = 0;
+static int petri_trace_records = PETRI_TRACE_RECORDS;
+static struct cdev *petri_trace_dev;
+
+CTASSERT(sizeof(struct petri_trace_record) == 32);
+CTASSERT(sizeof(struct petri_trace_ring) == CACHE_LINE_SIZE);
+
+SYSCTL_NODE(_kern_sched, OID_AUTO, petri_trace, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "Trace of the resource net firings");
+SYSCTL_INT(_kern_sched_petri_trace, OID_AUTO, enabled, CTLFLAG_RW, &petri_trace_enabled, 0,
+    "Record every firing of the resource net");
+SYSCTL_INT(_kern_sched_petri_trace, OID_AUTO, records, CTLFLAG_RDTUN, &petri_trace_records, 0,
+    "Records in the ring of each cpu");
+
+/**
+ * writing any value records the marking of the whole net, for a replay
+ * to start from
+*/
+static int
+sysctl_petri_trace_snapshot(SYSCTL_HANDLER_ARGS)
+{
+	int error, value = 0;
+
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (petri_trace_base == NULL || !petri_trace_enabled)
+		return (ENXIO);
+
+	petri_trace_snapshot();
+
+	return (0);
+}
+
+SYSCTL_PROC(_kern_sched_petri_trace, OID_AUTO, snapshot, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE,
+    NULL, 0, sysctl_petri_trace_snapshot, "I", "Record the marking of the net in the trace");
+
+static d_mmap_t petri_trace_mmap;
+
+static struct cdevsw petri_trace_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_mmap =		petri_trace_mmap,
+	.d_name =		PETRI_TRACE_DEVICE,
+};
+
+/**
+ * the rings are only written by the kernel, userspace gets them read-only
+*/
+static int
+petri_trace_mmap(struct cdev *dev, vm_ooffset_t offset, vm_paddr_t *paddr,
+    int nprot, vm_memattr_t *memattr)
+{
+
+	if ((nprot & (PROT_WRITE | PROT_EXEC)) != 0)
+		return (EACCES);
+	if (offset < 0 || offset >= petri_trace_size)
+		return (EINVAL);
+
+	*paddr = vtophys(petri_trace_base + offset);
+
+	return (0);
+}
+
+static void
+petri_trace_init(void *dummy __unused)
+{
+	struct petri_trace_ring *ring;
+	int records = petri_trace_records;
+	char *base;
+
+	if (records < 2)
+		records = 2;
+	if (!powerof2(records))
+		records = 1 << fls(records);
+	petri_trace_records = records;
+
+	petri_trace_ring_size = round_page(sizeof(struct petri_trace_ring) +
+	    records * sizeof(struct petri_trace_record));
+	petri_trace_size = (mp_maxid + 1) * petri_trace_ring_size;
+	base = (char *)malloc_aligned(petri_trace_size, PAGE_SIZE, M_DEVBUF, M_WAITOK | M_ZERO);
+
+	for (u_int cpu = 0; cpu <= mp_maxid; cpu++) {
+		ring = (struct petri_trace_ring *)(base + cpu * petri_trace_ring_size);
+		ring->ptr_version = PETRI_TRACE_VERSION;
+		ring->ptr_ncpu = mp_maxid + 1;
+		ring->ptr_records = records;
+		ring->ptr_size = petri_trace_ring_size;
+	}
+
+	//publish the rings only once their headers are written
+	atomic_store_rel_ptr((volatile uintptr_t *)&petri_trace_base, (uintptr_t)base);
+
+	petri_trace_dev = make_dev(&petri_trace_cdevsw, 0, UID_ROOT, GID_WHEEL, 0400,
+	    PETRI_TRACE_DEVICE);
+}
+
+SYSINIT(petri_trace, SI_SUB_DRIVERS, SI_ORDER_ANY, petri_trace_init, NULL);
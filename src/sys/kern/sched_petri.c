@@ -2,20 +2,13 @@
 #include <sys/sysctl.h>
 #include <sys/syslog.h>
 
+/* matrices and next-state table of the thread net, built from kern/petri_net.def */
+#include "petri_thread_net.h"
+
 SYSCTL_STRING(_kern_sched, OID_AUTO, cpu_sel, CTLFLAG_RD, "PETRI", 0,
     "Scheduler pickcpu method");
 
 /* GLOBAL VARIABLES */
-const int incidence_matrix[THREADS_PLACES_SIZE][THREADS_TRANSITIONS_SIZE] = {
-	{-1,  0,  0,  0,  0,  0,  0},
-	{ 1, -1,  0,  1,  0,  1,  1},
-	{ 0,  1, -1,  0,  0,  0, -1},
-	{ 0,  0,  1, -1, -1,  0,  0},
-	{ 0,  0,  0,  0,  1, -1,  0}
-};
-
-const int initial_mark[THREADS_PLACES_SIZE] = { 0, 1, 0, 0, 0 };
-const int initial_mark0[THREADS_PLACES_SIZE] = { 0, 0, 0, 1, 0 };
 
 const char *thread_transitions_names[THREADS_TRANSITIONS_SIZE] = {
 	"TRAN_INIT", "TRAN_ON_QUEUE", "TRAN_SET_RUNNING", "TRAN_SWITCH_OUT", "TRAN_TO_WAIT_CHANNEL", "TRAN_WAKEUP", "TRAN_REMOVE"
@@ -25,68 +18,98 @@ const char *thread_places[THREADS_PLACES_SIZE] = {
 	"INACTIVE", "CAN_RUN", "RUNQ", "RUNNING", "INHIBITED"
 };
 
-__inline bool thread_transition_is_sensitized(struct thread *pt, int transition_index);
+static int thread_interpreted_next_state(int place, int transition_index);
 void thread_print_net(struct thread *pt);
 
 void
 init_petri_thread(struct thread *pt_thread)
 {
-	// Create a new petr_thread structure
-	for (int i = 0; i < THREADS_PLACES_SIZE; i++) 
-		pt_thread->mark[i] = initial_mark[i];
-	
-	pt_thread->td_frominh = 0;
+
+	pt_thread->td_petri_state = PLACE_CAN_RUN;
+	pt_thread->td_petri_waker = 0;
+	pt_thread->td_petri_wakecpu = NOCPU;
+	pt_thread->td_petri_wakes = 0;
 }
 
 void
 init_petri_thread0(struct thread *pt_thread)
 {
-	// Create a new petr_thread structure
-	for (int i = 0; i < THREADS_PLACES_SIZE; i++) 
-		pt_thread->mark[i] = initial_mark0[i];
-	
-	pt_thread->td_frominh = 0;
-}
 
-__inline bool
-thread_transition_is_sensitized(struct thread *pt, int transition_index)
-{
-	for (int places_index = 0; places_index < THREADS_PLACES_SIZE; places_index++) {
-		if (((incidence_matrix[places_index][transition_index] < 0) && 
-			//If incidence is positive we really dont care if there are tokens or not
-			((incidence_matrix[places_index][transition_index] + pt->mark[places_index]) < 0))) 
-			return false;
-	}
-
-	return true;
+	pt_thread->td_petri_state = PLACE_RUNNING;
+	pt_thread->td_petri_waker = 0;
+	pt_thread->td_petri_wakecpu = NOCPU;
+	pt_thread->td_petri_wakes = 0;
 }
 
+/**
+ * the thread net always holds one token, so its marking is the place of
+ * that token and firing is a lookup in the next-state table generated from
+ * petri_net.def. the interpreted path walks the incidence matrix instead
+*/
 void
 thread_petri_fire(struct thread *pt, int transition, int print)
 {
-	if (thread_transition_is_sensitized(pt, transition)) 
-		for(int i = 0; i < THREADS_PLACES_SIZE; i++)
-			pt->mark[i] += incidence_matrix[i][transition];
-	else {
+	int place = pt->td_petri_state & TD_PETRI_PLACE_MASK;
+	int next;
+
+	if (!petri_interpreted)
+		next = petri_thread_next_state[place][transition];
+	else
+		next = thread_interpreted_next_state(place, transition);
+
+	if (next == PETRI_STATE_DISABLED) {
 		log(LOG_WARNING, "\t(sched_petri) %s no estaba sensibilizada para thread %d\n", thread_transitions_names[transition % CPU_BASE_TRANSITIONS], pt->td_tid);
 		thread_print_net(pt);
+		return;
 	}
+
+	pt->td_petri_state = (pt->td_petri_state & ~TD_PETRI_PLACE_MASK) | next;
+}
+
+static int
+thread_interpreted_next_state(int place, int transition_index)
+{
+
+	if (petri_thread_incidence[place][transition_index] >= 0 ||
+		petri_thread_inhibition[place][transition_index])
+		return PETRI_STATE_DISABLED;
+
+	for (int places_index = 0; places_index < THREADS_PLACES_SIZE; places_index++)
+		if (petri_thread_incidence[places_index][transition_index] > 0)
+			return places_index;
+
+	return PETRI_STATE_DISABLED;
 }
 
 void
 wakeup_if_needed(struct thread *td)
 {
-	if (td && (td->td_frominh == 1)) {
+	if (td && (td->td_petri_state & TD_PETRI_FROMINH)) {
 		thread_petri_fire(td, TRAN_WAKEUP, -1);
-		td->td_frominh = 0;
+		td->td_petri_state &= ~TD_PETRI_FROMINH;
 	}
 }
 
+/**
+ * record that waker, running on cpu, woke td up. the wakeups in a row by
+ * the same thread are counted for resource_wake_affine_cpu(), which looks
+ * at cpu until sched_add() queues td
+*/
+void
+petri_thread_woken(struct thread *td, struct thread *waker, int cpu)
+{
+
+	if (td->td_petri_waker != waker->td_tid) {
+		td->td_petri_waker = waker->td_tid;
+		td->td_petri_wakes = 1;
+	} else if (td->td_petri_wakes < PETRI_WAKES_MAX)
+		td->td_petri_wakes++;
+	td->td_petri_wakecpu = cpu;
+}
+
 void 
 thread_print_net(struct thread *pt)
 {
-	log(LOG_WARNING, "\t\t(sched_petri) Estado thread %2d: ", pt->td_tid);
-	for (int i = 0; i < THREADS_PLACES_SIZE; i++)
-		if (pt->mark[i] == 1)
-			log(LOG_WARNING, "%s\n", thread_places[i]);
+	log(LOG_WARNING, "\t\t(sched_petri) Estado thread %2d: %s\n", pt->td_tid,
+	    thread_places[pt->td_petri_state & TD_PETRI_PLACE_MASK]);
 }
@@ -0,0 +1,99 @@
+#ifndef PETRI_NET_IMAGE_H
+#define PETRI_NET_IMAGE_H
+
+#include <sys/types.h>
+
+/*
+ * Binary description of the resource net, so a kernel can run a net other
+ * than the built-in one of kern/petri_net.def without being rebuilt.
+ *
+ * An image keeps the places and transitions of the built-in net, which are
+ * the ones the scheduler hooks fire, and describes everything else: the
+ * arcs of the cpu template (repeated on every cpu), the arcs over the
+ * global places, the thread net transition mapped to every transition,
+ * the 1-safe places and where the global ones are packed, and the initial
+ * marking. It is a struct petri_net_image followed by pni_arcs arcs, in
+ * host byte order.
+ *
+ * The loader preloads it as a file of type PETRI_NET_IMAGE_TYPE, e.g. in
+ * loader.conf
+ *
+ *	petri_net_load="YES"
+ *	petri_net_type="petri_net"
+ *	petri_net_name="/boot/petri/batch.pnet"
+ *
+ * and the net is then built from it at boot. kern.sched.petri_net.image
+ * reads the image of the running net and, when written, swaps the net for
+ * the one of the new image on a quiescent system: every cpu is parked
+ * with interrupts disabled, so no transition is in flight, and the marking
+ * is carried over place by place. tools/petri/petri_netimage turns images
+ * to text and back.
+ */
+
+#define PETRI_NET_IMAGE_TYPE		"petri_net"
+#define PETRI_NET_IMAGE_MAGIC		0x54454e50	/* "PNET" */
+#define PETRI_NET_IMAGE_VERSION		1
+#define PETRI_NET_IMAGE_NAME		32
+#define PETRI_NET_IMAGE_PLACES		16	/* most places of the cpu template and of the global part */
+#define PETRI_NET_IMAGE_TRANSITIONS	16
+#define PETRI_NET_IMAGE_ARCS		1024
+
+/* pnp_flags */
+#define PETRI_NET_PLACE_SAFE		0x01	/* 1-safe, packed as a bit of its block */
+
+/*
+ * pnp_tokens is the initial marking of a global place, and of a cpu place
+ * on every cpu but the boot one, which starts with pnp_boot_tokens.
+ * pnp_block is the coordinator block of a global place: 0 is GLOBAL_BLOCK,
+ * 1 is SMP_BLOCK
+ */
+struct petri_net_image_place {
+	uint8_t		pnp_flags;
+	uint8_t		pnp_block;
+	uint8_t		pnp_tokens;
+	uint8_t		pnp_boot_tokens;
+};
+
+/* pna_flags */
+#define PETRI_NET_ARC_INHIBITOR			0x01
+#define PETRI_NET_ARC_GLOBAL_PLACE		0x02	/* pna_place is a global place */
+#define PETRI_NET_ARC_GLOBAL_TRANSITION	0x04	/* pna_transition is a global transition */
+#define PETRI_NET_ARC_SECONDARY			0x08	/* only on the cpus other than the boot one */
+
+/*
+ * an arc between a place and a transition of the cpu template connects
+ * them on every cpu, an arc between a global place and a transition of the
+ * template connects the place with that transition of every cpu (or of the
+ * secondary ones). pna_weight is the incidence of the arc, negative for
+ * input arcs, and 1 for inhibitor arcs. places of the template cannot be
+ * connected to global transitions
+ */
+struct petri_net_image_arc {
+	uint8_t		pna_place;
+	uint8_t		pna_transition;
+	int8_t		pna_weight;
+	uint8_t		pna_flags;
+};
+
+struct petri_net_image {
+	uint32_t	pni_magic;			/* PETRI_NET_IMAGE_MAGIC */
+	uint16_t	pni_version;		/* PETRI_NET_IMAGE_VERSION */
+	uint16_t	pni_arcs;			/* arcs following the header */
+	uint8_t		pni_cpu_places;		/* CPU_BASE_PLACES */
+	uint8_t		pni_cpu_transitions;	/* CPU_BASE_TRANSITIONS */
+	uint8_t		pni_global_places;	/* GLOBAL_PLACES */
+	uint8_t		pni_global_transitions;	/* GLOBAL_TRANSITIONS */
+	uint32_t	pni_spare;
+	char		pni_name[PETRI_NET_IMAGE_NAME];	/* NUL terminated */
+	struct petri_net_image_place pni_cpu_place[PETRI_NET_IMAGE_PLACES];
+	struct petri_net_image_place pni_global_place[PETRI_NET_IMAGE_PLACES];
+	/* thread net transition of each transition, or NO_HIERARCHICAL_TRANSITION */
+	int8_t		pni_cpu_map[PETRI_NET_IMAGE_TRANSITIONS];
+	int8_t		pni_global_map[PETRI_NET_IMAGE_TRANSITIONS];
+	struct petri_net_image_arc pni_arc[];
+};
+
+#define PETRI_NET_IMAGE_SIZE(arcs)	\
+	(sizeof(struct petri_net_image) + (size_t)(arcs) * sizeof(struct petri_net_image_arc))
+
+#endif
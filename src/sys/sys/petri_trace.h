@@ -0,0 +1,106 @@
+#ifndef PETRI_TRACE_H
+#define PETRI_TRACE_H
+
+#include <sys/types.h>
+
+/*
+ * Binary trace of the firings of the resource net and of the scheduler
+ * hooks that drive it, enough to replay them offline (tools/petri).
+ *
+ * Every cpu owns one ring and is its only writer: a firing is stored in
+ * the slot of ptr_head and then ptr_head is advanced with a release store,
+ * without any lock or formatting. When the ring is full the oldest records
+ * are overwritten.
+ *
+ * /dev/petri_trace maps the rings of all the cpus back to back, ptr_size
+ * bytes each (a multiple of the page size), cpu id order. A reader keeps
+ * its own tail per ring and, after copying records [tail, head), does an
+ * acquire fence and reads ptr_head again: records with head - index >=
+ * ptr_records may have been overwritten while copying and are dropped.
+ *
+ * Setting kern.sched.petri_trace.snapshot writes the marking of every block
+ * and the cpus already monopolized to the ring of the current cpu, a replay
+ * starts from there. The hooks run under sched_lock but cpus are turned on
+ * and off without it, so a snapshot taken meanwhile may be slightly off.
+ */
+
+#define PETRI_TRACE_DEVICE	"petri_trace"
+#define PETRI_TRACE_VERSION	2
+#define PETRI_TRACE_RECORDS	8192	/* default records per ring, kern.sched.petri_trace.records */
+#define PETRI_TRACE_NOCPU	0xffff	/* ptr_block of hooks without a cpu */
+
+/*
+ * ptr_kind of a record. a firing stores the marking word of its block
+ * after the firing, the hooks are recorded on entry, before the firings
+ * they cause, with ptr_block the cpu they act on and ptr_transition the
+ * transition they decided to fire:
+ *
+ *   MARKING	snapshot, ptr_mark is the word of block ptr_block
+ *   CPUSET	word ptr_transition of the cpuset of ptr_tid, ahead of its ADD
+ *   ADD	sched_add, ptr_mark is PETRI_TRACE_ADD_ARG()
+ *   SWITCH	sched_switch and sched_throw, ptr_mark holds the SW_* flags
+ *   REM	sched_rem
+ *   CHOOSE	sched_choose, ptr_tid is the thread chosen
+ *   SUSPEND, WAKEUP	a cpu turned off or on
+ *   MONOPOLIZE, RELEASE	ptr_mark is the pid taking or leaving the cpu
+ */
+#define PETRI_TRACE_FIRING		0
+#define PETRI_TRACE_MARKING		1
+#define PETRI_TRACE_CPUSET		2
+#define PETRI_TRACE_ADD			3
+#define PETRI_TRACE_SWITCH		4
+#define PETRI_TRACE_REM			5
+#define PETRI_TRACE_CHOOSE		6
+#define PETRI_TRACE_SUSPEND		7
+#define PETRI_TRACE_WAKEUP		8
+#define PETRI_TRACE_MONOPOLIZE	9
+#define PETRI_TRACE_RELEASE		10
+#define PETRI_TRACE_KINDS		11
+
+/* why sched_add queued the thread where it did */
+#define PETRI_TRACE_ADD_GLOBAL	0	/* global run queue */
+#define PETRI_TRACE_ADD_PINNED	1	/* td_pinned, its last cpu */
+#define PETRI_TRACE_ADD_BOUND	2	/* TDF_BOUND, its bound cpu */
+#define PETRI_TRACE_ADD_PICKED	3	/* sched_pickcpu() over its cpuset */
+#define PETRI_TRACE_ADD_STOLEN	4	/* taken by an idle cpu from the queue of another one */
+#define PETRI_TRACE_ADD_BALANCED	5	/* moved by the balancer from the queue of another cpu */
+#define PETRI_TRACE_ADD_SPILLED	6	/* pulled by an idle cpu from the global queue of another cache */
+#define PETRI_TRACE_ADD_AFFINE	7	/* resource_wake_affine_cpu(), near the thread that woke it */
+#define PETRI_TRACE_ADD_PACKED	8	/* resource_pack_cpu(), on a busy cpu while the load is low */
+#define PETRI_TRACE_ADD_DRAINED	9	/* moved off the queue of a cpu being suspended */
+
+/* SRQ_* flags, reason, td_lastcpu and pid of an ADD record */
+#define PETRI_TRACE_ADD_ARG(flags, reason, lastcpu, pid)				\
+	((uint64_t)((flags) & 0xff) | (uint64_t)(reason) << 8 |			\
+	(uint64_t)((lastcpu) & 0xffff) << 16 | (uint64_t)(uint32_t)(pid) << 32)
+#define PETRI_TRACE_ADD_FLAGS(arg)		((int)((arg) & 0xff))
+#define PETRI_TRACE_ADD_REASON(arg)		((int)(((arg) >> 8) & 0xff))
+#define PETRI_TRACE_ADD_LASTCPU(arg)	((int)(int16_t)((arg) >> 16))
+#define PETRI_TRACE_ADD_PID(arg)		((pid_t)((arg) >> 32))
+
+struct petri_trace_record {
+	uint64_t	ptr_ticks;		/* cpu_ticks() when fired */
+	uint64_t	ptr_mark;		/* marking word of ptr_block after the firing, or hook argument */
+	int32_t		ptr_tid;		/* thread the transition was fired for */
+	uint32_t	ptr_transition;	/* transition of the resource net */
+	uint16_t	ptr_cpu;		/* cpu that fired it */
+	uint16_t	ptr_block;		/* block of the net: cpu id, or CPU_NUMBER + n for the coordinator */
+	uint32_t	ptr_kind;		/* PETRI_TRACE_FIRING or the hook recorded */
+};
+
+struct petri_trace_ring {
+	uint32_t	ptr_version;	/* PETRI_TRACE_VERSION */
+	uint32_t	ptr_ncpu;		/* rings in the device */
+	uint32_t	ptr_records;	/* records in the ring, a power of 2 */
+	uint32_t	ptr_size;		/* bytes from one ring to the next */
+	volatile uint64_t ptr_head;	/* records ever written to the ring */
+	uint64_t	ptr_spare[5];
+	struct petri_trace_record ptr_record[];
+};
+
+/* kernel side, the rings live in kern/petri_trace.c */
+extern char *petri_trace_base;	/* NULL until the rings are allocated */
+extern size_t petri_trace_ring_size;
+extern int petri_trace_enabled;
+
+#endif
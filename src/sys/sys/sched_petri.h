@@ -5,6 +5,8 @@
 #include <sys/proc.h>
 #include <sys/cpuset.h>
 #include <sys/smp.h>
+#include <sys/petri_net_image.h>
+#include <sys/petri_trace.h>
 
 #define THREAD_CAN_SCHED(td, cpu)       \
        CPU_ISSET((cpu), &(td)->td_cpuset->cs_mask)
@@ -24,10 +26,11 @@ extern int CPU_NUMBER_PLACES;
 extern int CPU_NUMBER_TRANSITIONS; 	
 extern int PER_CPU_LAST_TRANSITION;	
 
-/* constants for handling hierarchical transitions */
-#define PER_CPU_HIER_TRANSITIONS 	6
-#define GLOBAL_HIER_TRANSITIONS 	2
-#define HIERARCHICAL_TRANSITIONS 	(PER_CPU_HIER_TRANSITIONS + GLOBAL_HIER_TRANSITIONS)
+/* entry of a next-state table for a transition not enabled in that state */
+#define PETRI_STATE_DISABLED	0xff
+
+/* resource transitions that do not fire any transition of the thread net */
+#define NO_HIERARCHICAL_TRANSITION	(-1)
 
 /* Definitions of places of the CPU resource net */
 #define PLACE_CPU 		0
@@ -37,10 +40,23 @@ extern int PER_CPU_LAST_TRANSITION;
 #define PLACE_TOEXEC 	4
 
 #define GLOBAL_PLACES	3
+#define PETRI_COORDINATOR_BLOCKS	2
+#define PETRI_BLOCKS	(CPU_NUMBER + PETRI_COORDINATOR_BLOCKS + GLOBAL_QUEUES - 1)
+#define GLOBAL_BLOCK	CPU_NUMBER			/* coordinator: global queue, enabled global transitions */
+#define SMP_BLOCK		(CPU_NUMBER + 1)	/* coordinator: smp places, read mostly */
+#define GLOBAL_QUEUE_BLOCK(queue)	(SMP_BLOCK + (queue))	/* coordinator: the other global queues */
 extern int PLACE_GLOBAL_QUEUE; 	
 extern int PLACE_SMP_NOT_READY; 
 extern int PLACE_SMP_READY; 	
 
+/* global places and transitions, numbered after the ones of every cpu */
+#define GLOBAL_PLACE_QUEUE			0
+#define GLOBAL_PLACE_SMP_NOT_READY	1
+#define GLOBAL_PLACE_SMP_READY		2
+#define GLOBAL_TRAN_REMOVE_QUEUE	0
+#define GLOBAL_TRAN_START_SMP		1
+#define GLOBAL_TRAN_QUEUE			2
+
 /* Definitions of transitions of the CPU resource net */
 #define TRAN_ADDTOQUEUE 		0
 #define TRAN_EXEC 				1
@@ -54,10 +70,52 @@ extern int PLACE_SMP_READY;
 #define TRAN_WAKEUP_PROC		9
 
 #define GLOBAL_TRANSITIONS	3
+
+/* base transitions whose enabled cpus are published in a cpuset for the other cpus */
+#define PETRI_PUBLISHED_TRANSITIONS	((1u << TRAN_ADDTOQUEUE) | (1u << TRAN_FROM_GLOBAL_CPU))
+/* base places whose marked cpus are published the same way: suspended cpus */
+#define PETRI_PUBLISHED_PLACES		(1u << PLACE_SUSPENDED)
+/*
+ * the idle thread runs as any other thread, holding the EXECUTING token, so
+ * the idle cpus are kept from the transitions that pick the next thread:
+ * EXEC_IDLE when the cpu found nothing to run, the others when it did
+ */
+#define PETRI_IDLE_TRANSITIONS		(1u << TRAN_EXEC_IDLE)
+#define PETRI_BUSY_TRANSITIONS		((1u << TRAN_UNQUEUE) | (1u << TRAN_FROM_GLOBAL_CPU))
 extern int TRAN_REMOVE_GLOBAL_QUEUE; 	
 extern int TRAN_START_SMP; 				
 extern int TRAN_QUEUE_GLOBAL; 		
 
+/*
+ * the global queue is sharded, one per last level cache: the global queue
+ * place and the global transitions over it are repeated for every queue.
+ * queue 0 keeps the global place and transitions of the image, the places
+ * and transitions of the others are numbered after them, each queue in a
+ * coordinator block of its own, so a net with a single last level cache
+ * is laid out as an unsharded one
+ */
+extern int GLOBAL_QUEUES;
+extern int *global_queue_per_cpu;	/* the queue each cpu queues to and pulls from */
+extern cpuset_t *global_queue_cpus;	/* the cpus of each queue */
+
+#define GLOBAL_QUEUE_OF_CPU(cpu)	(global_queue_per_cpu[(cpu)])
+#define PLACE_GLOBAL_QUEUE_OF(queue)	\
+	((queue) == 0 ? PLACE_GLOBAL_QUEUE : CPU_NUMBER_PLACES - GLOBAL_QUEUES + (queue))
+#define TRAN_REMOVE_GLOBAL_QUEUE_OF(queue)	\
+	((queue) == 0 ? TRAN_REMOVE_GLOBAL_QUEUE : CPU_NUMBER_TRANSITIONS - 2 * (GLOBAL_QUEUES - (queue)))
+#define TRAN_QUEUE_GLOBAL_OF(queue)	\
+	((queue) == 0 ? TRAN_QUEUE_GLOBAL : CPU_NUMBER_TRANSITIONS - 2 * (GLOBAL_QUEUES - (queue)) + 1)
+
+/*
+ * how closely cpus share caches, from smp_topo(): the cpus of a level
+ * around a cpu include the ones of the levels before it, and the last
+ * level falls back to every cpu when the topology has no such group
+ */
+#define PETRI_TOPO_CACHE	0	/* SMT siblings or cores sharing an L2 */
+#define PETRI_TOPO_LLC		1	/* cores sharing the last level cache */
+#define PETRI_TOPO_DOMAIN	2	/* NUMA domain, or package */
+#define PETRI_TOPO_LEVELS	3
+
 #define TURN_OFF	true
 #define TURN_ON 	false
 
@@ -66,10 +124,137 @@ extern int TRAN_QUEUE_GLOBAL;
 
 #define MALLOC_FLAGS (M_WAITOK | M_ZERO)
 
+/*
+ * the resource net is decomposed into one subnet per cpu (its base places
+ * and transitions) and a small coordinator net holding the global places.
+ *
+ * marking of one cpu subnet, or of coordinator places for the last blocks,
+ * packed in a single word so a transition is checked and fired on it with
+ * one compare-and-swap: the 1-safe places are bits of PETRI_SAFE_MASK, the
+ * locally enabled transitions of the subnet are kept next to them, so they
+ * can never disagree with the marking, and the only counting place of the
+ * block takes the upper half. every block owns its cache line, so firings
+ * on different cpus never write to the same line
+ */
+#define PETRI_SAFE_BITS			16
+#define PETRI_SAFE_MASK			0x000000000000ffffULL
+#define PETRI_ENABLED_SHIFT		16
+#define PETRI_ENABLED_MASK		0x00000000ffff0000ULL
+#define PETRI_COUNTER_SHIFT		32
+#define PETRI_BLOCK_COUNTERS	1
+
+#define PETRI_MARK_ENABLED(mark)	((u_int)(((mark) & PETRI_ENABLED_MASK) >> PETRI_ENABLED_SHIFT))
+#define PETRI_MARK_COUNTER(mark)	((int)((mark) >> PETRI_COUNTER_SHIFT))
+#define PETRI_COUNTER_TOKENS(tokens)	((uint64_t)(tokens) << PETRI_COUNTER_SHIFT)
+
+struct petri_cpu_block {
+	volatile uint64_t mark;
+} __aligned(CACHE_LINE_SIZE);
+
+/* where the tokens of a place are stored */
+struct petri_place_map {
+	int block;
+	int slot;			/* bit in the mark of 1-safe places */
+	bool safe;
+};
+
+/*
+ * arc of the resource net: weight is the incidence of the arc
+ * (negative for input arcs), inhibitor arcs keep a weight of 1
+ */
+struct petri_arc {
+	int place;
+	int weight;
+};
+
+/*
+ * arcs of a transition over one marking word: it is sensitized when
+ * (mark & required) == required, (mark & inhibit) == 0 and the counter
+ * holds at least tokens (and none with counter_inhibitor). firing it
+ * consumes the required bits and tokens, then marks the produce bits and
+ * adds output_tokens
+ */
+struct petri_word_arcs {
+	uint64_t required;
+	uint64_t inhibit;
+	uint64_t produce;
+	int tokens;
+	int output_tokens;
+	bool counter_inhibitor;
+};
+
+/*
+ * arcs of a transition over coordinator places, one per word it touches.
+ * arcs without incidence are only checked, never written
+ */
+struct petri_coordinator_arc {
+	volatile uint64_t *word;
+	struct petri_word_arcs arcs;
+	bool incidence;
+};
+
+/*
+ * arcs of a transition are stored contiguously in the arcs array
+ * as [input, output) input arcs, [output, inhibitor) output arcs
+ * and [inhibitor, end) inhibitor arcs (CSR-style).
+ * the arcs on coordinator places are also compiled against the packed
+ * marking as [coordinator, coordinator_end) in coordinator_arcs. only
+ * transitions with coordinator_incidence write to the coordinator
+ */
+struct petri_transition_arcs {
+	int input;
+	int output;
+	int inhibitor;
+	int end;
+	int coordinator;
+	int coordinator_end;
+	bool coordinator_incidence;
+};
+
+/*
+ * the whole net lives in one cache line aligned arena: this header, the
+ * marking blocks, the enabled, marked and idle cpusets and then the read-only compiled arcs,
+ * each section starting on its own cache line. transitions are numbered cpu
+ * by cpu, so the arcs of one cpu are contiguous and only refer to its block
+ * and the coordinator ones (block-diagonal storage)
+ */
 struct petri_cpu_resource_net {
-	int *mark;
-	char **incidence_matrix;
-	char **inhibition_matrix;
+	struct petri_cpu_block *blocks;	/* CPU_NUMBER per-cpu blocks + the coordinator blocks */
+	/* one cpuset per base transition with the cpus where it is locally
+	 * enabled, kept only for PETRI_PUBLISHED_TRANSITIONS and only written
+	 * when an enabling actually changes. concurrent firings may leave it
+	 * briefly behind the marking, readers confirm with the cpu block */
+	cpuset_t *enabled_cpus;
+	/* one cpuset per base place with the cpus where it holds a token, kept
+	 * only for PETRI_PUBLISHED_PLACES in the same way */
+	cpuset_t *marked_cpus;
+	cpuset_t *idle_cpus;		/* see PETRI_IDLE_TRANSITIONS */
+	uint64_t published_bits;	/* bits of a cpu block the published places are read from */
+	struct petri_place_map *places;
+	struct petri_transition_arcs *transitions;
+	struct petri_arc *arcs;
+	int arcs_number;
+	/* the cpu subnet, the same local arcs for every cpu */
+	struct petri_word_arcs *local;
+	/* base transitions with an input or inhibitor arc on each 1-safe place
+	 * and on the counter of the subnet, whose enabling cannot change while
+	 * the counter stays at or above local_counter_threshold */
+	u_int local_dependents[PETRI_SAFE_BITS];
+	u_int local_counter_dependents;
+	int local_counter_threshold;
+	struct petri_coordinator_arc *coordinator_arcs;
+	/* the groups of the cpu topology, the one of each PETRI_TOPO level
+	 * around cpu is topo_groups[topo_group[cpu * PETRI_TOPO_LEVELS + level]] */
+	cpuset_t *topo_groups;
+	int16_t *topo_group;
+	int8_t *hierarchical;		/* hierarchical_transitions of this net */
+	/* the image the net was built from, see sys/petri_net_image.h. the
+	 * generated firing functions are only used when its cpu template is
+	 * the one of petri_net.def */
+	struct petri_net_image *image;
+	size_t image_size;
+	bool generated;
+	size_t arena_size;
 };
 
 //Petri thread Methods
@@ -77,22 +262,90 @@ void init_petri_thread(struct thread *pt_thread);
 void init_petri_thread0(struct thread *pt_thread);
 void thread_petri_fire(struct thread *pt, int transition, int print);
 void wakeup_if_needed(struct thread *td);
+void petri_thread_woken(struct thread *td, struct thread *waker, int cpu);
+
+/* td_petri_wakes saturates there */
+#define PETRI_WAKES_MAX		255
+
+/* cpus sharing a PETRI_TOPO level with cpu */
+#define PETRI_TOPO_GROUP(net, cpu, level) \
+	(&(net)->topo_groups[(net)->topo_group[(cpu) * PETRI_TOPO_LEVELS + (level)]])
+
+/* local enabling only, transition_is_sensitized() also checks the coordinator arcs */
+#define TRANSITION_IS_ENABLED_ON_CPU(cpu, transition) \
+	((PETRI_MARK_ENABLED(resource_net->blocks[(cpu)].mark) & (1u << (transition))) != 0)
+
+/*
+ * a net swap frees the previous net right after the rendezvous that
+ * installs the new one (see petri_net_image.c), so resource_net is only
+ * read with interrupts disabled: by the hooks under their spin locks and
+ * by the other entry points under spinlock_enter()
+ */
+extern struct petri_cpu_resource_net *resource_net;
+#ifndef PETRI_NET_ASSERT_READER
+#define PETRI_NET_ASSERT_READER() \
+	KASSERT(curthread->td_md.md_spinlock_count > 0, \
+	    ("resource net read with interrupts enabled"))
+#endif
+
+/* cpus monopolized by some process */
+extern cpuset_t monopolized_cpus;
+
+/* fire through the matrices instead of the functions generated from petri_net.def */
+extern int petri_interpreted;
+
+/* wakeups in a row by the same thread before the woken one is placed near it, 0 for never */
+extern int petri_wake_affine;
+
+/* load percent under which threads are packed on the busy cpus, 0 for never */
+extern int petri_pack;
+
+/* average run queue wait in us over which packed threads spread again */
+extern int petri_pack_wait;
+
+/* set by the scheduler, empties the run queue of a cpu just suspended */
+extern void (*petri_drain_cpu)(int cpu_n);
+
+/* set by the scheduler, lock and unlock the run queue of a cpu the net suspends or wakes up */
+extern void (*petri_lock_cpu)(int cpu_n);
+extern void (*petri_unlock_cpu)(int cpu_n);
 
 //Petri Global Methods
 int  resource_choose_cpu(struct thread *td);
+int  resource_choose_victim(int cpu_n, const cpuset_t *tried);
+int  resource_balance_pair(const cpuset_t *group, int *from, int *to);
+int  resource_choose_global_queue(int cpu_n, const cpuset_t *tried);
+void resource_wakeup_cpus(struct thread *td, cpuset_t *cpus);
+int  resource_wake_affine_cpu(struct thread *td);
+int  resource_pack_cpu(struct thread *td);
+void resource_pack_waited(int wait);
 bool cpu_available_for_proc(int proc_id, int cpu);
 bool is_cpu_suspended(int cpu_n);
+int  resource_net_tokens(int place);
 void get_monopolized_cpus(int *dst);
-void free_double_pointer(void** pointer, int rows); 
 bool transition_is_sensitized(int transition_index);
-void **init_double_pointer(int rows, int cols, size_t size); 
 void *init_pointer(size_t size); 
 void init_resource_net(void);
+struct petri_cpu_resource_net *build_resource_net(const struct petri_net_image *image);
+int  install_resource_net(struct petri_cpu_resource_net *net);
+void free_resource_net(struct petri_cpu_resource_net *net);
+struct petri_net_image *petri_net_builtin_image(size_t *size);
+int  petri_net_image_check(const struct petri_net_image *image, size_t size);
+int  petri_net_use_image(const struct petri_net_image *image, size_t size);
 bool monopolize_cpu(int proc_id, int cpu); 
 bool release_cpu(int proc_id, int cpu); 
 void resource_fire_net(struct thread *pt, int transition_index, char *func);
+bool resource_try_fire_net(struct thread *pt, int transition_index, char *func);
 void resource_expulse_thread(struct thread *td, int flags, char *func);
 void toggle_pin_thread_to_cpu(int thread_id, int cpu);
+void petri_trace_hook(struct thread *td, u_int kind, int cpu, uint64_t arg, int transition);
+void petri_trace_snapshot(void);
+
+/* record a scheduler hook in the trace rings, see sys/petri_trace.h */
+#define PETRI_TRACE_HOOK(td, kind, cpu, arg, transition) do {		\
+	if (petri_trace_enabled)									\
+		petri_trace_hook((td), (kind), (cpu), (arg), (transition));	\
+} while (0)
 void turn_off_cpu(int cpu);
 void turn_on_cpu(int cpu);
 
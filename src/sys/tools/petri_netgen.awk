@@ -0,0 +1,353 @@
+#!/usr/bin/awk -f
+#
+# Compile one net of sys/kern/petri_net.def into a C header with its
+# matrices and one constant-folded enabled/fire function per transition,
+# or a next-state table for state nets.
+#
+# usage: awk -v net=<name> -f petri_netgen.awk petri_net.def > petri_<name>_net.h
+#
+
+function error(msg)
+{
+	printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr";
+	failed = 1;
+	exit 1;
+}
+
+function hex(value)
+{
+	return sprintf("0x%xULL", value);
+}
+
+# bit i of a mask, the masks used here never go past 2^16
+function bit(i)
+{
+	return 2 ^ i;
+}
+
+function has_bit(mask, i)
+{
+	return int(mask / bit(i)) % 2 == 1;
+}
+
+function add_arc(t, spec,    kind, place, weight, p)
+{
+	kind = spec;
+	sub(/:.*/, "", kind);
+	place = spec;
+	sub(/^[^:]*:/, "", place);
+	weight = 1;
+	if (place ~ /\*/) {
+		weight = place;
+		sub(/.*\*/, "", weight);
+		sub(/\*.*/, "", place);
+		weight += 0;
+	}
+
+	if (!(place in place_index))
+		error("unknown place " place);
+	p = place_index[place];
+
+	if (kind == "in")
+		incidence[p, t] -= weight;
+	else if (kind == "out")
+		incidence[p, t] += weight;
+	else if (kind == "inhibit")
+		inhibition[p, t] = 1;
+	else
+		error("unknown arc kind " kind);
+}
+
+BEGIN {
+	places = 0;
+	transitions = 0;
+}
+
+/^[ \t]*(#|$)/ {
+	next;
+}
+
+$1 == "net" {
+	selected = ($2 == net);
+	if (selected) {
+		found = 1;
+		kind = $3;
+		places_macro = $4;
+		transitions_macro = $5;
+		if (kind != "packed" && kind != "array" && kind != "state")
+			error("unknown net kind " kind);
+	}
+	next;
+}
+
+!selected {
+	next;
+}
+
+$1 == "place" {
+	place_index[$2] = places;
+	place_name[places] = $2;
+	place_safe[places] = ($3 == "safe");
+	places++;
+	next;
+}
+
+$1 == "transition" {
+	transition_name[transitions] = $2;
+	for (i = 3; i <= NF; i++)
+		add_arc(transitions, $i);
+	transitions++;
+	next;
+}
+
+{
+	error("unknown line " $1);
+}
+
+END {
+	if (failed)
+		exit 1;
+	if (!found) {
+		printf("petri_netgen.awk: no net %s\n", net) > "/dev/stderr";
+		exit 1;
+	}
+
+	counter = -1;
+	for (p = 0; p < places; p++) {
+		if (kind == "packed" && !place_safe[p]) {
+			if (counter != -1) {
+				printf("petri_netgen.awk: net %s has more than one counting place\n", net) > "/dev/stderr";
+				exit 1;
+			}
+			counter = p;
+		}
+	}
+
+	# transitions whose enabling depends on each place
+	for (t = 0; t < transitions; t++)
+		for (p = 0; p < places; p++)
+			if (incidence[p, t] < 0 || inhibition[p, t])
+				place_dependents[p] += bit(t);
+
+	# transitions to re-evaluate after firing each transition
+	for (t = 0; t < transitions; t++) {
+		dependents[t] = 0;
+		for (d = 0; d < transitions; d++)
+			for (p = 0; p < places; p++)
+				if (incidence[p, t] != 0 && has_bit(place_dependents[p], d)) {
+					dependents[t] += bit(d);
+					break;
+				}
+	}
+
+	printf("/*\n");
+	printf(" * petri_%s_net.h: generated by sys/tools/petri_netgen.awk from\n", net);
+	printf(" * sys/kern/petri_net.def, do not edit.\n");
+	printf(" */\n\n");
+
+	printf("CTASSERT(%s == %d);\n", places_macro, places);
+	printf("CTASSERT(%s == %d);\n", transitions_macro, transitions);
+	for (p = 0; p < places; p++)
+		printf("CTASSERT(%s == %d);\n", place_name[p], p);
+	for (t = 0; t < transitions; t++)
+		printf("CTASSERT(%s == %d);\n", transition_name[t], t);
+	printf("\n");
+
+	printf("static const int petri_%s_incidence[%s][%s] = {\n", net, places_macro, transitions_macro);
+	for (p = 0; p < places; p++) {
+		printf("\t{");
+		for (t = 0; t < transitions; t++)
+			printf("%s%2d", t ? ", " : " ", incidence[p, t]);
+		printf(" },\t/* %s */\n", place_name[p]);
+	}
+	printf("};\n\n");
+
+	printf("static const int petri_%s_inhibition[%s][%s] = {\n", net, places_macro, transitions_macro);
+	for (p = 0; p < places; p++) {
+		printf("\t{");
+		for (t = 0; t < transitions; t++)
+			printf("%s%d", t ? ", " : " ", inhibition[p, t] ? 1 : 0);
+		printf(" },\t/* %s */\n", place_name[p]);
+	}
+	printf("};\n\n");
+
+	if (kind == "packed") {
+		printf("static const bool petri_%s_safe[%s] = {", net, places_macro);
+		for (p = 0; p < places; p++)
+			printf("%s%s", p ? ", " : " ", place_safe[p] ? "true" : "false");
+		printf(" };\n\n");
+	}
+
+	if (kind == "state") {
+		emit_state();
+		exit 0;
+	}
+
+	# enabled functions first, the packed fire functions call them
+	for (t = 0; t < transitions; t++) {
+		word_arcs(t);
+		if (kind == "packed")
+			emit_packed_enabled(t);
+		else
+			emit_array_enabled(t);
+	}
+	for (t = 0; t < transitions; t++) {
+		word_arcs(t);
+		if (kind == "packed")
+			emit_packed_fire(t);
+		else
+			emit_array_fire(t);
+	}
+
+	printf("static %s (*const petri_%s_enabled[%s])(%s) = {\n", "bool", net, transitions_macro,
+	    kind == "packed" ? "uint64_t" : "const int *");
+	for (t = 0; t < transitions; t++)
+		printf("\tpetri_%s_enabled_%s,\n", net, transition_name[t]);
+	printf("};\n\n");
+
+	printf("static %s (*const petri_%s_fire[%s])(%s) = {\n", kind == "packed" ? "uint64_t" : "void",
+	    net, transitions_macro, kind == "packed" ? "uint64_t" : "int *");
+	for (t = 0; t < transitions; t++)
+		printf("\tpetri_%s_fire_%s,\n", net, transition_name[t]);
+	printf("};\n");
+}
+
+# masks and counter weights of the arcs of t, as compiled in petri_word_arcs
+function word_arcs(t,    p)
+{
+	required = 0;
+	inhibit = 0;
+	produce = 0;
+	tokens = 0;
+	output_tokens = 0;
+	counter_inhibitor = 0;
+	for (p = 0; p < places; p++) {
+		if (kind == "packed" && p == counter) {
+			if (incidence[p, t] < 0)
+				tokens = -incidence[p, t];
+			else
+				output_tokens = incidence[p, t];
+			counter_inhibitor = inhibition[p, t];
+			continue;
+		}
+		if (incidence[p, t] < 0)
+			required += bit(p);
+		else if (incidence[p, t] > 0)
+			produce += bit(p);
+		if (inhibition[p, t])
+			inhibit += bit(p);
+	}
+}
+
+function emit_packed_enabled(t,    conditions)
+{
+	conditions = "";
+	if (required)
+		conditions = conditions sprintf(" &&\n\t    (mark & %s) == %s", hex(required), hex(required));
+	if (inhibit)
+		conditions = conditions sprintf(" &&\n\t    (mark & %s) == 0", hex(inhibit));
+	if (tokens)
+		conditions = conditions sprintf(" &&\n\t    PETRI_MARK_COUNTER(mark) >= %d", tokens);
+	if (counter_inhibitor)
+		conditions = conditions " &&\n\t    PETRI_MARK_COUNTER(mark) == 0";
+	sub(/^ &&\n\t    /, "", conditions);
+	if (conditions == "")
+		conditions = "true";
+
+	printf("static __inline bool\n");
+	printf("petri_%s_enabled_%s(uint64_t mark)\n{\n\n", net, transition_name[t]);
+	printf("\treturn (%s);\n}\n\n", conditions);
+}
+
+function emit_packed_fire(t,    d)
+{
+
+	printf("static __inline uint64_t\n");
+	printf("petri_%s_fire_%s(uint64_t mark)\n{\n", net, transition_name[t]);
+	printf("\tu_int enabled;\n\n");
+	if (required || produce)
+		printf("\tmark = (mark & ~%s) | %s;\n", hex(required), hex(produce));
+	if (tokens)
+		printf("\tmark -= PETRI_COUNTER_TOKENS(%d);\n", tokens);
+	if (output_tokens)
+		printf("\tmark += PETRI_COUNTER_TOKENS(%d);\n", output_tokens);
+	printf("\tenabled = PETRI_MARK_ENABLED(mark) & ~0x%xu;\n", dependents[t]);
+	for (d = 0; d < transitions; d++)
+		if (has_bit(dependents[t], d))
+			printf("\tenabled |= (u_int)petri_%s_enabled_%s(mark) << %s;\n",
+			    net, transition_name[d], transition_name[d]);
+	printf("\n\treturn ((mark & ~PETRI_ENABLED_MASK) | ((uint64_t)enabled << PETRI_ENABLED_SHIFT));\n}\n\n");
+}
+
+function emit_array_enabled(t,    conditions, p)
+{
+	conditions = "";
+	for (p = 0; p < places; p++) {
+		if (incidence[p, t] < 0)
+			conditions = conditions sprintf(" &&\n\t    mark[%s] >= %d", place_name[p], -incidence[p, t]);
+		if (inhibition[p, t])
+			conditions = conditions sprintf(" &&\n\t    mark[%s] == 0", place_name[p]);
+	}
+	sub(/^ &&\n\t    /, "", conditions);
+	if (conditions == "")
+		conditions = "true";
+
+	printf("static __inline bool\n");
+	printf("petri_%s_enabled_%s(const int *mark)\n{\n\n", net, transition_name[t]);
+	printf("\treturn (%s);\n}\n\n", conditions);
+}
+
+function emit_array_fire(t,    p)
+{
+
+	printf("static __inline void\n");
+	printf("petri_%s_fire_%s(int *mark)\n{\n\n", net, transition_name[t]);
+	for (p = 0; p < places; p++) {
+		if (incidence[p, t] < 0)
+			printf("\tmark[%s] -= %d;\n", place_name[p], -incidence[p, t]);
+		else if (incidence[p, t] > 0)
+			printf("\tmark[%s] += %d;\n", place_name[p], incidence[p, t]);
+	}
+	printf("}\n\n");
+}
+
+# a state net holds a single token, each transition moves it from one
+# place to another, so the whole net is a next-state table
+function emit_state(    p, t, from, to)
+{
+	for (t = 0; t < transitions; t++) {
+		from = -1;
+		to = -1;
+		for (p = 0; p < places; p++) {
+			if (inhibition[p, t] || incidence[p, t] < -1 || incidence[p, t] > 1 ||
+			    (incidence[p, t] == -1 && from != -1) || (incidence[p, t] == 1 && to != -1)) {
+				printf("petri_netgen.awk: transition %s of state net %s does not move one token\n",
+				    transition_name[t], net) > "/dev/stderr";
+				exit 1;
+			}
+			if (incidence[p, t] == -1)
+				from = p;
+			else if (incidence[p, t] == 1)
+				to = p;
+		}
+		if (from == -1 || to == -1) {
+			printf("petri_netgen.awk: transition %s of state net %s does not move one token\n",
+			    transition_name[t], net) > "/dev/stderr";
+			exit 1;
+		}
+		next_state[from, t] = to;
+	}
+
+	printf("static const uint8_t petri_%s_next_state[%s][%s] = {\n", net, places_macro, transitions_macro);
+	for (p = 0; p < places; p++) {
+		printf("\t{");
+		for (t = 0; t < transitions; t++) {
+			if ((p, t) in next_state)
+				printf("%s%s", t ? ", " : " ", place_name[next_state[p, t]]);
+			else
+				printf("%sPETRI_STATE_DISABLED", t ? ", " : " ");
+		}
+		printf(" },\t/* %s */\n", place_name[p]);
+	}
+	printf("};\n");
+}
@@ -0,0 +1,620 @@
+/*
+ * petri_analyze: offline structural analysis of the SCHED_PETRI nets.
+ *
+ * The resource net is built by init_resource_net() exactly as the kernel
+ * does and composed with the thread net through hierarchical_transitions:
+ * every resource transition also moves a token between the places of the
+ * thread net it is mapped to, and the thread places count how many threads
+ * are in each state. Thread transitions no resource transition is mapped to
+ * (TRAN_INIT, TRAN_WAKEUP) fire on their own.
+ *
+ * On that composed net it computes
+ *
+ *   P-invariants	minimal semi-positive place invariants (Farkas)
+ *   T-invariants	minimal firing count vectors that return to a marking
+ *   boundedness	places covered by a P-invariant get its bound, the
+ *			1-safe places of the packed marking must get 1
+ *   reachability	every marking reachable with 1 to -r cpus and -t
+ *			threads besides the idle ones, checking the
+ *			invariants and 1-safe places on each, deadlocks and
+ *			transitions that can never fire
+ *
+ * With -f the resource net is built from a net image (sys/petri_net_image.h,
+ * see petri_netimage) instead of the built-in one, to check a net before
+ * booting a kernel with it. With -T smt:cores:llcs smp_topo() returns that
+ * topology, as in petri_sim, and the net gets a global queue for each last
+ * level cache.
+ *
+ * Inhibitor arcs are left out of the invariants, which hold regardless,
+ * and honored by the reachability search. It exits with 1 when a 1-safe
+ * place can get two tokens or an invariant is broken, the conditions under
+ * which kernels without INVARIANTS could not apply hook firings unchecked.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/sched_petri.h>
+
+#include "petri_thread_net.h"
+#include "petri_tools.h"
+
+#define MAX_INVARIANTS	100000		/* rows kept by the Farkas algorithm */
+
+struct analysis_net {
+	int		ncpu;
+	int		places;
+	int		transitions;
+	int		*incidence;	/* places x transitions */
+	int		*pre;		/* tokens each transition takes from each place */
+	bool		*inhibit;
+	bool		*safe;
+	int		*initial;
+	char		(*place_names)[32];
+	char		(*transition_names)[32];
+};
+
+struct invariants {
+	int		count;
+	int		size;		/* entries of each invariant */
+	int64_t		*vectors;
+};
+
+extern int8_t *hierarchical_transitions;
+static int verbose = 0;
+static long max_states = 4000000;
+
+#define INC(net, p, t)	((net)->incidence[(p) * (net)->transitions + (t)])
+#define PRE(net, p, t)	((net)->pre[(p) * (net)->transitions + (t)])
+#define INH(net, p, t)	((net)->inhibit[(p) * (net)->transitions + (t)])
+
+/**
+ * the resource net of ncpu cpus composed with the thread net, threads
+ * start inactive besides thread0 running on cpu 0 and the idle threads
+ * of the other cpus
+*/
+static void
+build_net(struct analysis_net *net, int ncpu, int threads)
+{
+	struct petri_transition_arcs *transition;
+	struct petri_arc *arc;
+	int resource_places, resource_transitions, t, h, p;
+	bool mapped[THREADS_TRANSITIONS_SIZE] = { false };
+	int free_transitions[THREADS_TRANSITIONS_SIZE], nfree = 0;
+
+	mp_ncpus = ncpu;
+	smp_started = 0;
+	init_resource_net();
+
+	resource_places = CPU_NUMBER_PLACES;
+	resource_transitions = CPU_NUMBER_TRANSITIONS;
+	for (t = 0; t < resource_transitions; t++)
+		if (hierarchical_transitions[t] != NO_HIERARCHICAL_TRANSITION)
+			mapped[hierarchical_transitions[t]] = true;
+	for (h = 0; h < THREADS_TRANSITIONS_SIZE; h++)
+		if (!mapped[h])
+			free_transitions[nfree++] = h;
+
+	net->ncpu = ncpu;
+	net->places = resource_places + THREADS_PLACES_SIZE;
+	net->transitions = resource_transitions + nfree;
+	net->incidence = malloc(net->places * net->transitions * sizeof(int), M_DEVBUF, M_WAITOK | M_ZERO);
+	net->pre = malloc(net->places * net->transitions * sizeof(int), M_DEVBUF, M_WAITOK | M_ZERO);
+	net->inhibit = malloc(net->places * net->transitions * sizeof(bool), M_DEVBUF, M_WAITOK | M_ZERO);
+	net->safe = malloc(net->places * sizeof(bool), M_DEVBUF, M_WAITOK | M_ZERO);
+	net->initial = malloc(net->places * sizeof(int), M_DEVBUF, M_WAITOK | M_ZERO);
+	net->place_names = malloc(net->places * sizeof(*net->place_names), M_DEVBUF, M_WAITOK | M_ZERO);
+	net->transition_names = malloc(net->transitions * sizeof(*net->transition_names), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	for (p = 0; p < resource_places; p++) {
+		if (p < CPU_NUMBER * CPU_BASE_PLACES)
+			snprintf(net->place_names[p], sizeof(net->place_names[p]), "%s_P%d",
+			    cpu_places_names[p % CPU_BASE_PLACES], p / CPU_BASE_PLACES);
+		else if (p < CPU_NUMBER * CPU_BASE_PLACES + GLOBAL_PLACES)
+			snprintf(net->place_names[p], sizeof(net->place_names[p]), "%s",
+			    global_place_names[p - CPU_NUMBER * CPU_BASE_PLACES]);
+		else
+			snprintf(net->place_names[p], sizeof(net->place_names[p]), "%s_%d",
+			    global_place_names[GLOBAL_PLACE_QUEUE], p - (CPU_NUMBER * CPU_BASE_PLACES + GLOBAL_PLACES) + 1);
+		net->safe[p] = resource_net->places[p].safe;
+		net->initial[p] = resource_net_tokens(p);
+	}
+	for (p = 0; p < THREADS_PLACES_SIZE; p++)
+		snprintf(net->place_names[resource_places + p], sizeof(net->place_names[0]), "thread %s",
+		    thread_place_names[p]);
+	net->initial[resource_places + PLACE_INACTIVE] = threads;
+	net->initial[resource_places + PLACE_CAN_RUN] = ncpu - 1;
+	net->initial[resource_places + PLACE_RUNNING] = 1;
+
+	for (t = 0; t < resource_transitions; t++) {
+		if (t < PER_CPU_LAST_TRANSITION)
+			snprintf(net->transition_names[t], sizeof(net->transition_names[t]), "%s_P%d",
+			    base_transition_names[t % CPU_BASE_TRANSITIONS], t / CPU_BASE_TRANSITIONS);
+		else if (t < PER_CPU_LAST_TRANSITION + GLOBAL_TRANSITIONS)
+			snprintf(net->transition_names[t], sizeof(net->transition_names[t]), "%s",
+			    global_transition_names[t - PER_CPU_LAST_TRANSITION]);
+		else
+			snprintf(net->transition_names[t], sizeof(net->transition_names[t]), "%s_%d",
+			    global_transition_names[(t - PER_CPU_LAST_TRANSITION - GLOBAL_TRANSITIONS) % 2 ?
+			    GLOBAL_TRAN_QUEUE : GLOBAL_TRAN_REMOVE_QUEUE],
+			    (t - PER_CPU_LAST_TRANSITION - GLOBAL_TRANSITIONS) / 2 + 1);
+
+		transition = &resource_net->transitions[t];
+		for (int i = transition->input; i < transition->end; i++) {
+			arc = &resource_net->arcs[i];
+			if (i >= transition->inhibitor)
+				INH(net, arc->place, t) = true;
+			else {
+				INC(net, arc->place, t) += arc->weight;
+				if (arc->weight < 0)
+					PRE(net, arc->place, t) -= arc->weight;
+			}
+		}
+
+		h = hierarchical_transitions[t];
+		if (h == NO_HIERARCHICAL_TRANSITION)
+			continue;
+		for (p = 0; p < THREADS_PLACES_SIZE; p++) {
+			INC(net, resource_places + p, t) += petri_thread_incidence[p][h];
+			if (petri_thread_incidence[p][h] < 0)
+				PRE(net, resource_places + p, t) -= petri_thread_incidence[p][h];
+		}
+	}
+
+	for (int i = 0; i < nfree; i++) {
+		t = resource_transitions + i;
+		h = free_transitions[i];
+		snprintf(net->transition_names[t], sizeof(net->transition_names[t]), "thread %s",
+		    thread_transition_names[h]);
+		for (p = 0; p < THREADS_PLACES_SIZE; p++) {
+			INC(net, resource_places + p, t) = petri_thread_incidence[p][h];
+			if (petri_thread_incidence[p][h] < 0)
+				PRE(net, resource_places + p, t) = -petri_thread_incidence[p][h];
+		}
+	}
+}
+
+static void
+free_net(struct analysis_net *net)
+{
+
+	free(net->incidence, M_DEVBUF);
+	free(net->pre, M_DEVBUF);
+	free(net->inhibit, M_DEVBUF);
+	free(net->safe, M_DEVBUF);
+	free(net->initial, M_DEVBUF);
+	free(net->place_names, M_DEVBUF);
+	free(net->transition_names, M_DEVBUF);
+}
+
+static int64_t
+gcd(int64_t a, int64_t b)
+{
+
+	a = a < 0 ? -a : a;
+	b = b < 0 ? -b : b;
+	while (b != 0) {
+		int64_t r = a % b;
+		a = b;
+		b = r;
+	}
+
+	return (a);
+}
+
+/* whether the support of a is contained in the one of b */
+static bool
+support_within(const int64_t *a, const int64_t *b, int size)
+{
+
+	for (int i = 0; i < size; i++)
+		if (a[i] != 0 && b[i] == 0)
+			return (false);
+
+	return (true);
+}
+
+/**
+ * minimal semi-positive solutions y of y.A = 0 for a rows x cols matrix,
+ * by the Farkas algorithm: every row starts as [A | I] and each column of
+ * A is cancelled in turn by combining rows of opposite sign, keeping only
+ * the combinations of minimal support
+*/
+static void
+farkas(int rows, int cols, const int *matrix, int stride_row, int stride_col, struct invariants *result)
+{
+	int width = cols + rows, count = rows, next_count;
+	int64_t *table, *next, *row;
+
+	table = malloc((size_t)MAX_INVARIANTS * width * sizeof(int64_t), M_DEVBUF, M_WAITOK | M_ZERO);
+	next = malloc((size_t)MAX_INVARIANTS * width * sizeof(int64_t), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	for (int r = 0; r < rows; r++) {
+		for (int c = 0; c < cols; c++)
+			table[r * width + c] = matrix[r * stride_row + c * stride_col];
+		table[r * width + cols + r] = 1;
+	}
+
+	for (int c = 0; c < cols; c++) {
+		next_count = 0;
+		for (int i = 0; i < count; i++)
+			if (table[i * width + c] == 0)
+				memcpy(&next[next_count++ * width], &table[i * width], width * sizeof(int64_t));
+
+		for (int i = 0; i < count; i++) {
+			int64_t a = table[i * width + c];
+
+			if (a <= 0)
+				continue;
+			for (int k = 0; k < count; k++) {
+				int64_t b = table[k * width + c], divisor = 0;
+				bool minimal = true;
+
+				if (b >= 0)
+					continue;
+				if (next_count == MAX_INVARIANTS)
+					errx(1, "more than %d invariant candidates", MAX_INVARIANTS);
+				row = &next[next_count * width];
+				for (int j = 0; j < width; j++) {
+					row[j] = -b * table[i * width + j] + a * table[k * width + j];
+					divisor = gcd(divisor, row[j]);
+				}
+				if (divisor > 1)
+					for (int j = 0; j < width; j++)
+						row[j] /= divisor;
+
+				//keep only rows whose support is not a superset of another one
+				for (int j = 0; j < next_count && minimal; j++)
+					if (support_within(&next[j * width + cols], &row[cols], rows))
+						minimal = false;
+				if (minimal)
+					next_count++;
+			}
+		}
+
+		//drop the rows the new ones made non minimal
+		count = 0;
+		for (int i = 0; i < next_count; i++) {
+			bool minimal = true;
+
+			for (int j = 0; j < next_count && minimal; j++)
+				if (j != i && support_within(&next[j * width + cols], &next[i * width + cols], rows) &&
+				    !(support_within(&next[i * width + cols], &next[j * width + cols], rows) && j > i))
+					minimal = false;
+			if (minimal)
+				memcpy(&table[count++ * width], &next[i * width], width * sizeof(int64_t));
+		}
+	}
+
+	result->count = count;
+	result->size = rows;
+	result->vectors = malloc(((size_t)count * rows + 1) * sizeof(int64_t), M_DEVBUF, M_WAITOK | M_ZERO);
+	for (int i = 0; i < count; i++)
+		memcpy(&result->vectors[i * rows], &table[i * width + cols], rows * sizeof(int64_t));
+
+	free(table, M_DEVBUF);
+	free(next, M_DEVBUF);
+}
+
+static int64_t
+weighted_tokens(const int64_t *invariant, const int *marking, int places)
+{
+	int64_t sum = 0;
+
+	for (int p = 0; p < places; p++)
+		sum += invariant[p] * marking[p];
+
+	return (sum);
+}
+
+static void
+print_vector(const int64_t *vector, int size, char (*names)[32])
+{
+	bool first = true;
+
+	for (int i = 0; i < size; i++) {
+		if (vector[i] == 0)
+			continue;
+		printf("%s", first ? "    " : " + ");
+		if (vector[i] != 1)
+			printf("%jd*", (intmax_t)vector[i]);
+		printf("%s", names[i]);
+		first = false;
+	}
+}
+
+/**
+ * invariants and structural bounds of the net. returns the 1-safe places
+ * no P-invariant bounds to a single token, left to the reachability search
+*/
+static int
+analyze_structure(struct analysis_net *net)
+{
+	struct invariants p_invariants, t_invariants;
+	int64_t bound, best;
+	int unproven = 0;
+
+	farkas(net->places, net->transitions, net->incidence, net->transitions, 1, &p_invariants);
+	farkas(net->transitions, net->places, net->incidence, 1, net->transitions, &t_invariants);
+
+	printf("%d cpus: %d places, %d transitions, %d P-invariants, %d T-invariants\n", net->ncpu,
+	    net->places, net->transitions, p_invariants.count, t_invariants.count);
+
+	printf("  P-invariants:\n");
+	for (int i = 0; i < p_invariants.count; i++) {
+		print_vector(&p_invariants.vectors[i * net->places], net->places, net->place_names);
+		printf(" = %jd\n", (intmax_t)weighted_tokens(&p_invariants.vectors[i * net->places],
+		    net->initial, net->places));
+	}
+
+	if (verbose) {
+		printf("  T-invariants:\n");
+		for (int i = 0; i < t_invariants.count; i++) {
+			print_vector(&t_invariants.vectors[i * net->transitions], net->transitions,
+			    net->transition_names);
+			printf("\n");
+		}
+	}
+
+	printf("  structural bounds:\n");
+	for (int p = 0; p < net->places; p++) {
+		best = -1;
+		for (int i = 0; i < p_invariants.count; i++) {
+			int64_t *invariant = &p_invariants.vectors[i * net->places];
+
+			if (invariant[p] == 0)
+				continue;
+			bound = weighted_tokens(invariant, net->initial, net->places) / invariant[p];
+			if (best == -1 || bound < best)
+				best = bound;
+		}
+		if (best == -1)
+			printf("    %-20s unbounded%s\n", net->place_names[p], net->safe[p] ? ", 1-safe left to reachability" : "");
+		else if (verbose || (net->safe[p] && best > 1))
+			printf("    %-20s %jd\n", net->place_names[p], (intmax_t)best);
+		if (net->safe[p] && (best == -1 || best > 1))
+			unproven++;
+	}
+
+	free(p_invariants.vectors, M_DEVBUF);
+	free(t_invariants.vectors, M_DEVBUF);
+
+	return (unproven);
+}
+
+/* reachable markings, an open addressing set of token vectors */
+struct marking_set {
+	int		places;
+	long		count;
+	long		slots;
+	uint8_t		*markings;
+	bool		*used;
+};
+
+static uint64_t
+marking_hash(const uint8_t *marking, int places)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (int p = 0; p < places; p++)
+		hash = (hash ^ marking[p]) * 0x100000001b3ULL;
+
+	return (hash);
+}
+
+/* add a marking, false when it was already there */
+static bool
+marking_insert(struct marking_set *set, const uint8_t *marking)
+{
+	long slot = marking_hash(marking, set->places) & (set->slots - 1);
+
+	while (set->used[slot]) {
+		if (memcmp(&set->markings[slot * set->places], marking, set->places) == 0)
+			return (false);
+		slot = (slot + 1) & (set->slots - 1);
+	}
+
+	set->used[slot] = true;
+	memcpy(&set->markings[slot * set->places], marking, set->places);
+	set->count++;
+
+	return (true);
+}
+
+static bool
+transition_enabled(struct analysis_net *net, const uint8_t *marking, int t)
+{
+
+	for (int p = 0; p < net->places; p++) {
+		if (marking[p] < PRE(net, p, t))
+			return (false);
+		if (INH(net, p, t) && marking[p] != 0)
+			return (false);
+	}
+
+	return (true);
+}
+
+/**
+ * breadth-first search of the reachable markings, checking every one of
+ * them. returns the number of violations found
+*/
+static long
+analyze_reachability(struct analysis_net *net)
+{
+	struct marking_set set;
+	struct invariants p_invariants;
+	uint8_t *queue, *marking, *next;
+	long head = 0, tail = 0, deadlocks = 0, violations = 0;
+	bool *fired, any;
+	int *tokens, *max_tokens, dead = 0;
+
+	farkas(net->places, net->transitions, net->incidence, net->transitions, 1, &p_invariants);
+
+	set.places = net->places;
+	set.count = 0;
+	for (set.slots = 1; set.slots < max_states * 2; set.slots <<= 1)
+		;
+	set.markings = malloc(set.slots * net->places, M_DEVBUF, M_WAITOK);
+	set.used = malloc(set.slots * sizeof(bool), M_DEVBUF, M_WAITOK | M_ZERO);
+	queue = malloc(max_states * net->places, M_DEVBUF, M_WAITOK);
+	next = malloc(net->places, M_DEVBUF, M_WAITOK);
+	tokens = malloc(net->places * sizeof(int), M_DEVBUF, M_WAITOK | M_ZERO);
+	max_tokens = malloc(net->places * sizeof(int), M_DEVBUF, M_WAITOK | M_ZERO);
+	fired = malloc(net->transitions * sizeof(bool), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	for (int p = 0; p < net->places; p++)
+		queue[p] = net->initial[p];
+	marking_insert(&set, queue);
+	tail = 1;
+
+	while (head < tail) {
+		marking = &queue[head++ * net->places];
+
+		for (int p = 0; p < net->places; p++) {
+			tokens[p] = marking[p];
+			max_tokens[p] = MAX(max_tokens[p], tokens[p]);
+			if (net->safe[p] && tokens[p] > 1) {
+				if (violations++ < 10)
+					printf("    %s holds %d tokens\n", net->place_names[p], tokens[p]);
+			}
+		}
+		for (int i = 0; i < p_invariants.count; i++) {
+			int64_t *invariant = &p_invariants.vectors[i * net->places];
+
+			if (weighted_tokens(invariant, tokens, net->places) !=
+			    weighted_tokens(invariant, net->initial, net->places) && violations++ < 10)
+				printf("    P-invariant %d broken\n", i);
+		}
+
+		any = false;
+		for (int t = 0; t < net->transitions; t++) {
+			if (!transition_enabled(net, marking, t))
+				continue;
+			any = true;
+			fired[t] = true;
+			for (int p = 0; p < net->places; p++) {
+				int value = marking[p] + INC(net, p, t);
+
+				if (value > UINT8_MAX)
+					errx(1, "%s grows past %d tokens", net->place_names[p], UINT8_MAX);
+				next[p] = value;
+			}
+			if (!marking_insert(&set, next))
+				continue;
+			if (tail == max_states)
+				errx(1, "more than %ld reachable markings, raise -m", max_states);
+			memcpy(&queue[tail++ * net->places], next, net->places);
+			//the queue may have been the slot of marking
+			marking = &queue[(head - 1) * net->places];
+		}
+		if (!any)
+			deadlocks++;
+	}
+
+	printf("  %ld reachable markings, %ld deadlocks, %ld violations\n", set.count, deadlocks, violations);
+	for (int t = 0; t < net->transitions; t++)
+		if (!fired[t]) {
+			if (dead++ == 0)
+				printf("  transitions that never fire:");
+			printf(" %s", net->transition_names[t]);
+		}
+	if (dead)
+		printf("\n");
+	if (verbose) {
+		printf("  most tokens reached:\n");
+		for (int p = 0; p < net->places; p++)
+			printf("    %-20s %d\n", net->place_names[p], max_tokens[p]);
+	}
+
+	free(set.markings, M_DEVBUF);
+	free(set.used, M_DEVBUF);
+	free(queue, M_DEVBUF);
+	free(next, M_DEVBUF);
+	free(tokens, M_DEVBUF);
+	free(max_tokens, M_DEVBUF);
+	free(fired, M_DEVBUF);
+	free(p_invariants.vectors, M_DEVBUF);
+
+	return (violations);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_analyze [-v] [-c cpus] [-f image] [-r cpus] [-t threads] [-m markings]\n"
+	    "                     [-T smt:cores:llcs]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct analysis_net net;
+	struct petri_net_image *image = NULL;
+	size_t size;
+	int ch, cpus = 4, reach_cpus = 2, threads = 2, unproven, smt, cores, llcs;
+	long violations = 0;
+
+	while ((ch = getopt(argc, argv, "c:f:m:r:t:T:v")) != -1) {
+		switch (ch) {
+		case 'c':
+			cpus = atoi(optarg);
+			break;
+		case 'f':
+			image = read_image_file(optarg, &size);
+			petri_shim_log_enabled = 1;
+			if (petri_net_use_image(image, size) != 0)
+				errx(1, "%s: not a usable net image", optarg);
+			petri_shim_log_enabled = 0;
+			break;
+		case 'm':
+			max_states = atol(optarg);
+			break;
+		case 'r':
+			reach_cpus = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d:%d:%d", &smt, &cores, &llcs) != 3 || smt < 1 || cores < 1 || llcs < 1)
+				usage();
+			petri_shim_topology(smt, cores, llcs);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (cpus < 1 || cpus > MAXCPU || reach_cpus < 0 || threads < 0 || max_states < 1)
+		usage();
+
+	printf("structure, resource net composed with the thread net, %d threads\n", threads);
+	build_net(&net, cpus, threads);
+	unproven = analyze_structure(&net);
+	free_net(&net);
+
+	for (int ncpu = 1; ncpu <= reach_cpus; ncpu++) {
+		printf("reachability, %d cpus, %d threads\n", ncpu, threads);
+		build_net(&net, ncpu, threads);
+		violations += analyze_reachability(&net);
+		free_net(&net);
+	}
+
+	free(image, M_DEVBUF);
+	if (violations != 0) {
+		printf("the net is not safe: hook firings must stay checked\n");
+		return (1);
+	}
+	printf("1-safe places and invariants hold%s\n", unproven && reach_cpus == 0 ?
+	    ", but some 1-safe places are only bounded by inhibitor arcs, run with -r" : "");
+
+	return (0);
+}
@@ -0,0 +1,154 @@
+/*
+ * petri_bench: measures how many sensitization checks, firings and
+ * resource_choose_cpu() decisions per second the resource net sustains
+ * for different CPU counts.
+ *
+ * Every iteration runs one thread through a complete cycle on the last CPU
+ * (ADDTOQUEUE -> UNQUEUE -> EXEC -> RETURN_INVOL), which is the sequence
+ * sched_add/sched_choose/sched_switch fire for a preempted thread. Firings
+ * are timed both through the functions generated from petri_net.def and
+ * through the interpreted matrices (kern.sched.petri_interpreted).
+ *
+ * Decisions are made for a thread that never ran and may only run on the
+ * last CPU, so resource_choose_cpu() scans the whole candidate cpuset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/sched_petri.h>
+
+extern struct petri_cpu_resource_net *resource_net;
+
+static const int cpu_numbers[] = { 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024 };
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+
+	return ((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec));
+}
+
+static double
+bench_firing(struct thread *td, int cpu, long iterations, int interpreted)
+{
+	struct timespec start, end;
+
+	petri_interpreted = interpreted;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		resource_fire_net(td, TRANSITION(cpu, TRAN_ADDTOQUEUE), "petri_bench");
+		resource_fire_net(td, TRANSITION(cpu, TRAN_UNQUEUE), "petri_bench");
+		resource_fire_net(td, TRANSITION(cpu, TRAN_EXEC), "petri_bench");
+		resource_fire_net(td, TRANSITION(cpu, TRAN_RETURN_INVOL), "petri_bench");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	petri_interpreted = 0;
+
+	return (iterations * 4 * 1e3 / elapsed_ns(&start, &end));
+}
+
+static void
+bench_cpu_number(int ncpu, long iterations)
+{
+	struct timespec start, end;
+	struct proc proc;
+	struct cpuset cpuset;
+	struct thread td;
+	volatile bool sensitized;
+	volatile int decision;
+	double interpreted_rate, fire_rate, sensitize_rate, choose_rate;
+	int cpu;
+
+	mp_ncpus = ncpu;
+	smp_started = 0;
+	init_resource_net();
+	smp_started = 1;
+
+	memset(&proc, 0, sizeof(proc));
+	proc.p_pid = 1;
+	strcpy(proc.p_comm, "petri_bench");
+	CPU_FILL(&cpuset.cs_mask);
+	memset(&td, 0, sizeof(td));
+	td.td_tid = 100001;
+	td.td_proc = &proc;
+	td.td_cpuset = &cpuset;
+	td.td_lastcpu = NOCPU;
+	init_petri_thread(&td);
+
+	cpu = ncpu - 1;
+
+	interpreted_rate = bench_firing(&td, cpu, iterations, 1);
+	fire_rate = bench_firing(&td, cpu, iterations, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++) {
+		sensitized = transition_is_sensitized(TRANSITION(cpu, TRAN_ADDTOQUEUE));
+		sensitized = transition_is_sensitized(TRANSITION(cpu, TRAN_UNQUEUE));
+		sensitized = transition_is_sensitized(TRANSITION(cpu, TRAN_EXEC));
+		sensitized = transition_is_sensitized(TRANSITION(cpu, TRAN_RETURN_INVOL));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sensitize_rate = iterations * 4 * 1e3 / elapsed_ns(&start, &end);
+	(void)sensitized;
+
+	CPU_ZERO(&cpuset.cs_mask);
+	CPU_SET(cpu, &cpuset.cs_mask);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < iterations; i++)
+		decision = resource_choose_cpu(&td);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	choose_rate = iterations * 1e3 / elapsed_ns(&start, &end);
+	if (decision != TRANSITION(cpu, TRAN_ADDTOQUEUE))
+		printf("petri_bench: %d cpus: resource_choose_cpu() picked transition %d\n", ncpu, decision);
+
+	printf("%6d %8d %11d %13.1f %13.1f %13.1f %13.1f\n", ncpu, CPU_NUMBER_PLACES,
+	    CPU_NUMBER_TRANSITIONS, sensitize_rate, interpreted_rate, fire_rate, choose_rate);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_bench [-c cpus] [-i iterations] [-v]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	long iterations = 1000000;
+	int ch, ncpu = 0;
+
+	while ((ch = getopt(argc, argv, "c:i:v")) != -1) {
+		switch (ch) {
+		case 'c':
+			ncpu = atoi(optarg);
+			break;
+		case 'i':
+			iterations = strtol(optarg, NULL, 10);
+			break;
+		case 'v':
+			petri_shim_log_enabled = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (iterations <= 0 || ncpu < 0 || ncpu > MAXCPU)
+		usage();
+
+	printf("rates in millions per second\n");
+	printf("%6s %8s %11s %13s %13s %13s %13s\n", "cpus", "places", "transitions",
+	    "sensitize", "fire(interp)", "fire", "choose_cpu");
+	if (ncpu != 0)
+		bench_cpu_number(ncpu, iterations);
+	else
+		for (size_t i = 0; i < sizeof(cpu_numbers) / sizeof(cpu_numbers[0]); i++)
+			bench_cpu_number(cpu_numbers[i], iterations);
+
+	return (0);
+}
@@ -0,0 +1,359 @@
+/*
+ * petri_locks: contention on the scheduler locks of sched_4bsd.c under a
+ * context-switch storm, with sched_lock alone against a lock per CPU run
+ * queue as with SCHED_PETRI_PCPU_LOCKS.
+ *
+ * Every worker is a CPU switching threads as fast as it can, following
+ * sched_switch(): with the lock of its run queue held it fires RETURN_INVOL
+ * for the running thread, queues it back with ADDTOQUEUE, picks the next
+ * one with UNQUEUE, FROM_GLOBAL_CPU or EXEC_IDLE and fires EXEC.  A share
+ * of the threads goes to the run queue of another CPU, whose lock is taken
+ * after dropping the own one as sched_add_switch() does, and another share
+ * to the global run queue with QUEUE_GLOBAL under the global lock.  With
+ * the global lock alone every lock is that one.
+ *
+ * The firings are checked, a locking mistake shows up as refused firings.
+ * The locks are plain test-and-test-and-set spin locks that count the
+ * acquisitions that had to wait; they yield the processor after a while
+ * of spinning, as workers may outnumber the processors unlike CPUs.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/sched_petri.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	cpu_spinwait()	__builtin_ia32_pause()
+#else
+#define	cpu_spinwait()	do { } while (0)
+#endif
+
+#define	SPINS_BEFORE_YIELD	1000
+
+struct bench_lock {
+	volatile int	locked;
+	long		acquired;
+	long		contended;
+	long		spins;
+} __aligned(CACHE_LINE_SIZE);
+
+struct bench_thread {
+	struct thread	td;
+	struct proc	proc;
+	struct cpuset	cpuset;
+	TAILQ_ENTRY(bench_thread) link;
+};
+TAILQ_HEAD(bench_threadq, bench_thread);
+
+struct bench_cpu {
+	struct bench_lock	*lock;
+	struct bench_threadq	runq;
+	struct bench_thread	idle;
+	struct bench_thread	*running;
+	pthread_t		thread;
+	unsigned int		seed;
+	int			id;
+	long			switches;
+	long			refused;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct bench_lock global_lock;
+static struct bench_lock *cpu_locks;
+static struct bench_threadq *global_runq;
+static struct bench_cpu *cpus;
+static volatile int stop;
+
+static int ncpu, remote_share = 10, global_share = 5, work = 50;
+
+static void
+lock_acquire(struct bench_lock *lock)
+{
+	long spins = 0;
+
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+		do {
+			if (++spins % SPINS_BEFORE_YIELD == 0)
+				sched_yield();
+			else
+				cpu_spinwait();
+		} while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED));
+	}
+	lock->acquired++;
+	if (spins > 0) {
+		lock->contended++;
+		lock->spins += spins;
+	}
+}
+
+static void
+lock_release(struct bench_lock *lock)
+{
+
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static void
+fire(struct bench_cpu *cpu, struct bench_thread *bt, int transition)
+{
+
+	if (!resource_try_fire_net(&bt->td, transition, "petri_locks"))
+		cpu->refused++;
+}
+
+static void
+init_bench_thread(struct bench_thread *bt, int tid)
+{
+
+	bt->proc.p_pid = tid;
+	snprintf(bt->proc.p_comm, sizeof(bt->proc.p_comm), "storm%d", tid);
+	CPU_FILL(&bt->cpuset.cs_mask);
+	bt->td.td_tid = tid;
+	bt->td.td_proc = &bt->proc;
+	bt->td.td_cpuset = &bt->cpuset;
+	bt->td.td_lastcpu = NOCPU;
+	init_petri_thread(&bt->td);
+}
+
+/* put bt, switched out of cpu, back on a run queue */
+static void
+bench_requeue(struct bench_cpu *cpu, struct bench_thread *bt)
+{
+	struct bench_cpu *target;
+	int queue, share;
+
+	share = rand_r(&cpu->seed) % 100;
+	if (share < global_share) {
+		queue = GLOBAL_QUEUE_OF_CPU(cpu->id);
+		if (cpu->lock != &global_lock)
+			lock_acquire(&global_lock);
+		fire(cpu, bt, TRAN_QUEUE_GLOBAL_OF(queue));
+		TAILQ_INSERT_TAIL(&global_runq[queue], bt, link);
+		if (cpu->lock != &global_lock)
+			lock_release(&global_lock);
+		return;
+	}
+
+	target = cpu;
+	if (share < global_share + remote_share && ncpu > 1)
+		target = &cpus[(cpu->id + 1 + rand_r(&cpu->seed) % (ncpu - 1)) % ncpu];
+	if (target->lock != cpu->lock) {
+		lock_release(cpu->lock);
+		lock_acquire(target->lock);
+	}
+	fire(cpu, bt, TRANSITION(target->id, TRAN_ADDTOQUEUE));
+	TAILQ_INSERT_TAIL(&target->runq, bt, link);
+	if (target->lock != cpu->lock) {
+		lock_release(target->lock);
+		lock_acquire(cpu->lock);
+	}
+}
+
+/* the next thread of cpu: its own run queue first, then the global one */
+static struct bench_thread *
+bench_choose(struct bench_cpu *cpu)
+{
+	struct bench_thread *bt;
+	int queue;
+
+	if ((bt = TAILQ_FIRST(&cpu->runq)) != NULL) {
+		TAILQ_REMOVE(&cpu->runq, bt, link);
+		fire(cpu, bt, TRANSITION(cpu->id, TRAN_UNQUEUE));
+		return (bt);
+	}
+
+	queue = GLOBAL_QUEUE_OF_CPU(cpu->id);
+	if (resource_net_tokens(PLACE_GLOBAL_QUEUE_OF(queue)) > 0) {
+		if (cpu->lock != &global_lock)
+			lock_acquire(&global_lock);
+		if ((bt = TAILQ_FIRST(&global_runq[queue])) != NULL) {
+			TAILQ_REMOVE(&global_runq[queue], bt, link);
+			fire(cpu, bt, TRANSITION(cpu->id, TRAN_FROM_GLOBAL_CPU));
+		}
+		if (cpu->lock != &global_lock)
+			lock_release(&global_lock);
+		if (bt != NULL)
+			return (bt);
+	}
+
+	fire(cpu, &cpu->idle, TRANSITION(cpu->id, TRAN_EXEC_IDLE));
+	return (&cpu->idle);
+}
+
+static void *
+cpu_main(void *arg)
+{
+	struct bench_cpu *cpu = arg;
+	struct bench_thread *bt;
+	int queue;
+
+	queue = GLOBAL_QUEUE_OF_CPU(cpu->id);
+	while (!stop) {
+		for (volatile int i = 0; i < work; i++)
+			cpu_spinwait();
+
+		/* the idle thread only switches once there is something to run */
+		if (cpu->running == &cpu->idle &&
+		    resource_net_tokens(PLACE(cpu->id, PLACE_QUEUE)) == 0 &&
+		    resource_net_tokens(PLACE_GLOBAL_QUEUE_OF(queue)) == 0)
+			continue;
+
+		lock_acquire(cpu->lock);
+		bt = cpu->running;
+		fire(cpu, bt, TRANSITION(cpu->id, TRAN_RETURN_INVOL));
+		if (bt != &cpu->idle)
+			bench_requeue(cpu, bt);
+		bt = bench_choose(cpu);
+		fire(cpu, bt, TRANSITION(cpu->id, TRAN_EXEC));
+		cpu->running = bt;
+		lock_release(cpu->lock);
+		cpu->switches++;
+	}
+
+	return (NULL);
+}
+
+static void
+bench_locks(int ncpus, int nthreads, int duration_ms, bool pcpu_locks)
+{
+	struct timespec start, end, pause;
+	struct bench_thread *threads;
+	long switches = 0, refused = 0, acquired, contended, spins;
+	double seconds;
+
+	ncpu = ncpus;
+	mp_ncpus = ncpu;
+	smp_started = 1;
+	init_resource_net();
+	stop = 0;
+
+	cpu_locks = malloc_aligned(ncpu * sizeof(*cpu_locks), CACHE_LINE_SIZE, M_DEVBUF,
+	    M_WAITOK | M_ZERO);
+	global_runq = malloc(ncpu * sizeof(*global_runq), M_DEVBUF, M_WAITOK | M_ZERO);
+	cpus = malloc_aligned(ncpu * sizeof(*cpus), CACHE_LINE_SIZE, M_DEVBUF, M_WAITOK | M_ZERO);
+	threads = malloc(ncpu * nthreads * sizeof(*threads), M_DEVBUF, M_WAITOK | M_ZERO);
+	memset(&global_lock, 0, sizeof(global_lock));
+
+	for (int queue = 0; queue < ncpu; queue++)
+		TAILQ_INIT(&global_runq[queue]);
+	for (int cpu_n = 0; cpu_n < ncpu; cpu_n++) {
+		struct bench_cpu *cpu = &cpus[cpu_n];
+
+		cpu->id = cpu_n;
+		cpu->seed = cpu_n + 1;
+		cpu->lock = pcpu_locks ? &cpu_locks[cpu_n] : &global_lock;
+		TAILQ_INIT(&cpu->runq);
+		init_bench_thread(&cpu->idle, 100000 + cpu_n);
+		/* cpu 0 boots running, the others start in their idle thread */
+		if (cpu_n == 0)
+			init_petri_thread0(&cpu->idle.td);
+		else {
+			fire(cpu, &cpu->idle, TRANSITION(cpu_n, TRAN_EXEC_IDLE));
+			fire(cpu, &cpu->idle, TRANSITION(cpu_n, TRAN_EXEC));
+		}
+		cpu->running = &cpu->idle;
+	}
+	for (int i = 0; i < ncpu * nthreads; i++) {
+		struct bench_cpu *cpu = &cpus[i % ncpu];
+
+		init_bench_thread(&threads[i], 100 + i);
+		fire(cpu, &threads[i], TRANSITION(cpu->id, TRAN_ADDTOQUEUE));
+		TAILQ_INSERT_TAIL(&cpu->runq, &threads[i], link);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int cpu_n = 0; cpu_n < ncpu; cpu_n++)
+		pthread_create(&cpus[cpu_n].thread, NULL, cpu_main, &cpus[cpu_n]);
+	pause.tv_sec = duration_ms / 1000;
+	pause.tv_nsec = (duration_ms % 1000) * 1000000L;
+	nanosleep(&pause, NULL);
+	stop = 1;
+	for (int cpu_n = 0; cpu_n < ncpu; cpu_n++) {
+		pthread_join(cpus[cpu_n].thread, NULL);
+		switches += cpus[cpu_n].switches;
+		refused += cpus[cpu_n].refused;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	acquired = global_lock.acquired;
+	contended = global_lock.contended;
+	spins = global_lock.spins;
+	for (int cpu_n = 0; pcpu_locks && cpu_n < ncpu; cpu_n++) {
+		acquired += cpu_locks[cpu_n].acquired;
+		contended += cpu_locks[cpu_n].contended;
+		spins += cpu_locks[cpu_n].spins;
+	}
+
+	printf("%-8s %5d %12.0f %10.2f%% %12.2f %8ld\n", pcpu_locks ? "per-cpu" : "global",
+	    ncpu, switches / seconds, acquired ? 100.0 * contended / acquired : 0.0,
+	    switches ? (double)spins / switches : 0.0, refused);
+
+	free(threads, M_DEVBUF);
+	free(cpus, M_DEVBUF);
+	free(global_runq, M_DEVBUF);
+	free(cpu_locks, M_DEVBUF);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_locks [-c cpus] [-d milliseconds] [-g global%%] "
+	    "[-r remote%%] [-t threads per cpu] [-w work]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, ncpus = 0, nthreads = 4, duration_ms = 500, max_cpus;
+
+	while ((ch = getopt(argc, argv, "c:d:g:r:t:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			ncpus = atoi(optarg);
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		case 'g':
+			global_share = atoi(optarg);
+			break;
+		case 'r':
+			remote_share = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'w':
+			work = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (ncpus < 0 || ncpus > MAXCPU || duration_ms <= 0 || nthreads <= 0 ||
+	    global_share < 0 || remote_share < 0 || global_share + remote_share > 100 ||
+	    work < 0)
+		usage();
+
+	/* by default every power of two up to the processors online */
+	max_cpus = ncpus;
+	if (ncpus == 0 && (max_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 2)
+		max_cpus = 2;
+	printf("lock      cpus   switches/s   contended spins/switch  refused\n");
+	for (int n = ncpus != 0 ? ncpus : 2; n <= max_cpus; n *= 2) {
+		bench_locks(n, nthreads, duration_ms, false);
+		bench_locks(n, nthreads, duration_ms, true);
+	}
+
+	return (0);
+}
@@ -0,0 +1,377 @@
+/*
+ * petri_netimage: converts resource net images (sys/petri_net_image.h)
+ * between their binary form, which the loader preloads and
+ * kern.sched.petri_net.image takes, and a text form to edit them in.
+ *
+ *   petri_netimage -b			the built-in net, as text
+ *   petri_netimage [-o out] file	check an image, binary or text, and
+ *					print it as text or write it as binary
+ *   petri_netimage -k			the net of the running kernel, as text
+ *   petri_netimage -l file		swap the net of the running kernel
+ *
+ * The text form has one statement per line, # starts a comment:
+ *
+ *   name NAME
+ *   place PLACE [safe] [tokens N] [boot N]	place of the cpu template
+ *   global PLACE [safe] [block N] [tokens N]
+ *   map TRANSITION THREAD_TRANSITION|-	thread net transition fired with it
+ *   arc PLACE TRANSITION WEIGHT|inhibit [secondary]
+ *
+ * Places and transitions are named as in petri_analyze, without the cpu
+ * suffix. Places and transitions left out get no tokens and no thread
+ * transition.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#endif
+
+#include <sys/sched_petri.h>
+
+#include "petri_thread_net.h"
+#include "petri_tools.h"
+
+#define IMAGE_SYSCTL	"kern.sched.petri_net.image"
+
+static const char *path;
+static int line;
+
+static void
+syntax(const char *reason, const char *word)
+{
+
+	errx(1, "%s:%d: %s%s%s", path, line, reason, word != NULL ? ": " : "", word != NULL ? word : "");
+}
+
+static int
+lookup(const char **names, int count, const char *word)
+{
+
+	for (int i = 0; i < count; i++)
+		if (strcmp(names[i], word) == 0)
+			return (i);
+
+	return (-1);
+}
+
+/* place of the template or global one (PETRI_NET_ARC_GLOBAL_PLACE in *flags) */
+static int
+lookup_place(const char *word, uint8_t *flags)
+{
+	int place;
+
+	if ((place = lookup(cpu_places_names, CPU_BASE_PLACES, word)) != -1)
+		return (place);
+	if ((place = lookup(global_place_names, GLOBAL_PLACES, word)) != -1) {
+		*flags |= PETRI_NET_ARC_GLOBAL_PLACE;
+		return (place);
+	}
+	syntax("unknown place", word);
+
+	return (-1);
+}
+
+static int
+lookup_transition(const char *word, uint8_t *flags)
+{
+	int transition;
+
+	if ((transition = lookup(base_transition_names, CPU_BASE_TRANSITIONS, word)) != -1)
+		return (transition);
+	if ((transition = lookup(global_transition_names, GLOBAL_TRANSITIONS, word)) != -1) {
+		*flags |= PETRI_NET_ARC_GLOBAL_TRANSITION;
+		return (transition);
+	}
+	syntax("unknown transition", word);
+
+	return (-1);
+}
+
+static int
+number(const char *word, long min, long max)
+{
+	char *end;
+	long value;
+
+	if (word == NULL)
+		syntax("missing number", NULL);
+	value = strtol(word, &end, 10);
+	if (*end != '\0' || value < min || value > max)
+		syntax("bad number", word);
+
+	return ((int)value);
+}
+
+/* the options of a place statement, after its name */
+static void
+parse_place(struct petri_net_image_place *place, char **words, int count, bool global)
+{
+
+	for (int i = 0; i < count; i++) {
+		if (strcmp(words[i], "safe") == 0)
+			place->pnp_flags |= PETRI_NET_PLACE_SAFE;
+		else if (strcmp(words[i], "tokens") == 0 && i + 1 < count)
+			place->pnp_tokens = number(words[++i], 0, UINT8_MAX);
+		else if (!global && strcmp(words[i], "boot") == 0 && i + 1 < count)
+			place->pnp_boot_tokens = number(words[++i], 0, UINT8_MAX);
+		else if (global && strcmp(words[i], "block") == 0 && i + 1 < count)
+			place->pnp_block = number(words[++i], 0, PETRI_COORDINATOR_BLOCKS - 1);
+		else
+			syntax("bad place option", words[i]);
+	}
+}
+
+static struct petri_net_image *
+parse_text(FILE *in, size_t *size)
+{
+	struct petri_net_image *image;
+	struct petri_net_image_arc *arc;
+	char buf[256], *words[8], *word, *next;
+	int count, place, transition, thread_transition;
+	uint8_t flags;
+
+	image = malloc(PETRI_NET_IMAGE_SIZE(PETRI_NET_IMAGE_ARCS), M_DEVBUF, M_WAITOK | M_ZERO);
+	image->pni_magic = PETRI_NET_IMAGE_MAGIC;
+	image->pni_version = PETRI_NET_IMAGE_VERSION;
+	image->pni_cpu_places = CPU_BASE_PLACES;
+	image->pni_cpu_transitions = CPU_BASE_TRANSITIONS;
+	image->pni_global_places = GLOBAL_PLACES;
+	image->pni_global_transitions = GLOBAL_TRANSITIONS;
+	memset(image->pni_cpu_map, NO_HIERARCHICAL_TRANSITION, CPU_BASE_TRANSITIONS);
+	memset(image->pni_global_map, NO_HIERARCHICAL_TRANSITION, GLOBAL_TRANSITIONS);
+
+	for (line = 1; fgets(buf, sizeof(buf), in) != NULL; line++) {
+		if ((word = strchr(buf, '#')) != NULL)
+			*word = '\0';
+		count = 0;
+		for (next = buf; (word = strsep(&next, " \t\n")) != NULL;) {
+			if (*word == '\0')
+				continue;
+			if (count == nitems(words))
+				syntax("too many words", word);
+			words[count++] = word;
+		}
+		if (count == 0)
+			continue;
+
+		flags = 0;
+		if (strcmp(words[0], "name") == 0 && count == 2) {
+			if (strlcpy(image->pni_name, words[1], sizeof(image->pni_name)) >= sizeof(image->pni_name))
+				syntax("name too long", words[1]);
+		} else if (strcmp(words[0], "place") == 0 && count >= 2) {
+			if ((place = lookup(cpu_places_names, CPU_BASE_PLACES, words[1])) == -1)
+				syntax("unknown cpu place", words[1]);
+			parse_place(&image->pni_cpu_place[place], words + 2, count - 2, false);
+		} else if (strcmp(words[0], "global") == 0 && count >= 2) {
+			if ((place = lookup(global_place_names, GLOBAL_PLACES, words[1])) == -1)
+				syntax("unknown global place", words[1]);
+			parse_place(&image->pni_global_place[place], words + 2, count - 2, true);
+		} else if (strcmp(words[0], "map") == 0 && count == 3) {
+			transition = lookup_transition(words[1], &flags);
+			thread_transition = NO_HIERARCHICAL_TRANSITION;
+			if (strcmp(words[2], "-") != 0 &&
+			    (thread_transition = lookup(thread_transition_names, THREADS_TRANSITIONS_SIZE, words[2])) == -1)
+				syntax("unknown thread transition", words[2]);
+			if (flags & PETRI_NET_ARC_GLOBAL_TRANSITION)
+				image->pni_global_map[transition] = thread_transition;
+			else
+				image->pni_cpu_map[transition] = thread_transition;
+		} else if (strcmp(words[0], "arc") == 0 && (count == 4 || count == 5)) {
+			if (image->pni_arcs == PETRI_NET_IMAGE_ARCS)
+				syntax("too many arcs", NULL);
+			arc = &image->pni_arc[image->pni_arcs++];
+			arc->pna_place = lookup_place(words[1], &flags);
+			arc->pna_transition = lookup_transition(words[2], &flags);
+			if (strcmp(words[3], "inhibit") == 0) {
+				flags |= PETRI_NET_ARC_INHIBITOR;
+				arc->pna_weight = 1;
+			} else
+				arc->pna_weight = number(words[3], INT8_MIN, INT8_MAX);
+			if (count == 5) {
+				if (strcmp(words[4], "secondary") != 0)
+					syntax("bad arc option", words[4]);
+				flags |= PETRI_NET_ARC_SECONDARY;
+			}
+			arc->pna_flags = flags;
+		} else
+			syntax("bad statement", words[0]);
+	}
+	if (ferror(in))
+		err(1, "%s", path);
+	if (image->pni_name[0] == '\0')
+		syntax("no name", NULL);
+
+	*size = PETRI_NET_IMAGE_SIZE(image->pni_arcs);
+
+	return (image);
+}
+
+static void
+print_place(const char *kind, const char *name, const struct petri_net_image_place *place, bool global)
+{
+
+	printf("%s %s", kind, name);
+	if (place->pnp_flags & PETRI_NET_PLACE_SAFE)
+		printf(" safe");
+	if (global && place->pnp_block != 0)
+		printf(" block %d", place->pnp_block);
+	if (place->pnp_tokens != 0)
+		printf(" tokens %d", place->pnp_tokens);
+	if (!global && place->pnp_boot_tokens != 0)
+		printf(" boot %d", place->pnp_boot_tokens);
+	printf("\n");
+}
+
+static void
+print_text(const struct petri_net_image *image)
+{
+	const struct petri_net_image_arc *arc;
+	bool global_transition;
+	int8_t thread_transition;
+
+	printf("name %s\n\n", image->pni_name);
+	for (int p = 0; p < CPU_BASE_PLACES; p++)
+		print_place("place", cpu_places_names[p], &image->pni_cpu_place[p], false);
+	for (int p = 0; p < GLOBAL_PLACES; p++)
+		print_place("global", global_place_names[p], &image->pni_global_place[p], true);
+
+	printf("\n");
+	for (int t = 0; t < CPU_BASE_TRANSITIONS + GLOBAL_TRANSITIONS; t++) {
+		thread_transition = t < CPU_BASE_TRANSITIONS ? image->pni_cpu_map[t] :
+		    image->pni_global_map[t - CPU_BASE_TRANSITIONS];
+		if (thread_transition != NO_HIERARCHICAL_TRANSITION)
+			printf("map %s %s\n", t < CPU_BASE_TRANSITIONS ? base_transition_names[t] :
+			    global_transition_names[t - CPU_BASE_TRANSITIONS], thread_transition_names[thread_transition]);
+	}
+
+	printf("\n");
+	for (int i = 0; i < image->pni_arcs; i++) {
+		arc = &image->pni_arc[i];
+		global_transition = (arc->pna_flags & PETRI_NET_ARC_GLOBAL_TRANSITION) != 0;
+		printf("arc %s %s",
+		    (arc->pna_flags & PETRI_NET_ARC_GLOBAL_PLACE) ? global_place_names[arc->pna_place] :
+		    cpu_places_names[arc->pna_place],
+		    global_transition ? global_transition_names[arc->pna_transition] :
+		    base_transition_names[arc->pna_transition]);
+		if (arc->pna_flags & PETRI_NET_ARC_INHIBITOR)
+			printf(" inhibit");
+		else
+			printf(" %d", arc->pna_weight);
+		printf("%s\n", (arc->pna_flags & PETRI_NET_ARC_SECONDARY) ? " secondary" : "");
+	}
+}
+
+/* a binary image or its text form, checked */
+static struct petri_net_image *
+read_image(const char *file, size_t *size)
+{
+	struct petri_net_image *image;
+	FILE *in;
+	uint32_t magic = 0;
+
+	path = file;
+	if ((in = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	if (fread(&magic, sizeof(magic), 1, in) != 1)
+		magic = 0;
+	if (magic == PETRI_NET_IMAGE_MAGIC) {
+		fclose(in);
+		image = read_image_file(file, size);
+	} else {
+		rewind(in);
+		image = parse_text(in, size);
+		fclose(in);
+	}
+
+	// petri_net_image_check() tells why through log()
+	petri_shim_log_enabled = 1;
+	if (petri_net_image_check(image, *size) != 0)
+		errx(1, "%s: not a usable net image", file);
+
+	return (image);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_netimage -b\n"
+	    "       petri_netimage [-o out] file\n"
+	    "       petri_netimage -k\n"
+	    "       petri_netimage -l file\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct petri_net_image *image;
+	const char *out = NULL, *load = NULL;
+	bool builtin = false, kernel = false;
+	size_t size;
+	FILE *output;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "bkl:o:")) != -1) {
+		switch (ch) {
+		case 'b':
+			builtin = true;
+			break;
+		case 'k':
+			kernel = true;
+			break;
+		case 'l':
+			load = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (builtin + kernel + (load != NULL) + (argc == 1) != 1 || argc > 1 || (out != NULL && argc != 1))
+		usage();
+
+	if (builtin) {
+		mp_ncpus = 1;
+		image = petri_net_builtin_image(&size);
+	} else if (kernel || load != NULL) {
+#ifdef __FreeBSD__
+		if (load != NULL) {
+			image = read_image(load, &size);
+			if (sysctlbyname(IMAGE_SYSCTL, NULL, NULL, image, size) == -1)
+				err(1, "%s", IMAGE_SYSCTL);
+			free(image, M_DEVBUF);
+			return (0);
+		}
+		size = PETRI_NET_IMAGE_SIZE(PETRI_NET_IMAGE_ARCS);
+		image = malloc(size, M_DEVBUF, M_WAITOK | M_ZERO);
+		if (sysctlbyname(IMAGE_SYSCTL, image, &size, NULL, 0) == -1)
+			err(1, "%s", IMAGE_SYSCTL);
+#else
+		errx(1, "-k and -l need a FreeBSD kernel running SCHED_PETRI");
+#endif
+	} else
+		image = read_image(argv[0], &size);
+
+	if (out == NULL)
+		print_text(image);
+	else {
+		if ((output = fopen(out, "w")) == NULL)
+			err(1, "%s", out);
+		if (fwrite(image, size, 1, output) != 1 || fclose(output) != 0)
+			err(1, "%s", out);
+	}
+	free(image, M_DEVBUF);
+
+	return (0);
+}
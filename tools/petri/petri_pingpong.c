@@ -0,0 +1,237 @@
+/*
+ * petri_pingpong: round trip latency of pairs of processes bouncing a
+ * message through two pipes, the producer/consumer pattern that
+ * kern.sched.wake_affine queues near each other.
+ *
+ * Every pair forks two processes: the first writes -s bytes to the second
+ * and reads them back, -n times, timing every round trip; the second reads
+ * and writes them back. Each write wakes the other end of the pair, so
+ * with wake_affine the woken process is queued on a cpu sharing the cache
+ * of the writer, where the message just copied into the pipe still is.
+ * With -a the run is repeated with kern.sched.wake_affine at 0 and at the
+ * value given, and set back afterwards (FreeBSD, as root).
+ */
+
+#include <sys/mman.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#endif
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int pairs = 1, rounds = 100000;
+static size_t size = 1;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+transfer(int fd, char *buf, bool out)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < size) {
+		n = out ? write(fd, buf + done, size - done) : read(fd, buf + done, size - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			_exit(1);
+		done += n;
+	}
+}
+
+/* the first process of a pair, latency[] gets every round trip in ns */
+static void
+ping(int out, int in, uint32_t *latency)
+{
+	char *buf;
+	uint64_t start;
+
+	if ((buf = calloc(1, size)) == NULL)
+		_exit(1);
+	for (int i = 0; i < rounds; i++) {
+		start = now_ns();
+		transfer(out, buf, true);
+		transfer(in, buf, false);
+		latency[i] = (uint32_t)(now_ns() - start);
+	}
+	_exit(0);
+}
+
+static void
+pong(int in, int out)
+{
+	char *buf;
+
+	if ((buf = calloc(1, size)) == NULL)
+		_exit(1);
+	for (int i = 0; i < rounds; i++) {
+		transfer(in, buf, false);
+		buf[0]++;
+		transfer(out, buf, true);
+	}
+	_exit(0);
+}
+
+static int
+compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/**
+ * run every pair at once, released together once all of them are forked,
+ * and print the round trips per second and the latency percentiles
+*/
+static void
+run(const char *label, uint32_t *latency)
+{
+	size_t total = (size_t)pairs * rounds;
+	uint64_t start, elapsed;
+	int go[2], there[2], back[2], status;
+	char byte;
+	bool failed = false;
+
+	if (pipe(go) == -1)
+		err(1, "pipe");
+	for (int pair = 0; pair < pairs; pair++) {
+		if (pipe(there) == -1 || pipe(back) == -1)
+			err(1, "pipe");
+		for (int end = 0; end < 2; end++) {
+			switch (fork()) {
+			case -1:
+				err(1, "fork");
+			case 0:
+				close(go[1]);
+				//wait for the parent to close its end
+				if (read(go[0], &byte, 1) != 0)
+					_exit(1);
+				if (end == 0) {
+					close(there[0]);
+					close(back[1]);
+					ping(there[1], back[0], latency + (size_t)pair * rounds);
+				}
+				close(there[1]);
+				close(back[0]);
+				pong(there[0], back[1]);
+			}
+		}
+		close(there[0]);
+		close(there[1]);
+		close(back[0]);
+		close(back[1]);
+	}
+
+	close(go[0]);
+	start = now_ns();
+	close(go[1]);
+	while (wait(&status) != -1)
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+	elapsed = now_ns() - start;
+	if (failed)
+		errx(1, "a process of a pair failed");
+
+	qsort(latency, total, sizeof(*latency), compare_u32);
+	printf("%-12s %5d %14.0f %10.1f %10.1f %10.1f\n", label, pairs,
+	    total * 1e9 / elapsed, latency[total / 2] / 1e3, latency[total * 99 / 100] / 1e3,
+	    latency[total - 1] / 1e3);
+}
+
+#ifdef __FreeBSD__
+static void
+set_wake_affine(int value)
+{
+
+	if (sysctlbyname("kern.sched.wake_affine", NULL, NULL, &value, sizeof(value)) == -1)
+		err(1, "kern.sched.wake_affine");
+}
+#endif
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_pingpong [-a wake_affine] [-n rounds] [-p pairs] [-s size]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t *latency;
+	int ch, affine = -1;
+
+	while ((ch = getopt(argc, argv, "a:n:p:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			affine = atoi(optarg);
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (rounds < 1 || pairs < 1 || size < 1 || affine == 0)
+		usage();
+#ifndef __FreeBSD__
+	if (affine != -1)
+		errx(1, "-a needs kern.sched.wake_affine");
+#endif
+
+	latency = mmap(NULL, (size_t)pairs * rounds * sizeof(*latency), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	if (latency == MAP_FAILED)
+		err(1, "mmap");
+
+	printf("wake_affine  pairs  round trips/s   p50 (us)   p99 (us)   max (us)\n");
+	if (affine == -1) {
+		run("current", latency);
+		return (0);
+	}
+
+#ifdef __FreeBSD__
+	{
+		size_t len = sizeof(int);
+		char label[16];
+		int saved;
+
+		if (sysctlbyname("kern.sched.wake_affine", &saved, &len, NULL, 0) == -1)
+			err(1, "kern.sched.wake_affine");
+		set_wake_affine(0);
+		run("0", latency);
+		set_wake_affine(affine);
+		snprintf(label, sizeof(label), "%d", affine);
+		run(label, latency);
+		set_wake_affine(saved);
+	}
+#endif
+
+	return (0);
+}
@@ -0,0 +1,465 @@
+/*
+ * petri_replay: feeds a trace written by petri_tracedump (or petri_sim -o)
+ * back through the resource net.
+ *
+ * Records are merged by ptr_ticks and the replay starts at the first
+ * marking snapshot (petri_tracedump -m): every recorded firing is fired
+ * again and the marking word it leaves is compared with the recorded one.
+ * A firing the net refuses or that leaves another marking is counted as a
+ * divergence and the block is set to the recorded word, so a single one
+ * does not hide the rest of the trace.
+ *
+ * With -p the cpu of every thread queued by sched_pickcpu() is also chosen
+ * again with another policy over the replayed marking and compared with
+ * the recorded choice:
+ *
+ *   petri	resource_choose_cpu(), the current net
+ *   4bsd	the stock sched_pickcpu(): the last cpu if allowed, otherwise
+ *		the one with the fewest tokens in its queue
+ *
+ * With -n the recorded firings are replayed that many more times from the
+ * snapshot and timed, -i does it through the matrices, to compare net
+ * layouts against real traffic.
+ *
+ * A trace of a machine with more than one last level cache has a global
+ * queue for each of them: -T smt:cores:llcs gives the topology of the trace,
+ * as petri_sim -T does.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/sched_petri.h>
+
+#define POLICY_NONE	0
+#define POLICY_PETRI	1
+#define POLICY_4BSD	2
+
+#define THREADS_HASH	4096
+
+struct replay_thread {
+	struct thread	td;
+	struct proc	proc;
+	struct cpuset	cpuset;
+	bool		cpuset_complete;	/* the next CPUSET record starts a new mask */
+	struct replay_thread *next;
+};
+
+struct replay_record {
+	struct petri_trace_record record;
+	size_t		index;			/* position in the file, orders records of equal ticks */
+};
+
+extern int *monopolized_cpus_per_proc;
+extern void init_global_variables(void);
+
+static const char *kind_names[PETRI_TRACE_KINDS] = {
+	"fire", "marking", "cpuset", "add", "switch", "rem", "choose", "suspend", "wakeup",
+	"monopolize", "release"
+};
+
+static struct replay_record *records;
+static size_t nrecords, first, start;
+static struct replay_thread *threads[THREADS_HASH];
+static int ncpu, policy = POLICY_NONE, verbose = 0;
+
+static long kinds[PETRI_TRACE_KINDS];
+static long fired, refused, diverged;
+static long picked, agreed;
+static long *recorded_cpus, *policy_cpus;
+
+static int
+compare_records(const void *a, const void *b)
+{
+	const struct replay_record *x = a, *y = b;
+
+	if (x->record.ptr_ticks != y->record.ptr_ticks)
+		return (x->record.ptr_ticks < y->record.ptr_ticks ? -1 : 1);
+	return (x->index < y->index ? -1 : x->index > y->index);
+}
+
+static void
+read_trace(const char *path)
+{
+	struct petri_trace_record record;
+	size_t size = 0;
+	FILE *in;
+
+	if ((in = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		if (nrecords == size) {
+			size = size ? size * 2 : 4096;
+			records = realloc(records, size * sizeof(*records));
+			if (records == NULL)
+				err(1, "realloc");
+		}
+		records[nrecords].record = record;
+		records[nrecords].index = nrecords;
+		nrecords++;
+	}
+	fclose(in);
+
+	qsort(records, nrecords, sizeof(*records), compare_records);
+}
+
+static struct replay_thread *
+thread_lookup(lwpid_t tid)
+{
+	struct replay_thread **bucket = &threads[(u_int)tid % THREADS_HASH], *rt;
+
+	for (rt = *bucket; rt != NULL; rt = rt->next)
+		if (rt->td.td_tid == tid)
+			return (rt);
+
+	rt = malloc(sizeof(*rt), M_DEVBUF, M_WAITOK | M_ZERO);
+	snprintf(rt->proc.p_comm, sizeof(rt->proc.p_comm), "tid%d", tid);
+	rt->td.td_tid = tid;
+	rt->td.td_proc = &rt->proc;
+	rt->td.td_cpuset = &rt->cpuset;
+	rt->td.td_lastcpu = NOCPU;
+	rt->td.td_oncpu = NOCPU;
+	rt->cpuset_complete = true;
+	CPU_FILL(&rt->cpuset.cs_mask);
+	init_petri_thread(&rt->td);
+	rt->next = *bucket;
+	*bucket = rt;
+
+	return (rt);
+}
+
+/* keep the published cpusets in line with a block written behind the net's back */
+static void
+refresh_published_cpus(int block)
+{
+	u_int published = PETRI_PUBLISHED_TRANSITIONS;
+	int transition, place;
+
+	if (block >= CPU_NUMBER)
+		return;
+
+	while ((transition = ffs(published)) != 0) {
+		transition--;
+		if (TRANSITION_IS_ENABLED_ON_CPU(block, transition))
+			CPU_SET(block, &resource_net->enabled_cpus[transition]);
+		else
+			CPU_CLR(block, &resource_net->enabled_cpus[transition]);
+		published &= ~(1u << transition);
+	}
+
+	published = PETRI_PUBLISHED_PLACES;
+	while ((place = ffs(published)) != 0) {
+		place--;
+		if (resource_net_tokens(PLACE(block, place)) > 0)
+			CPU_SET(block, &resource_net->marked_cpus[place]);
+		else
+			CPU_CLR(block, &resource_net->marked_cpus[place]);
+		published &= ~(1u << place);
+	}
+}
+
+static void
+set_block(int block, uint64_t mark)
+{
+
+	resource_net->blocks[block].mark = mark;
+	refresh_published_cpus(block);
+}
+
+/* the process a cpu is monopolized by, or -1, as toggle_pin_cpu_to_proc() keeps it */
+static void
+set_monopolized(int cpu_n, int proc_id)
+{
+
+	monopolized_cpus_per_proc[cpu_n] = proc_id;
+	if (proc_id != -1)
+		CPU_SET(cpu_n, &monopolized_cpus);
+	else
+		CPU_CLR(cpu_n, &monopolized_cpus);
+}
+
+/**
+ * find the first snapshot and size the net after it: the blocks are the
+ * cpus and then the coordinator ones
+*/
+static void
+find_snapshot(void)
+{
+	int blocks = 0;
+
+	for (first = 0; first < nrecords; first++)
+		if (records[first].record.ptr_kind == PETRI_TRACE_MARKING)
+			break;
+	if (first == nrecords)
+		errx(1, "no marking snapshot in the trace, record it with petri_tracedump -m");
+
+	for (start = first; start < nrecords; start++) {
+		struct petri_trace_record *record = &records[start].record;
+
+		if (record->ptr_kind == PETRI_TRACE_MARKING)
+			blocks = MAX(blocks, record->ptr_block + 1);
+		else if (record->ptr_kind != PETRI_TRACE_MONOPOLIZE)
+			break;
+	}
+
+	//the coordinator blocks and the blocks of the other global queues follow the cpus
+	for (int cpus = 1; ncpu == 0 && cpus <= MAXCPU && cpus < blocks; cpus++) {
+		mp_ncpus = cpus;
+		init_global_variables();
+		if (PETRI_BLOCKS == blocks)
+			ncpu = cpus;
+	}
+	if (ncpu < 1 || ncpu > MAXCPU)
+		errx(1, "bad snapshot: %d blocks", blocks);
+}
+
+static void
+restore_snapshot(void)
+{
+	struct petri_trace_record *record;
+
+	for (int cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++)
+		set_monopolized(cpu_n, -1);
+
+	for (size_t i = first; i < start; i++) {
+		record = &records[i].record;
+		if (record->ptr_kind == PETRI_TRACE_MARKING && record->ptr_block < PETRI_BLOCKS)
+			set_block(record->ptr_block, record->ptr_mark);
+		else if (record->ptr_kind == PETRI_TRACE_MONOPOLIZE && record->ptr_block < CPU_NUMBER)
+			set_monopolized(record->ptr_block, record->ptr_mark);
+	}
+}
+
+/* stock 4BSD sched_pickcpu() over the replayed queues */
+static int
+pickcpu_4bsd(struct thread *td)
+{
+	int best = NOCPU, cpu_n;
+
+	if (td->td_lastcpu != NOCPU && td->td_lastcpu < CPU_NUMBER && THREAD_CAN_SCHED(td, td->td_lastcpu))
+		best = td->td_lastcpu;
+	for (cpu_n = 0; cpu_n < CPU_NUMBER; cpu_n++) {
+		if (!THREAD_CAN_SCHED(td, cpu_n))
+			continue;
+		if (best == NOCPU || resource_net_tokens(PLACE(cpu_n, PLACE_QUEUE)) <
+		    resource_net_tokens(PLACE(best, PLACE_QUEUE)))
+			best = cpu_n;
+	}
+
+	return (best);
+}
+
+static void
+replay_add(struct petri_trace_record *record)
+{
+	struct replay_thread *rt = thread_lookup(record->ptr_tid);
+	int cpu_n, transition;
+
+	rt->proc.p_pid = PETRI_TRACE_ADD_PID(record->ptr_mark);
+	rt->td.td_lastcpu = PETRI_TRACE_ADD_LASTCPU(record->ptr_mark);
+	rt->cpuset_complete = true;
+
+	if (policy == POLICY_NONE || PETRI_TRACE_ADD_REASON(record->ptr_mark) != PETRI_TRACE_ADD_PICKED ||
+	    record->ptr_block >= CPU_NUMBER)
+		return;
+
+	if (policy == POLICY_PETRI) {
+		transition = resource_choose_cpu(&rt->td);
+		cpu_n = transition == TRAN_QUEUE_GLOBAL ? NOCPU : transition / CPU_BASE_TRANSITIONS;
+	} else
+		cpu_n = pickcpu_4bsd(&rt->td);
+
+	picked++;
+	recorded_cpus[record->ptr_block]++;
+	if (cpu_n != NOCPU)
+		policy_cpus[cpu_n]++;
+	if (cpu_n == record->ptr_block)
+		agreed++;
+}
+
+static void
+replay_firing(struct petri_trace_record *record)
+{
+	struct replay_thread *rt = thread_lookup(record->ptr_tid);
+	uint64_t mark;
+
+	if (record->ptr_block >= PETRI_BLOCKS || record->ptr_transition >= CPU_NUMBER_TRANSITIONS) {
+		diverged++;
+		return;
+	}
+
+	fired++;
+	if (!resource_try_fire_net(&rt->td, record->ptr_transition, "petri_replay")) {
+		refused++;
+		if (verbose)
+			printf("%ju: transition %u of tid %d refused\n", (uintmax_t)record->ptr_ticks,
+			    record->ptr_transition, record->ptr_tid);
+		set_block(record->ptr_block, record->ptr_mark);
+		return;
+	}
+
+	mark = resource_net->blocks[record->ptr_block].mark;
+	if (mark != record->ptr_mark) {
+		diverged++;
+		if (verbose)
+			printf("%ju: transition %u left block %u at 0x%016jx, recorded 0x%016jx\n",
+			    (uintmax_t)record->ptr_ticks, record->ptr_transition, record->ptr_block,
+			    (uintmax_t)mark, (uintmax_t)record->ptr_mark);
+		set_block(record->ptr_block, record->ptr_mark);
+	}
+}
+
+static void
+replay(void)
+{
+	struct petri_trace_record *record;
+	struct replay_thread *rt;
+
+	restore_snapshot();
+	for (size_t i = start; i < nrecords; i++) {
+		record = &records[i].record;
+		if (record->ptr_kind < PETRI_TRACE_KINDS)
+			kinds[record->ptr_kind]++;
+
+		switch (record->ptr_kind) {
+		case PETRI_TRACE_FIRING:
+			replay_firing(record);
+			break;
+		case PETRI_TRACE_MARKING:
+			//a later snapshot, the replay keeps its own marking
+			break;
+		case PETRI_TRACE_CPUSET:
+			rt = thread_lookup(record->ptr_tid);
+			if (rt->cpuset_complete)
+				CPU_ZERO(&rt->cpuset.cs_mask);
+			rt->cpuset_complete = false;
+			if (record->ptr_transition < nitems(rt->cpuset.cs_mask.__bits))
+				rt->cpuset.cs_mask.__bits[record->ptr_transition] = record->ptr_mark;
+			break;
+		case PETRI_TRACE_ADD:
+			replay_add(record);
+			break;
+		case PETRI_TRACE_MONOPOLIZE:
+			if (record->ptr_block < CPU_NUMBER)
+				set_monopolized(record->ptr_block, record->ptr_mark);
+			break;
+		case PETRI_TRACE_RELEASE:
+			if (record->ptr_block < CPU_NUMBER)
+				set_monopolized(record->ptr_block, -1);
+			break;
+		}
+	}
+}
+
+/* the recorded firings only, as fast as the net takes them */
+static double
+bench(int loops)
+{
+	struct petri_trace_record *record;
+	struct timespec begin, end;
+	long firings = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int loop = 0; loop < loops; loop++) {
+		restore_snapshot();
+		for (size_t i = start; i < nrecords; i++) {
+			record = &records[i].record;
+			if (record->ptr_kind != PETRI_TRACE_FIRING || record->ptr_transition >= CPU_NUMBER_TRANSITIONS)
+				continue;
+			if (!resource_try_fire_net(&thread_lookup(record->ptr_tid)->td, record->ptr_transition,
+			    "petri_replay"))
+				set_block(record->ptr_block, record->ptr_mark);
+			firings++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (firings / ((end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9) / 1e6);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_replay [-iv] [-c cpus] [-n loops] [-p petri|4bsd] [-T smt:cores:llcs] trace\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, loops = 0, smt, cores, llcs;
+
+	while ((ch = getopt(argc, argv, "c:in:p:T:v")) != -1) {
+		switch (ch) {
+		case 'c':
+			ncpu = atoi(optarg);
+			break;
+		case 'i':
+			petri_interpreted = 1;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'p':
+			if (strcmp(optarg, "petri") == 0)
+				policy = POLICY_PETRI;
+			else if (strcmp(optarg, "4bsd") == 0)
+				policy = POLICY_4BSD;
+			else
+				usage();
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d:%d:%d", &smt, &cores, &llcs) != 3 || smt < 1 || cores < 1 || llcs < 1)
+				usage();
+			petri_shim_topology(smt, cores, llcs);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || loops < 0)
+		usage();
+
+	read_trace(argv[0]);
+	find_snapshot();
+
+	//the snapshot already has smp started, START_SMP is only fired if recorded
+	mp_ncpus = ncpu;
+	smp_started = 0;
+	init_resource_net();
+	recorded_cpus = malloc(ncpu * sizeof(long), M_DEVBUF, M_WAITOK | M_ZERO);
+	policy_cpus = malloc(ncpu * sizeof(long), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	replay();
+
+	printf("%zu records, %zu before the snapshot, %d cpus\n", nrecords, first, ncpu);
+	for (int kind = 0; kind < PETRI_TRACE_KINDS; kind++)
+		if (kind != PETRI_TRACE_MARKING && kinds[kind] != 0)
+			printf("%-12s %10ld\n", kind_names[kind], kinds[kind]);
+	printf("firings replayed %ld, refused %ld, diverged %ld\n", fired, refused, diverged);
+
+	if (policy != POLICY_NONE) {
+		printf("%s policy: %ld cpus picked, %ld (%.1f%%) as recorded\n",
+		    policy == POLICY_PETRI ? "petri" : "4bsd", picked, agreed,
+		    picked ? agreed * 100.0 / picked : 0);
+		printf("%-6s %10s %10s\n", "cpu", "recorded", "policy");
+		for (int cpu_n = 0; cpu_n < ncpu; cpu_n++)
+			printf("%-6d %10ld %10ld\n", cpu_n, recorded_cpus[cpu_n], policy_cpus[cpu_n]);
+	}
+
+	if (loops > 0)
+		printf("%s: %.2f M firings/s over %d loops\n", petri_interpreted ? "interpreted" : "generated",
+		    bench(loops), loops);
+
+	return (0);
+}
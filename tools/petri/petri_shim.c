@@ -0,0 +1,193 @@
+/*
+ * Userspace implementation of the kernel services declared in petri_shim.h
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <petri_shim.h>
+#include <sys/petri_trace.h>
+
+#undef malloc
+#undef free
+#undef log
+
+int mp_ncpus = 1;
+volatile int smp_started = 0;
+volatile int ticks = 0;
+int petri_shim_log_enabled = 0;
+struct petri_shim_pcpu petri_shim_pcpu;
+
+static struct proc proc0 = { .p_pid = 0, .p_comm = "petri_shim" };
+static struct thread thread0 = { .td_tid = 100000, .td_proc = &proc0, .td_lastcpu = NOCPU };
+struct thread *curthread = &thread0;
+
+/* no trace rings in userspace, see kern/petri_trace.c */
+char *petri_trace_base = NULL;
+size_t petri_trace_ring_size = 0;
+int petri_trace_enabled = 0;
+
+/* shape of the topology smp_topo() builds, 0 for a single group */
+static int topo_smt, topo_cores, topo_llcs;
+static struct cpu_group *topo_root;
+static int topo_ncpus;
+
+void
+petri_shim_topology(int smt, int cores, int llcs)
+{
+
+	topo_smt = smt;
+	topo_cores = cores;
+	topo_llcs = llcs;
+	topo_ncpus = 0;
+}
+
+/* the socket of cpu, the cpus of a socket are numbered together */
+int
+petri_shim_topology_socket(int cpu)
+{
+
+	if (topo_smt == 0)
+		return (0);
+	return (cpu / (topo_smt * topo_cores * topo_llcs));
+}
+
+/* the cpus first to last of parent, split into groups of spans[level] cpus and those into the next level */
+static void
+topo_fill(struct cpu_group *parent, int first, int last, const int *spans, int level)
+{
+	static const int8_t levels[] = { CG_SHARE_NONE, CG_SHARE_L3, CG_SHARE_L1 };
+	static const int8_t flags[] = { CG_FLAG_NODE, 0, CG_FLAG_SMT };
+	struct cpu_group *cg;
+	int children;
+
+	for (int cpu = first; cpu <= last; cpu++)
+		CPU_SET(cpu, &parent->cg_mask);
+	parent->cg_count = last - first + 1;
+	parent->cg_first = first;
+	parent->cg_last = last;
+	if (level == 3 || spans[level] <= 1)
+		return;
+
+	children = (last - first + spans[level]) / spans[level];
+	parent->cg_child = calloc(children, sizeof(*parent->cg_child));
+	parent->cg_children = children;
+	for (int i = 0; i < children; i++) {
+		cg = &parent->cg_child[i];
+		cg->cg_parent = parent;
+		cg->cg_level = levels[level];
+		cg->cg_flags = flags[level];
+		topo_fill(cg, first + i * spans[level], MIN(last, first + (i + 1) * spans[level] - 1),
+		    spans, level + 1);
+	}
+}
+
+static void
+topo_free(struct cpu_group *cg)
+{
+
+	for (int i = 0; i < cg->cg_children; i++)
+		topo_free(&cg->cg_child[i]);
+	free(cg->cg_child);
+}
+
+struct cpu_group *
+smp_topo(void)
+{
+	int spans[3];
+
+	if (topo_root != NULL && topo_ncpus == mp_ncpus)
+		return (topo_root);
+
+	if (topo_root != NULL) {
+		topo_free(topo_root);
+		free(topo_root);
+	}
+	topo_root = calloc(1, sizeof(*topo_root));
+	topo_root->cg_level = CG_SHARE_NONE;
+	spans[0] = topo_smt * topo_cores * topo_llcs;	/* socket */
+	spans[1] = topo_smt * topo_cores;		/* llc */
+	spans[2] = topo_smt;				/* core */
+	if (topo_smt == 0)
+		spans[0] = 0;
+	topo_fill(topo_root, 0, mp_ncpus - 1, spans, 0);
+	topo_ncpus = mp_ncpus;
+
+	return (topo_root);
+}
+
+uint64_t
+petri_shim_cpu_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void *
+petri_shim_malloc(size_t size, int flags)
+{
+	void *ptr;
+
+	ptr = (flags & M_ZERO) ? calloc(1, size) : malloc(size);
+	if (ptr == NULL && (flags & M_WAITOK)) {
+		fprintf(stderr, "petri_shim: out of memory allocating %zu bytes\n", size);
+		abort();
+	}
+
+	return (ptr);
+}
+
+void *
+petri_shim_malloc_aligned(size_t size, size_t align, int flags)
+{
+	void *ptr;
+
+	ptr = aligned_alloc(align, (size + align - 1) & ~(align - 1));
+	if (ptr == NULL && (flags & M_WAITOK)) {
+		fprintf(stderr, "petri_shim: out of memory allocating %zu bytes\n", size);
+		abort();
+	}
+	if (ptr != NULL && (flags & M_ZERO))
+		memset(ptr, 0, size);
+
+	return (ptr);
+}
+
+void
+petri_shim_free(void *ptr)
+{
+
+	free(ptr);
+}
+
+void
+petri_shim_panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+void
+petri_shim_log(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!petri_shim_log_enabled)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
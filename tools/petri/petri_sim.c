@@ -0,0 +1,1306 @@
+/*
+ * petri_sim: discrete-event simulation of the 4BSD scheduler hooks, with
+ * the SCHED_PETRI pick/choose logic of patches/sys/kern/sched_4bsd.c.patch
+ * running on the real resource net, next to the stock 4BSD logic.
+ *
+ * A synthetic workload is generated once from the seed: threads arrive
+ * over time, alternate CPU bursts and sleeps, and may be bound to a CPU
+ * (sched_bind, TDF_BOUND) or restricted to a cpuset mask (TSF_AFFINITY).
+ * Both policies replay exactly the same workload:
+ *
+ *   sched_add	threads that are bound or have an affinity mask go to the
+ *		run queue of the CPU sched_pickcpu() returns, the rest to the
+ *		global run queue, with petri the one of the last level cache
+ *		of their last CPU; an idle CPU that can run them is woken up
+ *   sched_choose	the best of the global and the CPU run queues, by priority;
+ *		with petri a CPU left with nothing pulls a thread from the
+ *		global queue resource_choose_global_queue() returns, then
+ *		steals one from the queue of the CPU resource_choose_victim()
+ *		returns, unless -S
+ *   sched_balance	every -L us (0 turns it off) queued threads move from the
+ *		most to the least loaded CPU of every topology group that
+ *		resource_balance_pair() finds unbalanced, as the callout does
+ *   sched_switch	when a burst ends (the thread sleeps or exits) or its
+ *		time slice expires (the thread is put back with sched_add)
+ *
+ * With -P the threads run in pairs, 0 and 1, 2 and 3, ..., that ping-pong
+ * like the ends of a pipe: a burst that ends wakes the other thread of the
+ * pair, which the net sees as woken by it (petri_thread_woken()), and
+ * sleeps until that one wakes it back. With petri the woken thread goes
+ * near its waker once resource_wake_affine_cpu() accepts it.
+ *
+ * With -K pack%[:wait_us] petri packs threads on busy cpus while the load is
+ * under pack% of the cpus (kern.sched.pack and pack_wait): sched_add queues
+ * them to the cpu resource_pack_cpu() returns instead of a global queue,
+ * and every run queue wait is handed to resource_pack_waited().
+ *
+ * With -U cpu:from_us:to_us petri suspends a cpu with turn_off_cpu() over
+ * that time, and the net calls back petri_drain_cpu() as in the kernel:
+ * the threads of its run queue that may run elsewhere move to where
+ * sched_add puts them, and the thread running there is preempted. With
+ * -M cpu the process of the first thread monopolizes that cpu from the
+ * start, so -U can suspend a monopolized cpu (with -A the thread has an
+ * affinity mask and resource_choose_cpu() picks the cpu for it).
+ *
+ * Priorities are fixed per thread and there is no priority preemption,
+ * only time slices. sched_rem is never driven: nothing pulls a thread off a
+ * run queue in these workloads.
+ *
+ * With -T smt:cores:llcs the cpus are laid out in sockets of llcs last level
+ * caches, each shared by cores cores of smt threads, and smp_topo() returns
+ * that topology to the net.
+ *
+ * For each policy it reports throughput, the time threads wait in a run
+ * queue (percentiles), migrations (and how many crossed sockets), how long
+ * the idle periods of the CPUs last and the idle time of every CPU. With -o
+ * the petri run is also written as a trace like petri_tracedump's, for
+ * petri_replay.
+ */
+
+#include <sys/queue.h>
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/sched_petri.h>
+
+/* log() is the kernel logger in the shim, the workload draws use libm's */
+#undef log
+
+#define RQ_NQS		64		/* run queues, like sys/runq.h */
+#define RQ_PPQ		4		/* priorities per queue */
+#define PRI_MIN_TIMESHARE	88
+#define PRI_SPAN	48		/* priorities handed out to threads */
+
+#define POLICY_PETRI	0
+#define POLICY_4BSD	1
+#define POLICIES	2
+
+static const char *policy_names[POLICIES] = { "petri", "4bsd" };
+
+/* workload parameters */
+struct sim_config {
+	int		ncpu;
+	int		nthreads;
+	int		bursts;			/* bursts of every thread before it exits */
+	double		arrival_us;		/* mean time between thread arrivals */
+	double		burst_us;		/* mean cpu burst */
+	double		sleep_us;		/* mean sleep between bursts */
+	uint64_t	quantum_us;		/* time slice */
+	uint64_t	balance_us;		/* period of the petri balancer, 0 for none */
+	int		bound_percent;		/* threads bound to one cpu */
+	int		affinity_percent;	/* threads with a cpuset mask */
+	int		affinity_cpus;		/* cpus in each mask */
+	bool		pairs;			/* threads wake each other in pairs */
+	int		pack;			/* petri_pack, 0 for no packing */
+	int		pack_wait_us;		/* petri_pack_wait */
+	int		suspend_cpu;		/* -1 for none */
+	int		monopolized_cpu;	/* by the first thread, -1 for none */
+	uint64_t	suspend_from_us;
+	uint64_t	suspend_to_us;
+	double		duration_s;		/* simulated time limit */
+	unsigned int	seed;
+};
+
+struct sim_thread {
+	struct thread	td;
+	struct proc	proc;
+	struct cpuset	cpuset;
+	TAILQ_ENTRY(sim_thread) link;
+	int		priority;
+	int		bound_cpu;		/* NOCPU unless bound */
+	bool		affinity;
+	uint64_t	arrival;
+	unsigned int	workload_seed;		/* burst and sleep lengths, the same for every policy */
+	unsigned int	seed;
+	int		bursts_left;
+	uint64_t	burst_left;		/* us left of the current burst */
+	uint64_t	runnable_since;
+	int		runq_cpu;		/* NOCPU for a global queue */
+	int		runq_queue;		/* the global queue, when runq_cpu is NOCPU */
+	int		partner;		/* the other thread of its pair, -1 for none */
+	bool		waiting;		/* for its partner to wake it */
+	int		woken_from;		/* cpu of its partner when woken, until it runs */
+	bool		idle;
+};
+
+TAILQ_HEAD(sim_threadq, sim_thread);
+
+struct sim_runq {
+	struct sim_threadq	queues[RQ_NQS];
+	uint64_t	status;
+	int		length;
+};
+
+struct sim_cpu {
+	struct sim_thread	idle;
+	struct sim_thread	*running;
+	struct sim_runq	runq;
+	uint64_t	slice_start;		/* when the running thread got the cpu */
+	uint64_t	slice_end;		/* when the running thread's event fires */
+	uint64_t	idle_since;
+	uint64_t	idle_time;
+	long		idle_periods;
+};
+
+#define EVENT_ARRIVAL	0
+#define EVENT_WAKEUP	1
+#define EVENT_CPU	2
+#define EVENT_BALANCE	3
+#define EVENT_SUSPEND	4
+#define EVENT_RESUME	5
+
+struct sim_event {
+	uint64_t	time;
+	uint64_t	seq;
+	int		type;
+	int		id;			/* thread, or cpu for EVENT_CPU */
+};
+
+struct sim_stats {
+	uint64_t	end;
+	long		bursts;
+	long		finished;
+	long		migrations;
+	long		socket_migrations;	/* migrations to another socket of -T */
+	long		switches;
+	long		rejected;		/* firings the net refused */
+	long		pickcpu_global;		/* resource_choose_cpu() found no cpu */
+	long		spills;			/* threads taken from the global queue of another cache */
+	long		steals;			/* threads taken from another cpu run queue */
+	long		balanced;		/* threads moved by the balancer */
+	long		wakeups;		/* idle cpus woken */
+	long		packed;			/* threads resource_pack_cpu() queued to a busy cpu */
+	long		drained;		/* threads moved off the queue of the suspended cpu */
+	uint64_t	drain_us;		/* from its suspension until it went idle */
+	long		idle_periods;
+	uint64_t	idle_total;
+	long		pair_wakeups;
+	long		pair_same_cpu;		/* ran on the cpu of the partner that woke it */
+	long		pair_other_socket;	/* ran on another socket than that partner */
+	uint64_t	*waits;
+	long		nwaits;
+	long		waits_size;
+	uint64_t	*idle;			/* idle time per cpu */
+};
+
+static struct sim_config config = {
+	.ncpu = 8,
+	.nthreads = 64,
+	.bursts = 100,
+	.arrival_us = 1000,
+	.burst_us = 2000,
+	.sleep_us = 5000,
+	.quantum_us = 100000,
+	.balance_us = 100000,
+	.bound_percent = 0,
+	.affinity_percent = 0,
+	.affinity_cpus = 2,
+	.pack_wait_us = 1000,
+	.suspend_cpu = -1,
+	.monopolized_cpu = -1,
+	.duration_s = 60,
+	.seed = 1,
+};
+
+static struct sim_thread *threads;
+static struct sim_cpu *cpus;
+static struct sim_runq *global_runq;	/* one per global queue of the net, only the first for 4bsd */
+static struct sim_event *events;
+static int nevents, events_size;
+static uint64_t event_seq, now;
+static int policy, next_idle_cpu;
+static bool steal = true;
+static struct sim_stats *stats;
+static FILE *trace_out;
+static uint64_t suspended_at;		/* when -U suspended its cpu, 0 once it is idle */
+static uint64_t *trace_tails;
+
+/* event queue, a binary heap ordered by time and then insertion */
+
+static bool
+event_before(struct sim_event *a, struct sim_event *b)
+{
+
+	return (a->time < b->time || (a->time == b->time && a->seq < b->seq));
+}
+
+static void
+event_push(uint64_t time, int type, int id)
+{
+	struct sim_event event = { time, event_seq++, type, id }, swap;
+	int i, parent;
+
+	if (nevents == events_size) {
+		events_size = events_size ? events_size * 2 : 256;
+		events = realloc(events, events_size * sizeof(*events));
+		if (events == NULL)
+			abort();
+	}
+
+	i = nevents++;
+	events[i] = event;
+	while (i > 0 && event_before(&events[i], &events[parent = (i - 1) / 2])) {
+		swap = events[i];
+		events[i] = events[parent];
+		events[parent] = swap;
+		i = parent;
+	}
+}
+
+static struct sim_event
+event_pop(void)
+{
+	struct sim_event top = events[0], swap;
+	int i = 0, child;
+
+	events[0] = events[--nevents];
+	while ((child = 2 * i + 1) < nevents) {
+		if (child + 1 < nevents && event_before(&events[child + 1], &events[child]))
+			child++;
+		if (!event_before(&events[child], &events[i]))
+			break;
+		swap = events[i];
+		events[i] = events[child];
+		events[child] = swap;
+		i = child;
+	}
+
+	return (top);
+}
+
+/* run queues, a FIFO per group of RQ_PPQ priorities like runq_add/runq_choose */
+
+static void
+runq_init(struct sim_runq *rq)
+{
+
+	for (int i = 0; i < RQ_NQS; i++)
+		TAILQ_INIT(&rq->queues[i]);
+	rq->status = 0;
+	rq->length = 0;
+}
+
+static void
+runq_add(struct sim_runq *rq, struct sim_thread *st)
+{
+	int queue = st->priority / RQ_PPQ;
+
+	TAILQ_INSERT_TAIL(&rq->queues[queue], st, link);
+	rq->status |= 1ULL << queue;
+	rq->length++;
+}
+
+static struct sim_thread *
+runq_choose(struct sim_runq *rq)
+{
+
+	if (rq->status == 0)
+		return (NULL);
+	return (TAILQ_FIRST(&rq->queues[ffsll(rq->status) - 1]));
+}
+
+static void
+runq_remove(struct sim_runq *rq, struct sim_thread *st)
+{
+	int queue = st->priority / RQ_PPQ;
+
+	TAILQ_REMOVE(&rq->queues[queue], st, link);
+	if (TAILQ_EMPTY(&rq->queues[queue]))
+		rq->status &= ~(1ULL << queue);
+	rq->length--;
+}
+
+/* workload */
+
+static double
+exponential(unsigned int *seed, double mean)
+{
+	double u = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+
+	return (-mean * log(u));
+}
+
+static uint64_t
+draw_us(unsigned int *seed, double mean)
+{
+	uint64_t us = (uint64_t)exponential(seed, mean);
+
+	return (us > 0 ? us : 1);
+}
+
+static void
+generate_workload(void)
+{
+	unsigned int seed = config.seed;
+	uint64_t arrival = 0;
+	int cpu;
+
+	threads = malloc(config.nthreads * sizeof(*threads), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	for (int i = 0; i < config.nthreads; i++) {
+		struct sim_thread *st = &threads[i];
+
+		st->priority = PRI_MIN_TIMESHARE + rand_r(&seed) % PRI_SPAN;
+		st->bound_cpu = NOCPU;
+		if (rand_r(&seed) % 100 < config.bound_percent)
+			st->bound_cpu = rand_r(&seed) % config.ncpu;
+		else if (rand_r(&seed) % 100 < config.affinity_percent)
+			st->affinity = true;
+
+		CPU_ZERO(&st->cpuset.cs_mask);
+		if (st->affinity)
+			for (int k = 0; k < config.affinity_cpus; k++) {
+				cpu = rand_r(&seed) % config.ncpu;
+				CPU_SET(cpu, &st->cpuset.cs_mask);
+			}
+		else if (st->bound_cpu != NOCPU)
+			CPU_SET(st->bound_cpu, &st->cpuset.cs_mask);
+		else
+			for (cpu = 0; cpu < config.ncpu; cpu++)
+				CPU_SET(cpu, &st->cpuset.cs_mask);
+
+		st->arrival = arrival;
+		arrival += draw_us(&seed, config.arrival_us);
+		st->workload_seed = rand_r(&seed);
+	}
+}
+
+/* the scheduler hooks */
+
+static void
+fire(struct sim_thread *st, int transition)
+{
+
+	if (!resource_try_fire_net(&st->td, transition, "petri_sim"))
+		stats[policy].rejected++;
+}
+
+static void
+record_wait(struct sim_thread *st)
+{
+	struct sim_stats *s = &stats[policy];
+
+	if (s->nwaits == s->waits_size) {
+		s->waits_size = s->waits_size ? s->waits_size * 2 : 1024;
+		s->waits = realloc(s->waits, s->waits_size * sizeof(*s->waits));
+		if (s->waits == NULL)
+			abort();
+	}
+	s->waits[s->nwaits++] = now - st->runnable_since;
+	if (policy == POLICY_PETRI)
+		resource_pack_waited(now - st->runnable_since);
+}
+
+/* stock 4BSD: the last cpu if allowed, otherwise the shortest run queue */
+static int
+pickcpu_4bsd(struct sim_thread *st)
+{
+	int best, cpu;
+
+	if (st->td.td_lastcpu != NOCPU && THREAD_CAN_SCHED(&st->td, st->td.td_lastcpu))
+		best = st->td.td_lastcpu;
+	else
+		best = NOCPU;
+	for (cpu = 0; cpu < config.ncpu; cpu++) {
+		if (!THREAD_CAN_SCHED(&st->td, cpu))
+			continue;
+		if (best == NOCPU || cpus[cpu].runq.length < cpus[best].runq.length)
+			best = cpu;
+	}
+
+	return (best);
+}
+
+static int
+pickcpu_petri(struct sim_thread *st)
+{
+	int transition;
+
+	transition = resource_choose_cpu(&st->td);
+	if (transition == TRAN_QUEUE_GLOBAL)
+		return (NOCPU);
+
+	return (transition / CPU_BASE_TRANSITIONS);
+}
+
+/* the global queue of a thread or cpu: the one of its last level cache with petri */
+static int
+global_queue(int cpu_n)
+{
+
+	return (policy == POLICY_PETRI ? GLOBAL_QUEUE_OF_CPU(cpu_n) : 0);
+}
+
+static void
+sched_add(struct sim_thread *st)
+{
+	int cpu = NOCPU, reason = PETRI_TRACE_ADD_GLOBAL;
+
+	st->runnable_since = now;
+	if (policy == POLICY_PETRI)
+		wakeup_if_needed(&st->td);
+
+	if (policy == POLICY_PETRI && st->bound_cpu == NOCPU && !st->affinity &&
+	    (cpu = resource_wake_affine_cpu(&st->td)) != NOCPU)
+		reason = PETRI_TRACE_ADD_AFFINE;
+	else if (policy == POLICY_PETRI && st->bound_cpu == NOCPU && !st->affinity &&
+	    (cpu = resource_pack_cpu(&st->td)) != NOCPU) {
+		reason = PETRI_TRACE_ADD_PACKED;
+		stats[policy].packed++;
+	} else if (st->bound_cpu != NOCPU || st->affinity) {
+		if (st->bound_cpu != NOCPU && (policy == POLICY_4BSD ||
+		    transition_is_sensitized(TRANSITION(st->bound_cpu, TRAN_ADDTOQUEUE)))) {
+			cpu = st->bound_cpu;
+			reason = PETRI_TRACE_ADD_BOUND;
+		} else {
+			cpu = policy == POLICY_PETRI ? pickcpu_petri(st) : pickcpu_4bsd(st);
+			reason = PETRI_TRACE_ADD_PICKED;
+		}
+		//the kernel asserts a cpu was found, keep the thread runnable anyway
+		if (cpu == NOCPU)
+			stats[policy].pickcpu_global++;
+	}
+	st->td.td_petri_wakecpu = NOCPU;
+
+	st->runq_cpu = cpu;
+	st->runq_queue = global_queue(st->td.td_lastcpu != NOCPU ? st->td.td_lastcpu : petri_shim_pcpu.pc_cpuid);
+	if (policy == POLICY_PETRI)
+		PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_ADD, cpu, PETRI_TRACE_ADD_ARG(0, reason,
+		    st->td.td_lastcpu, st->proc.p_pid), cpu != NOCPU ? TRANSITION(cpu, TRAN_ADDTOQUEUE) :
+		    TRAN_QUEUE_GLOBAL_OF(st->runq_queue));
+	if (cpu != NOCPU) {
+		if (policy == POLICY_PETRI)
+			fire(st, TRANSITION(cpu, TRAN_ADDTOQUEUE));
+		runq_add(&cpus[cpu].runq, st);
+	} else {
+		if (policy == POLICY_PETRI)
+			fire(st, TRAN_QUEUE_GLOBAL_OF(st->runq_queue));
+		runq_add(&global_runq[st->runq_queue], st);
+	}
+}
+
+/* the highest priority thread of rq that cpu_n may run, bound ones stay */
+static struct sim_thread *
+steal_from(struct sim_runq *rq, int cpu_n)
+{
+	struct sim_thread *st;
+
+	for (int i = 0; i < RQ_NQS; i++)
+		TAILQ_FOREACH(st, &rq->queues[i], link)
+			if (st->bound_cpu == NOCPU && THREAD_CAN_SCHED(&st->td, cpu_n) &&
+			    cpu_available_for_proc(st->proc.p_pid, cpu_n))
+				return (st);
+
+	return (NULL);
+}
+
+/* sched_steal: REMOVE_QUEUE on the victim, ADDTOQUEUE and UNQUEUE on cpu_n */
+static struct sim_thread *
+sched_steal(int cpu_n)
+{
+	struct sim_thread *st = NULL;
+	cpuset_t tried;
+	int victim;
+
+	if (!steal || !transition_is_sensitized(TRANSITION(cpu_n, TRAN_ADDTOQUEUE)))
+		return (NULL);
+
+	CPU_ZERO(&tried);
+	while ((victim = resource_choose_victim(cpu_n, &tried)) != NOCPU) {
+		if ((st = steal_from(&cpus[victim].runq, cpu_n)) != NULL)
+			break;
+		CPU_SET(victim, &tried);
+	}
+	if (st == NULL)
+		return (NULL);
+
+	PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_REM, victim, 0, TRANSITION(victim, TRAN_REMOVE_QUEUE));
+	fire(st, TRANSITION(victim, TRAN_REMOVE_QUEUE));
+	PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_ADD, cpu_n, PETRI_TRACE_ADD_ARG(0, PETRI_TRACE_ADD_STOLEN,
+	    st->td.td_lastcpu, st->proc.p_pid), TRANSITION(cpu_n, TRAN_ADDTOQUEUE));
+	fire(st, TRANSITION(cpu_n, TRAN_ADDTOQUEUE));
+	PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_CHOOSE, cpu_n, 0, TRANSITION(cpu_n, TRAN_UNQUEUE));
+	fire(st, TRANSITION(cpu_n, TRAN_UNQUEUE));
+
+	runq_remove(&cpus[victim].runq, st);
+	st->runq_cpu = cpu_n;
+	stats[policy].steals++;
+
+	return (st);
+}
+
+/* sched_spill: REMOVE_GLOBAL_QUEUE of the other queue, QUEUE_GLOBAL of its own and FROM_GLOBAL_CPU */
+static struct sim_thread *
+sched_spill(int cpu_n)
+{
+	struct sim_thread *st = NULL;
+	cpuset_t tried;
+	int queue = GLOBAL_QUEUE_OF_CPU(cpu_n), victim;
+
+	CPU_ZERO(&tried);
+	while ((victim = resource_choose_global_queue(cpu_n, &tried)) != -1) {
+		if ((st = runq_choose(&global_runq[victim])) != NULL &&
+		    cpu_available_for_proc(st->proc.p_pid, cpu_n))
+			break;
+		st = NULL;
+		CPU_SET(victim, &tried);
+	}
+	if (st == NULL)
+		return (NULL);
+
+	PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_REM, NOCPU, 0, TRAN_REMOVE_GLOBAL_QUEUE_OF(victim));
+	fire(st, TRAN_REMOVE_GLOBAL_QUEUE_OF(victim));
+	PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_ADD, NOCPU, PETRI_TRACE_ADD_ARG(0, PETRI_TRACE_ADD_SPILLED,
+	    st->td.td_lastcpu, st->proc.p_pid), TRAN_QUEUE_GLOBAL_OF(queue));
+	fire(st, TRAN_QUEUE_GLOBAL_OF(queue));
+	PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_CHOOSE, cpu_n, 0, TRANSITION(cpu_n, TRAN_FROM_GLOBAL_CPU));
+	fire(st, TRANSITION(cpu_n, TRAN_FROM_GLOBAL_CPU));
+
+	runq_remove(&global_runq[victim], st);
+	stats[policy].spills++;
+
+	return (st);
+}
+
+static struct sim_thread *
+sched_choose(int cpu_n)
+{
+	struct sim_thread *st, *stcpu, *idle = &cpus[cpu_n].idle;
+	struct sim_runq *rq = &global_runq[global_queue(cpu_n)];
+	bool suspended = policy == POLICY_PETRI && is_cpu_suspended(cpu_n);
+
+	st = runq_choose(rq);
+	stcpu = runq_choose(&cpus[cpu_n].runq);
+
+	if (suspended || st == NULL || (stcpu != NULL && stcpu->priority < st->priority)) {
+		st = stcpu;
+		rq = &cpus[cpu_n].runq;
+		if (policy == POLICY_PETRI) {
+			if (st != NULL) {
+				PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_CHOOSE, cpu_n, 0, TRANSITION(cpu_n, TRAN_UNQUEUE));
+				fire(st, TRANSITION(cpu_n, TRAN_UNQUEUE));
+			} else if (suspended) {
+				wakeup_if_needed(&idle->td);
+				PETRI_TRACE_HOOK(&idle->td, PETRI_TRACE_CHOOSE, cpu_n, 0,
+				    TRANSITION(cpu_n, TRAN_EXEC_IDLE));
+				fire(idle, TRANSITION(cpu_n, TRAN_EXEC_IDLE));
+				return (idle);
+			}
+		}
+	} else if (policy == POLICY_PETRI) {
+		if (cpu_available_for_proc(st->proc.p_pid, cpu_n)) {
+			PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_CHOOSE, cpu_n, 0,
+			    TRANSITION(cpu_n, TRAN_FROM_GLOBAL_CPU));
+			fire(st, TRANSITION(cpu_n, TRAN_FROM_GLOBAL_CPU));
+		} else if (stcpu != NULL) {
+			//monopolized by another process, its own queue first
+			st = stcpu;
+			rq = &cpus[cpu_n].runq;
+			PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_CHOOSE, cpu_n, 0, TRANSITION(cpu_n, TRAN_UNQUEUE));
+			fire(st, TRANSITION(cpu_n, TRAN_UNQUEUE));
+		} else
+			st = NULL;
+	}
+
+	if (st != NULL) {
+		runq_remove(rq, st);
+		return (st);
+	}
+
+	if (policy == POLICY_PETRI && !suspended &&
+	    ((st = sched_spill(cpu_n)) != NULL || (st = sched_steal(cpu_n)) != NULL))
+		return (st);
+
+	if (policy == POLICY_PETRI) {
+		wakeup_if_needed(&idle->td);
+		PETRI_TRACE_HOOK(&idle->td, PETRI_TRACE_CHOOSE, cpu_n, 0, TRANSITION(cpu_n, TRAN_EXEC_IDLE));
+		fire(idle, TRANSITION(cpu_n, TRAN_EXEC_IDLE));
+	}
+	return (idle);
+}
+
+/* the balancer, kern.sched.balance_threshold and balance_batch at their defaults */
+#define BALANCE_THRESHOLD	1
+#define BALANCE_BATCH		4
+
+static void sched_switch(int cpu_n, int flags, bool runnable);
+
+static void
+balance_group(const cpuset_t *group)
+{
+	struct sim_thread *st;
+	int from, to, imbalance, count;
+
+	imbalance = resource_balance_pair(group, &from, &to);
+	if (imbalance <= BALANCE_THRESHOLD)
+		return;
+
+	count = MIN(imbalance / 2, BALANCE_BATCH);
+	for (int moved = 0; moved < count; moved++) {
+		if (!transition_is_sensitized(TRANSITION(to, TRAN_ADDTOQUEUE)) ||
+		    (st = steal_from(&cpus[from].runq, to)) == NULL)
+			break;
+		PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_REM, from, 0, TRANSITION(from, TRAN_REMOVE_QUEUE));
+		fire(st, TRANSITION(from, TRAN_REMOVE_QUEUE));
+		PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_ADD, to, PETRI_TRACE_ADD_ARG(0, PETRI_TRACE_ADD_BALANCED,
+		    st->td.td_lastcpu, st->proc.p_pid), TRANSITION(to, TRAN_ADDTOQUEUE));
+		fire(st, TRANSITION(to, TRAN_ADDTOQUEUE));
+		runq_remove(&cpus[from].runq, st);
+		runq_add(&cpus[to].runq, st);
+		st->runq_cpu = to;
+		stats[policy].balanced++;
+	}
+
+	//kick_other_cpu()
+	if (cpus[to].runq.length > 0 && cpus[to].running->idle)
+		sched_switch(to, SW_VOL, false);
+}
+
+static void
+sched_balance(void)
+{
+	const cpuset_t *group;
+
+	for (int level = 0; level < PETRI_TOPO_LEVELS; level++)
+		for (int cpu_n = 0; cpu_n < config.ncpu; cpu_n++) {
+			group = PETRI_TOPO_GROUP(resource_net, cpu_n, level);
+			if (CPU_FFS(group) - 1 == cpu_n)
+				balance_group(group);
+		}
+	balance_group(NULL);
+}
+
+/* put newtd on the cpu, as sched_switch does after choosethread() */
+static void
+run_thread(int cpu_n, struct sim_thread *newtd)
+{
+	struct sim_cpu *cpu = &cpus[cpu_n];
+
+	if (policy == POLICY_PETRI)
+		fire(newtd, TRANSITION(cpu_n, TRAN_EXEC));
+
+	cpu->running = newtd;
+	newtd->td.td_oncpu = cpu_n;
+	if (newtd->idle) {
+		cpu->idle_since = now;
+		if (cpu_n == config.suspend_cpu && suspended_at != 0) {
+			stats[policy].drain_us = now - suspended_at;
+			suspended_at = 0;
+		}
+		return;
+	}
+
+	record_wait(newtd);
+	if (newtd->woken_from != NOCPU) {
+		stats[policy].pair_wakeups++;
+		if (newtd->woken_from == cpu_n)
+			stats[policy].pair_same_cpu++;
+		if (petri_shim_topology_socket(newtd->woken_from) != petri_shim_topology_socket(cpu_n))
+			stats[policy].pair_other_socket++;
+		newtd->woken_from = NOCPU;
+	}
+	if (newtd->td.td_lastcpu != NOCPU && newtd->td.td_lastcpu != cpu_n) {
+		stats[policy].migrations++;
+		if (petri_shim_topology_socket(newtd->td.td_lastcpu) != petri_shim_topology_socket(cpu_n))
+			stats[policy].socket_migrations++;
+	}
+	cpu->slice_start = now;
+	cpu->slice_end = now + MIN(newtd->burst_left, config.quantum_us);
+	event_push(cpu->slice_end, EVENT_CPU, cpu_n);
+}
+
+/**
+ * switch the running thread of a cpu out. runnable is set when its time
+ * slice expired and it goes back to a run queue
+*/
+static void
+sched_switch(int cpu_n, int flags, bool runnable)
+{
+	struct sim_cpu *cpu = &cpus[cpu_n];
+	struct sim_thread *td = cpu->running;
+
+	petri_shim_pcpu.pc_cpuid = cpu_n;
+	stats[policy].switches++;
+	if (td->idle) {
+		cpu->idle_time += now - cpu->idle_since;
+		cpu->idle_periods++;
+	}
+
+	td->td.td_lastcpu = cpu_n;
+	td->td.td_oncpu = NOCPU;
+	if (policy == POLICY_PETRI)
+		resource_expulse_thread(&td->td, flags, "petri_sim");
+
+	if (runnable)
+		sched_add(td);
+
+	run_thread(cpu_n, sched_choose(cpu_n));
+}
+
+/**
+ * wake idle cpus for a thread just added, as kick_other_cpu and
+ * forward_wakeup do: its own cpu for a cpu run queue, otherwise idle cpus
+ * in turn until one of them takes a thread from its global queue, the
+ * ones of the queue first. for petri only the ones resource_wakeup_cpus()
+ * gives for the thread
+*/
+static void
+kick_idle_cpus(struct sim_thread *st)
+{
+	struct sim_runq *rq = &global_runq[st->runq_queue];
+	cpuset_t wake;
+	bool local;
+	int cpu_n;
+
+	if (st->runq_cpu != NOCPU) {
+		if (cpus[st->runq_cpu].running->idle) {
+			stats[policy].wakeups++;
+			sched_switch(st->runq_cpu, SW_VOL, false);
+		}
+		return;
+	}
+
+	if (policy == POLICY_PETRI)
+		resource_wakeup_cpus(&st->td, &wake);
+	for (int i = 0; i < 2 * config.ncpu && rq->length > 0; i++) {
+		cpu_n = (next_idle_cpu + i) % config.ncpu;
+		local = policy == POLICY_4BSD || CPU_ISSET(cpu_n, &global_queue_cpus[st->runq_queue]);
+		if (!cpus[cpu_n].running->idle || local != (i < config.ncpu) ||
+			(policy == POLICY_PETRI && !CPU_ISSET(cpu_n, &wake)))
+			continue;
+		stats[policy].wakeups++;
+		sched_switch(cpu_n, SW_VOL, false);
+		if (!cpus[cpu_n].running->idle) {
+			next_idle_cpu = (cpu_n + 1) % config.ncpu;
+			break;
+		}
+	}
+}
+
+/**
+ * st, running on cpu_n, wakes its partner up when it waits for it, as
+ * writing to a pipe wakes its reader: sched_wakeup() records the waker
+ * before sched_add() and the idle cpus are kicked
+*/
+static void
+pair_wakeup(struct sim_thread *st, int cpu_n)
+{
+	struct sim_thread *partner = &threads[st->partner];
+
+	if (!partner->waiting)
+		return;
+
+	partner->waiting = false;
+	partner->woken_from = cpu_n;
+	petri_shim_pcpu.pc_cpuid = cpu_n;
+	petri_thread_woken(&partner->td, &st->td, cpu_n);
+	sched_add(partner);
+	kick_idle_cpus(partner);
+}
+
+static void
+cpu_event(int cpu_n)
+{
+	struct sim_thread *st = cpus[cpu_n].running;
+	uint64_t ran = now - cpus[cpu_n].slice_start;
+
+	st->burst_left -= ran;
+	if (st->burst_left > 0) {
+		sched_switch(cpu_n, SW_INVOL, true);
+		return;
+	}
+
+	stats[policy].bursts++;
+	if (--st->bursts_left == 0) {
+		stats[policy].finished++;
+		//the partner goes on alone
+		if (st->partner != -1) {
+			pair_wakeup(st, cpu_n);
+			threads[st->partner].partner = -1;
+		}
+		sched_switch(cpu_n, SW_VOL, false);
+		return;
+	}
+
+	st->burst_left = draw_us(&st->seed, config.burst_us);
+	if (st->partner != -1) {
+		pair_wakeup(st, cpu_n);
+		st->waiting = true;
+	} else
+		event_push(now + draw_us(&st->seed, config.sleep_us), EVENT_WAKEUP, st - threads);
+	sched_switch(cpu_n, SW_VOL, false);
+}
+
+/**
+ * the net suspended cpu_n, petri_drain_cpu() as sched_drain(): the threads
+ * of its run queue that are not bound leave through REMOVE_QUEUE for the
+ * cpu resource_choose_cpu() picks if they have affinity, else for a busy
+ * cpu if resource_pack_cpu() packs them or their global queue. then the
+ * running thread is preempted, its burst so far accounted
+*/
+static void
+drain_cpu(int cpu_n)
+{
+	struct sim_thread **drain, *st;
+	int count = 0, cpu, queue;
+
+	drain = malloc((cpus[cpu_n].runq.length + 1) * sizeof(*drain), M_DEVBUF, M_WAITOK);
+	for (int i = 0; i < RQ_NQS; i++)
+		TAILQ_FOREACH(st, &cpus[cpu_n].runq.queues[i], link)
+			if (st->bound_cpu == NOCPU)
+				drain[count++] = st;
+
+	//kicking an idle cpu may have it steal the next one first
+	for (int i = 0; i < count; i++) {
+		st = drain[i];
+		if (st->runq_cpu != cpu_n)
+			continue;
+		queue = global_queue(st->td.td_lastcpu != NOCPU ? st->td.td_lastcpu : cpu_n);
+		if (st->affinity) {
+			if ((cpu = pickcpu_petri(st)) == NOCPU)
+				continue;
+		} else
+			cpu = resource_pack_cpu(&st->td);
+		//stays, as in sched_drain(), when retrying would pick the same
+		if (cpu == cpu_n ||
+		    (cpu != NOCPU && !transition_is_sensitized(TRANSITION(cpu, TRAN_ADDTOQUEUE))))
+			continue;
+
+		PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_REM, cpu_n, 0, TRANSITION(cpu_n, TRAN_REMOVE_QUEUE));
+		fire(st, TRANSITION(cpu_n, TRAN_REMOVE_QUEUE));
+		runq_remove(&cpus[cpu_n].runq, st);
+		PETRI_TRACE_HOOK(&st->td, PETRI_TRACE_ADD, cpu, PETRI_TRACE_ADD_ARG(0, PETRI_TRACE_ADD_DRAINED,
+		    st->td.td_lastcpu, st->proc.p_pid), cpu != NOCPU ? TRANSITION(cpu, TRAN_ADDTOQUEUE) :
+		    TRAN_QUEUE_GLOBAL_OF(queue));
+		st->runq_cpu = cpu;
+		st->runq_queue = queue;
+		if (cpu != NOCPU) {
+			fire(st, TRANSITION(cpu, TRAN_ADDTOQUEUE));
+			runq_add(&cpus[cpu].runq, st);
+		} else {
+			fire(st, TRAN_QUEUE_GLOBAL_OF(queue));
+			runq_add(&global_runq[queue], st);
+		}
+		stats[policy].drained++;
+		kick_idle_cpus(st);
+	}
+	free(drain, M_DEVBUF);
+
+	st = cpus[cpu_n].running;
+	if (!st->idle && st->bound_cpu == NOCPU) {
+		st->burst_left -= now - cpus[cpu_n].slice_start;
+		sched_switch(cpu_n, SW_INVOL, true);
+		kick_idle_cpus(st);
+	}
+}
+
+/**
+ * trace rings of the simulated cpus, written with the kernel code and
+ * drained to the -o file after every event
+*/
+static void
+trace_start(void)
+{
+	struct petri_trace_ring *ring;
+
+	petri_trace_ring_size = sizeof(struct petri_trace_ring) +
+	    PETRI_TRACE_RECORDS * sizeof(struct petri_trace_record);
+	petri_trace_base = malloc(config.ncpu * petri_trace_ring_size, M_DEVBUF, M_WAITOK | M_ZERO);
+	trace_tails = malloc(config.ncpu * sizeof(*trace_tails), M_DEVBUF, M_WAITOK | M_ZERO);
+	for (int cpu_n = 0; cpu_n < config.ncpu; cpu_n++) {
+		ring = (struct petri_trace_ring *)(petri_trace_base + cpu_n * petri_trace_ring_size);
+		ring->ptr_version = PETRI_TRACE_VERSION;
+		ring->ptr_ncpu = config.ncpu;
+		ring->ptr_records = PETRI_TRACE_RECORDS;
+		ring->ptr_size = petri_trace_ring_size;
+	}
+	petri_trace_enabled = 1;
+	petri_shim_pcpu.pc_cpuid = 0;
+	petri_trace_snapshot();
+}
+
+static void
+trace_drain(void)
+{
+	struct petri_trace_ring *ring;
+
+	for (int cpu_n = 0; cpu_n < config.ncpu; cpu_n++) {
+		ring = (struct petri_trace_ring *)(petri_trace_base + cpu_n * petri_trace_ring_size);
+		for (; trace_tails[cpu_n] < ring->ptr_head; trace_tails[cpu_n]++)
+			fwrite(&ring->ptr_record[trace_tails[cpu_n] & (ring->ptr_records - 1)],
+			    sizeof(struct petri_trace_record), 1, trace_out);
+	}
+}
+
+static void
+trace_stop(void)
+{
+
+	trace_drain();
+	petri_trace_enabled = 0;
+	free(trace_tails, M_DEVBUF);
+	free(petri_trace_base, M_DEVBUF);
+	petri_trace_base = NULL;
+}
+
+static void
+init_thread(struct sim_thread *st, int tid, pid_t pid)
+{
+
+	st->proc.p_pid = pid;
+	snprintf(st->proc.p_comm, sizeof(st->proc.p_comm), "sim%d", tid);
+	st->td.td_tid = tid;
+	st->td.td_proc = &st->proc;
+	st->td.td_cpuset = &st->cpuset;
+	st->td.td_lastcpu = NOCPU;
+	st->td.td_oncpu = NOCPU;
+	init_petri_thread(&st->td);
+}
+
+static void
+simulate(int sim_policy)
+{
+	struct sim_event event;
+	uint64_t limit = config.duration_s * 1e6;
+
+	policy = sim_policy;
+	now = 0;
+	ticks = 0;
+	nevents = 0;
+	event_seq = 0;
+	next_idle_cpu = 0;
+
+	if (policy == POLICY_PETRI) {
+		mp_ncpus = config.ncpu;
+		smp_started = 0;
+		petri_pack = config.pack;
+		petri_pack_wait = config.pack_wait_us;
+		petri_drain_cpu = drain_cpu;
+		init_resource_net();
+		smp_started = 1;
+		if (trace_out != NULL)
+			trace_start();
+		if (config.monopolized_cpu != -1)
+			monopolize_cpu(1, config.monopolized_cpu);
+	}
+
+	global_runq = malloc(config.ncpu * sizeof(*global_runq), M_DEVBUF, M_WAITOK | M_ZERO);
+	for (int queue = 0; queue < config.ncpu; queue++)
+		runq_init(&global_runq[queue]);
+
+	cpus = malloc(config.ncpu * sizeof(*cpus), M_DEVBUF, M_WAITOK | M_ZERO);
+	for (int cpu_n = 0; cpu_n < config.ncpu; cpu_n++) {
+		struct sim_cpu *cpu = &cpus[cpu_n];
+
+		runq_init(&cpu->runq);
+		init_thread(&cpu->idle, 100000 + cpu_n, 0);
+		cpu->idle.idle = true;
+		CPU_ZERO(&cpu->idle.cpuset.cs_mask);
+		CPU_SET(cpu_n, &cpu->idle.cpuset.cs_mask);
+		//cpu 0 boots running, the others start in their idle thread
+		if (cpu_n == 0) {
+			init_petri_thread0(&cpu->idle.td);
+			cpu->running = &cpu->idle;
+			cpu->idle.td.td_oncpu = 0;
+		} else
+			run_thread(cpu_n, sched_choose(cpu_n));
+	}
+	//then goes idle as the others, so the net publishes it idle and it gets woken
+	sched_switch(0, SW_VOL, false);
+
+	for (int i = 0; i < config.nthreads; i++) {
+		struct sim_thread *st = &threads[i];
+
+		init_thread(st, 100 + i, i + 1);
+		st->seed = st->workload_seed;
+		st->bursts_left = config.bursts;
+		st->partner = config.pairs && (i ^ 1) < config.nthreads ? i ^ 1 : -1;
+		st->waiting = false;
+		st->woken_from = NOCPU;
+		event_push(st->arrival, EVENT_ARRIVAL, i);
+	}
+	if (policy == POLICY_PETRI && config.balance_us > 0)
+		event_push(config.balance_us, EVENT_BALANCE, 0);
+	if (policy == POLICY_PETRI && config.suspend_cpu != -1) {
+		event_push(config.suspend_from_us, EVENT_SUSPEND, config.suspend_cpu);
+		event_push(config.suspend_to_us, EVENT_RESUME, config.suspend_cpu);
+	}
+
+	while (nevents > 0 && stats[policy].finished < config.nthreads) {
+		event = event_pop();
+		if (event.time > limit)
+			break;
+		now = event.time;
+		ticks = now / 1000;	/* hz = 1000 */
+		petri_shim_pcpu.pc_cpuid = 0;
+		switch (event.type) {
+		case EVENT_ARRIVAL:
+			threads[event.id].burst_left = draw_us(&threads[event.id].seed, config.burst_us);
+			/* FALLTHROUGH */
+		case EVENT_WAKEUP:
+			sched_add(&threads[event.id]);
+			kick_idle_cpus(&threads[event.id]);
+			break;
+		case EVENT_CPU:
+			//a preempted thread left its slice early
+			if (cpus[event.id].running->idle || cpus[event.id].slice_end != now)
+				break;
+			cpu_event(event.id);
+			break;
+		case EVENT_BALANCE:
+			sched_balance();
+			event_push(now + config.balance_us, EVENT_BALANCE, 0);
+			break;
+		case EVENT_SUSPEND:
+			suspended_at = now;
+			turn_off_cpu(event.id);
+			if (suspended_at != 0 && cpus[event.id].running->idle) {
+				stats[policy].drain_us = 0;
+				suspended_at = 0;
+			}
+			break;
+		case EVENT_RESUME:
+			turn_on_cpu(event.id);
+			if (cpus[event.id].running->idle && global_runq[global_queue(event.id)].length > 0)
+				sched_switch(event.id, SW_VOL, false);
+			break;
+		}
+		if (policy == POLICY_PETRI && trace_out != NULL)
+			trace_drain();
+	}
+	if (policy == POLICY_PETRI && trace_out != NULL)
+		trace_stop();
+
+	stats[policy].end = now;
+	stats[policy].idle = malloc(config.ncpu * sizeof(uint64_t), M_DEVBUF, M_WAITOK | M_ZERO);
+	for (int cpu_n = 0; cpu_n < config.ncpu; cpu_n++) {
+		if (cpus[cpu_n].running->idle) {
+			cpus[cpu_n].idle_time += now - cpus[cpu_n].idle_since;
+			cpus[cpu_n].idle_periods++;
+		}
+		stats[policy].idle[cpu_n] = cpus[cpu_n].idle_time;
+		stats[policy].idle_total += cpus[cpu_n].idle_time;
+		stats[policy].idle_periods += cpus[cpu_n].idle_periods;
+	}
+	free(cpus, M_DEVBUF);
+	free(global_runq, M_DEVBUF);
+}
+
+/* report */
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static double
+percentile(struct sim_stats *s, double p)
+{
+
+	if (s->nwaits == 0)
+		return (0);
+	return (s->waits[(long)((s->nwaits - 1) * p / 100)]);
+}
+
+static void
+report(bool run[POLICIES])
+{
+	struct sim_stats *s;
+	static const double percentiles[] = { 50, 90, 99, 100 };
+	int p;
+
+	for (p = 0; p < POLICIES; p++)
+		if (run[p])
+			qsort(stats[p].waits, stats[p].nwaits, sizeof(uint64_t), compare_u64);
+
+	printf("%-24s", "");
+	for (p = 0; p < POLICIES; p++)
+		if (run[p])
+			printf(" %12s", policy_names[p]);
+	printf("\n");
+
+#define ROW(label, fmt, expr) do {					\
+	printf("%-24s", label);						\
+	for (p = 0; p < POLICIES; p++) {				\
+		s = &stats[p];						\
+		if (run[p])						\
+			printf(" " fmt, expr);				\
+	}								\
+	printf("\n");							\
+} while (0)
+
+	ROW("simulated time (s)", "%12.3f", s->end / 1e6);
+	ROW("threads finished", "%12ld", s->finished);
+	ROW("bursts", "%12ld", s->bursts);
+	ROW("bursts/s", "%12.1f", s->end ? s->bursts * 1e6 / s->end : 0);
+	ROW("context switches", "%12ld", s->switches);
+	ROW("migrations", "%12ld", s->migrations);
+	ROW("  to another socket", "%12ld", s->socket_migrations);
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		char label[32];
+
+		if (percentiles[i] == 100)
+			snprintf(label, sizeof(label), "runq wait max (us)");
+		else
+			snprintf(label, sizeof(label), "runq wait p%.0f (us)", percentiles[i]);
+		ROW(label, "%12.0f", percentile(s, percentiles[i]));
+	}
+	ROW("no cpu picked", "%12ld", s->pickcpu_global);
+	ROW("threads spilled", "%12ld", s->spills);
+	ROW("threads stolen", "%12ld", s->steals);
+	ROW("threads balanced", "%12ld", s->balanced);
+	ROW("idle cpus woken", "%12ld", s->wakeups);
+	if (config.pack)
+		ROW("threads packed", "%12ld", s->packed);
+	if (config.suspend_cpu != -1) {
+		ROW("threads drained", "%12ld", s->drained);
+		ROW("  cpu idle after (us)", "%12ju", (uintmax_t)s->drain_us);
+	}
+	ROW("idle periods", "%12ld", s->idle_periods);
+	ROW("  mean length (us)", "%12.0f", s->idle_periods ? (double)s->idle_total / s->idle_periods : 0);
+	if (config.pairs) {
+		ROW("pair wakeups", "%12ld", s->pair_wakeups);
+		ROW("  on the waker's cpu", "%12ld", s->pair_same_cpu);
+		ROW("  to another socket", "%12ld", s->pair_other_socket);
+	}
+	ROW("net firings refused", "%12ld", s->rejected);
+	for (int cpu_n = 0; cpu_n < config.ncpu; cpu_n++) {
+		char label[32];
+
+		snprintf(label, sizeof(label), "cpu%d idle (%%)", cpu_n);
+		ROW(label, "%12.1f", s->end ? s->idle[cpu_n] * 100.0 / s->end : 0);
+	}
+#undef ROW
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "usage: petri_sim [-PSv] [-c cpus] [-t threads] [-n bursts] [-a arrival_us]\n"
+	    "                 [-b burst_us] [-w sleep_us] [-q quantum_us] [-B bound%%]\n"
+	    "                 [-A affinity%%] [-k mask_cpus] [-d seconds] [-s seed]\n"
+	    "                 [-L balance_us] [-p petri|4bsd|both] [-T smt:cores:llcs]\n"
+	    "                 [-K pack%%[:wait_us]] [-U cpu:from_us:to_us] [-M cpu]\n"
+	    "                 [-o trace]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	bool run[POLICIES] = { true, true };
+	uintmax_t from_us, to_us;
+	int ch, smt, cores, llcs;
+
+	while ((ch = getopt(argc, argv, "a:A:b:B:c:d:k:K:L:M:n:o:p:Pq:s:St:T:U:vw:")) != -1) {
+		switch (ch) {
+		case 'a':
+			config.arrival_us = atof(optarg);
+			break;
+		case 'A':
+			config.affinity_percent = atoi(optarg);
+			break;
+		case 'b':
+			config.burst_us = atof(optarg);
+			break;
+		case 'B':
+			config.bound_percent = atoi(optarg);
+			break;
+		case 'c':
+			config.ncpu = atoi(optarg);
+			break;
+		case 'd':
+			config.duration_s = atof(optarg);
+			break;
+		case 'k':
+			config.affinity_cpus = atoi(optarg);
+			break;
+		case 'K':
+			if (sscanf(optarg, "%d:%d", &config.pack, &config.pack_wait_us) < 1 ||
+			    config.pack < 0 || config.pack_wait_us < 0)
+				usage();
+			break;
+		case 'L':
+			config.balance_us = strtoull(optarg, NULL, 10);
+			break;
+		case 'M':
+			config.monopolized_cpu = atoi(optarg);
+			break;
+		case 'n':
+			config.bursts = atoi(optarg);
+			break;
+		case 'o':
+			if ((trace_out = fopen(optarg, "w")) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'p':
+			run[POLICY_PETRI] = strcmp(optarg, "4bsd") != 0;
+			run[POLICY_4BSD] = strcmp(optarg, "petri") != 0;
+			if (!run[POLICY_PETRI] && !run[POLICY_4BSD] && strcmp(optarg, "both") != 0)
+				usage();
+			break;
+		case 'P':
+			config.pairs = true;
+			break;
+		case 'q':
+			config.quantum_us = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			config.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			steal = false;
+			break;
+		case 't':
+			config.nthreads = atoi(optarg);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d:%d:%d", &smt, &cores, &llcs) != 3 || smt < 1 || cores < 1 || llcs < 1)
+				usage();
+			petri_shim_topology(smt, cores, llcs);
+			break;
+		case 'U':
+			if (sscanf(optarg, "%d:%ju:%ju", &config.suspend_cpu, &from_us, &to_us) != 3)
+				usage();
+			config.suspend_from_us = from_us;
+			config.suspend_to_us = to_us;
+			break;
+		case 'v':
+			petri_shim_log_enabled = 1;
+			break;
+		case 'w':
+			config.sleep_us = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (config.ncpu < 1 || config.ncpu > MAXCPU || config.nthreads < 1 || config.bursts < 1 ||
+	    config.arrival_us <= 0 || config.burst_us <= 0 || config.sleep_us <= 0 ||
+	    config.quantum_us == 0 || config.affinity_cpus < 1 || config.duration_s <= 0 ||
+	    config.suspend_cpu == 0 || config.suspend_cpu >= config.ncpu ||
+	    config.monopolized_cpu == 0 || config.monopolized_cpu >= config.ncpu ||
+	    (config.suspend_cpu != -1 && config.suspend_from_us >= config.suspend_to_us))
+		usage();
+
+	stats = malloc(POLICIES * sizeof(*stats), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	generate_workload();
+	for (int p = 0; p < POLICIES; p++)
+		if (run[p])
+			simulate(p);
+	report(run);
+
+	return (0);
+}
@@ -0,0 +1,235 @@
+/*
+ * petri_stress: fires transitions of the resource net from several threads
+ * at once, without any lock, and checks the net afterwards.
+ *
+ * Every worker repeatedly tries a random transition: mostly per-CPU ones,
+ * on any CPU so workers race on the same blocks, plus the global queue
+ * ones. Once all of them are done the marking must still satisfy the
+ * P-invariants of the net:
+ *
+ *   CPU + EXECUTING + TOEXEC = 1		for every CPU
+ *   SMP_NOT_READY + SMP_READY = 1
+ *   sum(QUEUE) + sum(GLOBAL_QUEUE) = queued - dequeued	(token conservation)
+ *
+ * and the enabled bits kept in each block and the published cpusets must
+ * match a sensitization computed from scratch.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/sched_petri.h>
+
+extern struct petri_cpu_resource_net *resource_net;
+
+struct worker {
+	pthread_t	thread;
+	struct proc	proc;
+	struct cpuset	cpuset;
+	struct thread	td;
+	unsigned int	seed;
+	long		iterations;
+	long		fired;
+	long		queued;		/* tokens added to a queue */
+	long		dequeued;	/* tokens removed from a queue */
+};
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *worker = arg;
+	int transition, base_transition;
+
+	for (long i = 0; i < worker->iterations; i++) {
+		if (rand_r(&worker->seed) % 8 == 0)
+			transition = PER_CPU_LAST_TRANSITION +
+			    rand_r(&worker->seed) % (CPU_NUMBER_TRANSITIONS - PER_CPU_LAST_TRANSITION);
+		else
+			transition = rand_r(&worker->seed) % PER_CPU_LAST_TRANSITION;
+
+		if (!resource_try_fire_net(&worker->td, transition, "petri_stress"))
+			continue;
+		worker->fired++;
+
+		if (transition >= PER_CPU_LAST_TRANSITION) {
+			for (int queue = 0; queue < GLOBAL_QUEUES; queue++) {
+				if (transition == TRAN_QUEUE_GLOBAL_OF(queue))
+					worker->queued++;
+				else if (transition == TRAN_REMOVE_GLOBAL_QUEUE_OF(queue))
+					worker->dequeued++;
+			}
+			continue;
+		}
+
+		base_transition = transition % CPU_BASE_TRANSITIONS;
+		if (base_transition == TRAN_ADDTOQUEUE)
+			worker->queued++;
+		else if (base_transition == TRAN_REMOVE_QUEUE ||
+		    base_transition == TRAN_UNQUEUE ||
+		    base_transition == TRAN_FROM_GLOBAL_CPU)
+			worker->dequeued++;
+	}
+
+	return (NULL);
+}
+
+static bool
+reference_is_sensitized(int transition_index)
+{
+	struct petri_transition_arcs *transition = &resource_net->transitions[transition_index];
+	struct petri_arc *arc;
+
+	for (int i = transition->input; i < transition->output; i++) {
+		arc = &resource_net->arcs[i];
+		if (resource_net_tokens(arc->place) + arc->weight < 0)
+			return (false);
+	}
+	for (int i = transition->inhibitor; i < transition->end; i++)
+		if (resource_net_tokens(resource_net->arcs[i].place) > 0)
+			return (false);
+
+	return (true);
+}
+
+static int
+check_net(long queued, long dequeued)
+{
+	long tokens;
+	int errors = 0, cpu;
+
+	tokens = 0;
+	for (int queue = 0; queue < GLOBAL_QUEUES; queue++)
+		tokens += resource_net_tokens(PLACE_GLOBAL_QUEUE_OF(queue));
+	for (cpu = 0; cpu < CPU_NUMBER; cpu++) {
+		if (resource_net_tokens(PLACE(cpu, PLACE_CPU)) +
+		    resource_net_tokens(PLACE(cpu, PLACE_EXECUTING)) +
+		    resource_net_tokens(PLACE(cpu, PLACE_TOEXEC)) != 1) {
+			printf("  CPU%d: CPU + EXECUTING + TOEXEC != 1\n", cpu);
+			errors++;
+		}
+		tokens += resource_net_tokens(PLACE(cpu, PLACE_QUEUE));
+
+		for (int base_transition = 0; base_transition < CPU_BASE_TRANSITIONS; base_transition++) {
+			if ((PETRI_PUBLISHED_TRANSITIONS & (1u << base_transition)) &&
+			    CPU_ISSET(cpu, &resource_net->enabled_cpus[base_transition]) !=
+			    TRANSITION_IS_ENABLED_ON_CPU(cpu, base_transition)) {
+				printf("  CPU%d: published enabling of %d out of date\n", cpu, base_transition);
+				errors++;
+			}
+		}
+		for (int num_place = 0; num_place < CPU_BASE_PLACES; num_place++) {
+			if ((PETRI_PUBLISHED_PLACES & (1u << num_place)) &&
+			    CPU_ISSET(cpu, &resource_net->marked_cpus[num_place]) !=
+			    (resource_net_tokens(PLACE(cpu, num_place)) > 0)) {
+				printf("  CPU%d: published marking of %d out of date\n", cpu, num_place);
+				errors++;
+			}
+		}
+	}
+
+	if (resource_net_tokens(PLACE_SMP_NOT_READY) + resource_net_tokens(PLACE_SMP_READY) != 1) {
+		printf("  SMP_NOT_READY + SMP_READY != 1\n");
+		errors++;
+	}
+
+	if (tokens != queued - dequeued) {
+		printf("  queues hold %ld tokens, %ld queued - %ld dequeued\n", tokens, queued, dequeued);
+		errors++;
+	}
+
+	for (int transition = 0; transition < CPU_NUMBER_TRANSITIONS; transition++) {
+		if (transition_is_sensitized(transition) != reference_is_sensitized(transition)) {
+			printf("  transition %d: enabled bit out of date\n", transition);
+			errors++;
+		}
+	}
+
+	return (errors);
+}
+
+static int
+stress_cpu_number(int ncpu, int nthreads, long iterations)
+{
+	struct worker *workers;
+	long fired = 0, queued = 0, dequeued = 0;
+	int errors;
+
+	mp_ncpus = ncpu;
+	smp_started = 1;
+	init_resource_net();
+
+	workers = malloc(nthreads * sizeof(*workers), M_DEVBUF, M_WAITOK | M_ZERO);
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].proc.p_pid = i + 1;
+		snprintf(workers[i].proc.p_comm, sizeof(workers[i].proc.p_comm), "stress%d", i);
+		CPU_FILL(&workers[i].cpuset.cs_mask);
+		workers[i].td.td_tid = 100001 + i;
+		workers[i].td.td_proc = &workers[i].proc;
+		workers[i].td.td_cpuset = &workers[i].cpuset;
+		workers[i].td.td_lastcpu = NOCPU;
+		workers[i].seed = i + 1;
+		workers[i].iterations = iterations;
+		init_petri_thread(&workers[i].td);
+	}
+
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		fired += workers[i].fired;
+		queued += workers[i].queued;
+		dequeued += workers[i].dequeued;
+	}
+	free(workers, M_DEVBUF);
+
+	errors = check_net(queued, dequeued);
+	printf("%6d %8d %12ld %8s\n", ncpu, nthreads, fired, errors ? "FAILED" : "ok");
+
+	return (errors);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_stress [-c cpus] [-i iterations] [-t threads]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int cpu_numbers[] = { 2, 4, 16, 64, 256 };
+	long iterations = 200000;
+	int ch, ncpu = 0, nthreads = 8, errors = 0;
+
+	while ((ch = getopt(argc, argv, "c:i:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			ncpu = atoi(optarg);
+			break;
+		case 'i':
+			iterations = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (iterations <= 0 || nthreads <= 0 || ncpu < 0 || ncpu > MAXCPU)
+		usage();
+
+	printf("  cpus  threads       firings   result\n");
+	if (ncpu != 0)
+		errors += stress_cpu_number(ncpu, nthreads, iterations);
+	else
+		for (size_t i = 0; i < sizeof(cpu_numbers) / sizeof(cpu_numbers[0]); i++)
+			errors += stress_cpu_number(cpu_numbers[i], nthreads, iterations);
+
+	return (errors != 0);
+}
@@ -0,0 +1,52 @@
+/*
+ * Names of the places and transitions of the nets and reading of net
+ * images (sys/petri_net_image.h), shared by the tools.
+ */
+
+#ifndef PETRI_TOOLS_H
+#define PETRI_TOOLS_H
+
+#include <err.h>
+#include <stdio.h>
+
+#include <sys/sched_petri.h>
+
+extern const char *cpu_places_names[];
+
+static const char __unused *base_transition_names[CPU_BASE_TRANSITIONS] = {
+	"ADDTOQUEUE", "EXEC", "EXEC_IDLE", "FROM_GLOBAL_CPU", "REMOVE_QUEUE", "RETURN_INVOL",
+	"RETURN_VOL", "SUSPEND_PROC", "UNQUEUE", "WAKEUP_PROC"
+};
+static const char __unused *global_place_names[GLOBAL_PLACES] = { "GLOBAL_QUEUE", "SMP_NOT_READY", "SMP_READY" };
+static const char __unused *global_transition_names[GLOBAL_TRANSITIONS] = {
+	"REMOVE_GLOBAL_QUEUE", "START_SMP", "QUEUE_GLOBAL"
+};
+static const char __unused *thread_place_names[THREADS_PLACES_SIZE] = {
+	"INACTIVE", "CAN_RUN", "CPU_RUN_QUEUE", "RUNNING", "INHIBITED"
+};
+static const char __unused *thread_transition_names[THREADS_TRANSITIONS_SIZE] = {
+	"INIT", "ON_QUEUE", "SET_RUNNING", "SWITCH_OUT", "TO_WAIT_CHANNEL", "WAKEUP", "REMOVE"
+};
+
+/* read a whole file, at most the size of the largest net image */
+static void *
+read_image_file(const char *path, size_t *size)
+{
+	size_t limit = PETRI_NET_IMAGE_SIZE(PETRI_NET_IMAGE_ARCS) + 1;
+	void *data;
+	FILE *in;
+
+	if ((in = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	data = malloc(limit, M_DEVBUF, M_WAITOK | M_ZERO);
+	*size = fread(data, 1, limit, in);
+	if (ferror(in))
+		err(1, "%s", path);
+	if (*size == limit)
+		errx(1, "%s: larger than any net image", path);
+	fclose(in);
+
+	return (data);
+}
+
+#endif
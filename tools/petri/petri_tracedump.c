@@ -0,0 +1,195 @@
+/*
+ * petri_tracedump: drains the firing trace rings of the resource net
+ * exported by /dev/petri_trace (see sys/petri_trace.h).
+ *
+ * Records are written to the output as raw struct petri_trace_record, ring
+ * by ring on every pass, or as text with -t. Records overwritten before
+ * they could be copied are counted and reported when it exits. With -m the
+ * marking of the net is recorded first (kern.sched.petri_trace.snapshot),
+ * so petri_replay can start from it.
+ */
+
+#include <sys/mman.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#endif
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/petri_trace.h>
+
+static volatile sig_atomic_t done = 0;
+
+static const char *kind_names[PETRI_TRACE_KINDS] = {
+	"fire", "marking", "cpuset", "add", "switch", "rem", "choose", "suspend", "wakeup",
+	"monopolize", "release"
+};
+
+static void
+stop(int sig)
+{
+
+	done = 1;
+}
+
+/**
+ * copy the records of a ring written since *tail, dropping the ones the
+ * kernel may have overwritten while they were being copied
+*/
+static size_t
+drain_ring(struct petri_trace_ring *ring, uint64_t *tail, struct petri_trace_record *buffer,
+    uint64_t *lost)
+{
+	uint64_t head, now, first, index;
+	size_t copied = 0;
+
+	head = __atomic_load_n(&ring->ptr_head, __ATOMIC_ACQUIRE);
+	first = *tail;
+	if (head - first > ring->ptr_records) {
+		*lost += head - first - ring->ptr_records;
+		first = head - ring->ptr_records;
+	}
+
+	for (index = first; index < head; index++)
+		buffer[index - first] = ring->ptr_record[index & (ring->ptr_records - 1)];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	now = __atomic_load_n(&ring->ptr_head, __ATOMIC_RELAXED);
+	for (index = first; index < head; index++) {
+		if (now - index >= ring->ptr_records) {
+			(*lost)++;
+			continue;
+		}
+		buffer[copied++] = buffer[index - first];
+	}
+
+	*tail = head;
+
+	return (copied);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: petri_tracedump [-m] [-s] [-t] [-f device] [-i interval_ms] [-o file]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct petri_trace_ring *ring;
+	struct petri_trace_record *buffer;
+	const char *device = "/dev/" PETRI_TRACE_DEVICE;
+	FILE *out = stdout;
+	uint64_t *tails, lost = 0, written = 0;
+	uint32_t ncpu, size, records;
+	char *rings;
+	size_t copied;
+	int ch, fd, interval = 10;
+	bool single = false, snapshot = false, text = false;
+
+	while ((ch = getopt(argc, argv, "f:i:mo:st")) != -1) {
+		switch (ch) {
+		case 'f':
+			device = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'm':
+			snapshot = true;
+			break;
+		case 'o':
+			if ((out = fopen(optarg, "w")) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 's':
+			single = true;
+			break;
+		case 't':
+			text = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (interval <= 0)
+		usage();
+
+	if ((fd = open(device, O_RDONLY)) == -1)
+		err(1, "%s", device);
+
+	//the header of the first ring tells the geometry of all of them
+	ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		err(1, "mmap %s", device);
+	if (ring->ptr_version != PETRI_TRACE_VERSION)
+		errx(1, "%s: trace version %u, expected %u", device, ring->ptr_version, PETRI_TRACE_VERSION);
+	ncpu = ring->ptr_ncpu;
+	size = ring->ptr_size;
+	records = ring->ptr_records;
+	munmap(ring, sizeof(*ring));
+
+	rings = mmap(NULL, (size_t)ncpu * size, PROT_READ, MAP_SHARED, fd, 0);
+	if (rings == MAP_FAILED)
+		err(1, "mmap %s", device);
+	tails = calloc(ncpu, sizeof(*tails));
+	buffer = calloc(records, sizeof(*buffer));
+	if (tails == NULL || buffer == NULL)
+		err(1, "calloc");
+
+	//start from what is still in the rings
+	for (uint32_t cpu = 0; cpu < ncpu; cpu++) {
+		ring = (struct petri_trace_ring *)(rings + (size_t)cpu * size);
+		tails[cpu] = ring->ptr_head > records ? ring->ptr_head - records : 0;
+	}
+
+	if (snapshot) {
+#ifdef __FreeBSD__
+		int one = 1;
+
+		if (sysctlbyname("kern.sched.petri_trace.snapshot", NULL, NULL, &one, sizeof(one)) == -1)
+			err(1, "kern.sched.petri_trace.snapshot");
+#else
+		errx(1, "-m needs kern.sched.petri_trace.snapshot");
+#endif
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	while (!done) {
+		for (uint32_t cpu = 0; cpu < ncpu; cpu++) {
+			ring = (struct petri_trace_ring *)(rings + (size_t)cpu * size);
+			copied = drain_ring(ring, &tails[cpu], buffer, &lost);
+			written += copied;
+			if (!text) {
+				fwrite(buffer, sizeof(*buffer), copied, out);
+				continue;
+			}
+			for (size_t i = 0; i < copied; i++)
+				fprintf(out, "%ju cpu %u %s tid %d transition %u block %u mark 0x%016jx\n",
+				    (uintmax_t)buffer[i].ptr_ticks, buffer[i].ptr_cpu,
+				    buffer[i].ptr_kind < PETRI_TRACE_KINDS ? kind_names[buffer[i].ptr_kind] : "?",
+				    buffer[i].ptr_tid, buffer[i].ptr_transition, buffer[i].ptr_block,
+				    (uintmax_t)buffer[i].ptr_mark);
+		}
+		fflush(out);
+		if (single)
+			break;
+		usleep(interval * 1000);
+	}
+
+	fprintf(stderr, "petri_tracedump: %ju records, %ju lost\n", (uintmax_t)written, (uintmax_t)lost);
+
+	return (0);
+}
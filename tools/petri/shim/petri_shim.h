@@ -0,0 +1,307 @@
+/*
+ * Minimal stand-ins for the kernel interfaces used by the Petri net engine
+ * (petri_global_net.c and sched_petri.c), so it can be built and measured
+ * as a regular userspace program.
+ */
+
+#ifndef PETRI_SHIM_H
+#define PETRI_SHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#ifndef __inline
+#define __inline	inline
+#endif
+#ifndef __aligned
+#define __aligned(x)	__attribute__((__aligned__(x)))
+#endif
+#ifndef __unused
+#define __unused	__attribute__((__unused__))
+#endif
+#ifndef __predict_true
+#define __predict_true(exp)	__builtin_expect((exp), 1)
+#define __predict_false(exp)	__builtin_expect((exp), 0)
+#endif
+
+/* sys/systm.h */
+#define CTASSERT(x)	_Static_assert(x, "compile-time assertion failed")
+
+#define MAXCPU		1024
+#define NOCPU		(-1)
+#define CACHE_LINE_SIZE	64
+
+/* sys/param.h */
+#ifndef roundup2
+#define roundup2(x, y)	(((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+#ifndef nitems
+#define nitems(x)	(sizeof((x)) / sizeof((x)[0]))
+#endif
+#ifndef MIN
+#define MIN(a, b)	(((a) < (b)) ? (a) : (b))
+#define MAX(a, b)	(((a) > (b)) ? (a) : (b))
+#endif
+
+/* sys/systm.h */
+void	petri_shim_panic(const char *fmt, ...);
+
+static inline size_t
+petri_shim_strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size != 0) {
+		memcpy(dst, src, MIN(len, size - 1));
+		dst[MIN(len, size - 1)] = '\0';
+	}
+	return (len);
+}
+
+#define strlcpy		petri_shim_strlcpy
+
+#ifdef INVARIANTS
+#define KASSERT(exp, msg)	do {					\
+	if (__predict_false(!(exp)))					\
+		petri_shim_panic msg;					\
+} while (0)
+#else
+#define KASSERT(exp, msg)	do { } while (0)
+#endif
+
+/* machine/atomic.h */
+#define atomic_load_64(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_load_acq_64(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_rel_64(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_thread_fence_acq()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define atomic_thread_fence_rel()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define atomic_add_int(p, v)	((void)__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST))
+
+static inline int
+atomic_fcmpset_64(volatile uint64_t *p, uint64_t *cmpval, uint64_t newval)
+{
+
+	return (__atomic_compare_exchange_n(p, cmpval, newval, false,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+static inline int
+atomic_cmpset_int(volatile u_int *p, u_int cmpval, u_int newval)
+{
+
+	return (__atomic_compare_exchange_n(p, &cmpval, newval, false,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+/* sys/malloc.h */
+#define M_DEVBUF	NULL
+#define M_NOWAIT	0x0001
+#define M_WAITOK	0x0002
+#define M_ZERO		0x0100
+
+void	*petri_shim_malloc(size_t size, int flags);
+void	*petri_shim_malloc_aligned(size_t size, size_t align, int flags);
+void	 petri_shim_free(void *ptr);
+
+#define malloc(size, type, flags)	petri_shim_malloc((size), (flags))
+#define malloc_aligned(size, align, type, flags)			\
+	petri_shim_malloc_aligned((size), (align), (flags))
+#define free(ptr, type)			petri_shim_free((ptr))
+
+/* sys/syslog.h */
+#define LOG_KERN	(0<<3)
+#define LOG_LOCAL0	(16<<3)
+#define LOG_LOCAL1	(17<<3)
+#define LOG_LOCAL2	(18<<3)
+#define LOG_ERR		3
+#define LOG_WARNING	4
+#define LOG_INFO	6
+
+extern int petri_shim_log_enabled;
+
+void	petri_shim_log(int level, const char *fmt, ...);
+
+#define log	petri_shim_log
+
+/* sys/sysctl.h */
+#define SYSCTL_STRING(...)	extern int petri_shim_sysctl_unused
+#define SYSCTL_INT(...)		extern int petri_shim_sysctl_unused
+
+/* sys/cpuset.h */
+#define CPU_SETSIZE	MAXCPU
+#define _CPUSET_BITS	(sizeof(long) * 8)
+#define _CPUSET_WORDS	(CPU_SETSIZE / _CPUSET_BITS)
+
+typedef struct _cpuset {
+	long	__bits[_CPUSET_WORDS];
+} cpuset_t;
+
+#define CPU_ZERO(p)		memset((p), 0, sizeof(cpuset_t))
+#define CPU_FILL(p)		memset((p), 0xff, sizeof(cpuset_t))
+#define CPU_SET(n, p)		((p)->__bits[(n) / _CPUSET_BITS] |= (1L << ((n) % _CPUSET_BITS)))
+#define CPU_CLR(n, p)		((p)->__bits[(n) / _CPUSET_BITS] &= ~(1L << ((n) % _CPUSET_BITS)))
+#define CPU_ISSET(n, p)		(((p)->__bits[(n) / _CPUSET_BITS] & (1L << ((n) % _CPUSET_BITS))) != 0)
+#define CPU_COPY(f, t)		(*(t) = *(f))
+#define CPU_SET_ATOMIC(n, p)	__atomic_fetch_or(&(p)->__bits[(n) / _CPUSET_BITS], \
+	(1L << ((n) % _CPUSET_BITS)), __ATOMIC_SEQ_CST)
+#define CPU_CLR_ATOMIC(n, p)	__atomic_fetch_and(&(p)->__bits[(n) / _CPUSET_BITS], \
+	~(1L << ((n) % _CPUSET_BITS)), __ATOMIC_SEQ_CST)
+#define CPU_AND(d, s1, s2)	do {					\
+	for (size_t __i = 0; __i < _CPUSET_WORDS; __i++)		\
+		(d)->__bits[__i] = (s1)->__bits[__i] & (s2)->__bits[__i]; \
+} while (0)
+#define CPU_ANDNOT(d, s1, s2)	do {					\
+	for (size_t __i = 0; __i < _CPUSET_WORDS; __i++)		\
+		(d)->__bits[__i] = (s1)->__bits[__i] & ~(s2)->__bits[__i]; \
+} while (0)
+#define CPU_EMPTY(p)		(petri_shim_cpuset_ffs((p)) == 0)
+#define CPU_FFS(p)		petri_shim_cpuset_ffs((p))
+#define BIT_FFS_AT(s, p, start)	petri_shim_cpuset_ffs_at((p), (start))
+
+struct cpuset {
+	cpuset_t	cs_mask;
+};
+
+static inline int
+petri_shim_cpuset_ffs(const cpuset_t *p)
+{
+
+	for (size_t i = 0; i < _CPUSET_WORDS; i++)
+		if (p->__bits[i] != 0)
+			return (i * _CPUSET_BITS + __builtin_ctzl(p->__bits[i]) + 1);
+	return (0);
+}
+
+static inline int
+petri_shim_cpuset_ffs_at(const cpuset_t *p, int start)
+{
+	size_t i = start / _CPUSET_BITS;
+	long word;
+
+	if (start < 0 || start >= CPU_SETSIZE)
+		return (0);
+	word = p->__bits[i] & (~0UL << (start % _CPUSET_BITS));
+	for (;;) {
+		if (word != 0)
+			return (i * _CPUSET_BITS + __builtin_ctzl(word) + 1);
+		if (++i == _CPUSET_WORDS)
+			return (0);
+		word = p->__bits[i];
+	}
+}
+
+/* sys/proc.h, thread net definitions must match patches/sys/sys/proc.h.patch */
+#define THREADS_PLACES_SIZE 5
+#define PLACE_INACTIVE 		0
+#define PLACE_CAN_RUN 		1
+#define PLACE_CPU_RUN_QUEUE 2
+#define PLACE_RUNNING 		3
+#define PLACE_INHIBITED 	4
+
+#define THREADS_TRANSITIONS_SIZE 7
+#define TRAN_INIT 				 0
+#define TRAN_ON_QUEUE 			 1
+#define TRAN_SET_RUNNING 		 2
+#define TRAN_SWITCH_OUT 		 3
+#define TRAN_TO_WAIT_CHANNEL 	 4
+#define TRAN_WAKEUP 			 5
+#define TRAN_REMOVE 			 6
+
+#define TD_PETRI_PLACE_MASK		0x07
+#define TD_PETRI_FROMINH		0x80
+
+#define SW_VOL		0x0100
+#define SW_INVOL	0x0200
+
+typedef int32_t	lwpid_t;
+
+struct proc {
+	pid_t		p_pid;
+	char		p_comm[20];
+};
+
+struct thread {
+	lwpid_t		td_tid;
+	u_char		td_petri_state;
+	struct proc	*td_proc;
+	struct cpuset	*td_cpuset;
+	int		td_lastcpu;
+	int		td_oncpu;
+	lwpid_t		td_petri_waker;
+	int		td_petri_wakecpu;
+	u_char		td_petri_wakes;
+};
+
+extern struct thread *curthread;
+
+/* sys/smp.h, sys/pcpu.h */
+struct petri_shim_pcpu {
+	int	pc_cpuid;
+};
+
+extern int mp_ncpus;
+extern volatile int smp_started;
+
+/* sys/kernel.h, hardclock ticks, set by the programs that keep a clock */
+extern volatile int ticks;
+extern struct petri_shim_pcpu petri_shim_pcpu;
+
+#define PCPU_GET(member)	(petri_shim_pcpu.pc_ ## member)
+#define curcpu			PCPU_GET(cpuid)
+#define DPCPU_DEFINE_STATIC(t, n)	static t petri_shim_dpcpu_##n
+#define DPCPU_GET(n)		(petri_shim_dpcpu_##n)
+#define DPCPU_SET(n, v)		(petri_shim_dpcpu_##n = (v))
+
+/* a single thread per cpu, nothing to disable */
+#define critical_enter()	do { } while (0)
+#define critical_exit()		do { } while (0)
+#define spinlock_enter()	do { } while (0)
+#define spinlock_exit()		do { } while (0)
+#define PETRI_NET_ASSERT_READER()	do { } while (0)
+
+/*
+ * sys/smp.h cache sharing topology. smp_topo() builds a tree of mp_ncpus
+ * cpus from the shape set with petri_shim_topology(): sockets (NUMA
+ * nodes) of llcs groups sharing an L3, each of cores cores of smt threads.
+ * Without it every cpu is in a single group
+ */
+#define CG_SHARE_NONE	0
+#define CG_SHARE_L1	1
+#define CG_SHARE_L2	2
+#define CG_SHARE_L3	3
+
+#define CG_FLAG_HTT	0x01
+#define CG_FLAG_SMT	0x02
+#define CG_FLAG_THREAD	(CG_FLAG_HTT | CG_FLAG_SMT)
+#define CG_FLAG_NOSHARE	0x04
+#define CG_FLAG_NODE	0x08
+
+struct cpu_group {
+	struct cpu_group *cg_parent;
+	struct cpu_group *cg_child;
+	cpuset_t	cg_mask;
+	int32_t		cg_count;
+	int32_t		cg_first;
+	int32_t		cg_last;
+	int16_t		cg_children;
+	int8_t		cg_level;
+	int8_t		cg_flags;
+};
+
+struct cpu_group *smp_topo(void);
+void	petri_shim_topology(int smt, int cores, int llcs);
+int	petri_shim_topology_socket(int cpu);
+
+uint64_t	petri_shim_cpu_ticks(void);
+
+#define cpu_ticks		petri_shim_cpu_ticks
+#define CPU_FOREACH(i)		for ((i) = 0; (i) < mp_ncpus; (i)++)
+
+#endif
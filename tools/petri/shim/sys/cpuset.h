@@ -0,0 +1 @@
+#include <petri_shim.h>